@@ -3,31 +3,19 @@
 #include <time.h>
 #include <fcntl.h>
 
-#define nonblocking(fn, result, sock, buf, len) \
-	do { \
-		long flags = fcntl (sock, F_GETFL); \
-		if (flags == -1) \
-			fatal ("Getting flags for socket failed: %s", \
-			        xstrerror (errno)); \
-		flags |= O_NONBLOCK; \
-		if (fcntl (sock, F_SETFL, O_NONBLOCK) == -1) \
-			fatal ("Setting O_NONBLOCK for the socket failed: %s", \
-			        xstrerror (errno)); \
-		result = ::fn (sock, buf, len, 0); \
-		flags &= ~O_NONBLOCK; \
-		if (fcntl (sock, F_SETFL, flags) == -1) \
-			fatal ("Restoring flags for socket failed: %s", \
-			        xstrerror (errno)); \
-	} while (0)
-
 void Socket::send(const void *data, size_t n)
 {
 	SOCKET_DEBUG("Socketsend: %d %s", (int)n, buffering ? "-> buffer" : "");
 	if (buffering)
 	{
 		buf.insert(buf.end(), (char*)data, (char*)data+n);
+		return;
 	}
-	else while (n)
+
+	// don't cut into a queued packet
+	if (sent > done) send_partial();
+
+	while (n)
 	{
 		ssize_t res = ::send(s, data, n, 0);
 		if (res <= 0) 
@@ -40,25 +28,56 @@ void Socket::send(const void *data, size_t n)
 	}
 }
 
-void Socket::read(void *data, size_t n)
+/* How much recv() asks for at a time */
+#define RECV_CHUNK	65536
+
+bool Socket::fill(bool block)
 {
-	SOCKET_DEBUG("Socketread: %d", n);
-	while (n)
+	if (in_pos == in.size())
+	{
+		in.clear(); in_pos = 0;
+	}
+	else if (in_pos >= RECV_CHUNK)
+	{
+		in.erase(in.begin(), in.begin() + in_pos);
+		in_pos = 0;
+	}
+
+	size_t n0 = in.size();
+	in.resize(n0 + RECV_CHUNK);
+	while (true)
 	{
-		ssize_t res = recv (s, data, n, 0);
-		SOCKET_DEBUG("Socketread: %d -- %d", n, (int)res);
+		ssize_t res = recv (s, in.data() + n0, RECV_CHUNK, block ? 0 : MSG_DONTWAIT);
+		SOCKET_DEBUG("Socketread: %d", (int)res);
+		if (res > 0)
+		{
+			in.resize(n0 + res);
+			return true;
+		}
+		in.resize(n0);
+		if (res < 0 && errno == EINTR) continue;
+		if (res < 0 && !block && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return false;
 		if (res < 0)
 		{
 			log_errno ("Socket recv() failed", errno);
 			throw std::runtime_error("Socket recv() failed!");
 		}
-		if (res == 0)
-		{
-			log_errno ("Unexpected EOF from socket recv()!", errno);
-			throw std::runtime_error("Unexpected EOF from socket recv()!");
-		}
-		n -= res;
-		(char*&)data += res;
+		logit ("Unexpected EOF from socket recv()!");
+		throw std::runtime_error("Unexpected EOF from socket recv()!");
+	}
+}
+
+void Socket::read(void *data, size_t n)
+{
+	while (n)
+	{
+		if (!buffered()) fill(true);
+		size_t k = std::min(n, buffered());
+		memcpy(data, in.data() + in_pos, k);
+		in_pos += k;
+		n -= k;
+		(char*&)data += k;
 	}
 }
 
@@ -77,19 +96,82 @@ void Socket::flush()
 	buf.clear();
 }
 
-bool Socket::get_int_noblock (int &i)
+/* Playlists are sent as the number of items, then for each item: how
+ * many bytes of its path are the same as in the one before, the rest of
+ * the path, its type and mtime. Paths in a playlist mostly share long
+ * directory prefixes, and with the type the receiver doesn't need to
+ * stat() every file. */
+void Socket::send(const plist &pl, size_t i, size_t j)
 {
-	ssize_t res;
-	nonblocking (recv, res, s, &i, sizeof (int));
+	assert(i <= j && j <= pl.size());
+	send((uint32_t)(j - i));
+	const str *prev = NULL;
+	for (; i < j; ++i)
+	{
+		const plist_item &it = pl[i];
+		size_t k = 0;
+		if (prev)
+		{
+			size_t n = std::min(std::min(prev->length(), it.path.length()), (size_t)UINT16_MAX);
+			while (k < n && (*prev)[k] == it.path[k]) ++k;
+		}
+		send((uint16_t)k);
+		send((uint32_t)(it.path.length() - k));
+		send(it.path.data() + k, it.path.length() - k);
+		send((uint8_t)it.type);
+		send((int64_t)it.mtime);
+		prev = &it.path;
+	}
+}
 
-	if (res == ssizeof (int)) return true;
-	if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+void Socket::get(plist &pl)
+{
+	uint32_t n; get(n);
+	plist tmp;
+	tmp.items.reserve(std::min(n, (uint32_t)65536));
+	str path;
+	for (uint32_t i = 0; i < n; ++i)
+	{
+		uint16_t k; uint32_t m; uint8_t t; int64_t mtime;
+		get(k); get(m);
+		if (k > path.length() || m > 65536)
+			throw std::runtime_error("Bad playlist data!");
+		path.resize(k + m);
+		read(&path[k], m);
+		get(t); get(mtime);
+		if (path.empty() || path[0] != '/' || t > F_PLAYLIST)
+			throw std::runtime_error("Bad playlist data!");
+		tmp.items.emplace_back(new plist_item(path, (file_type)t, (time_t)mtime));
+	}
+	pl.clear();
+	pl += std::move(tmp);
+}
+
+int Socket::get_event()
+{
+	int type = get_int();
+	if (framed(type)) { uint32_t n; get(n); }
+	return type;
+}
 
-	char *err = xstrerror (errno);
-	logit ("recv() failed when getting int (res %zd): %s", res, err);
-	str msg = format("recv() failed when getting int (res %zd): %s", res, err ? err : "");
-	free (err);
-	throw std::runtime_error(msg);
+bool Socket::event_ready() const
+{
+	const size_t k = buffered();
+	int type; uint32_t n;
+	if (k < sizeof(type)) return false;
+	memcpy(&type, in.data() + in_pos, sizeof(type));
+	if (!framed(type)) return true;
+	if (k < sizeof(type) + sizeof(n)) return false;
+	memcpy(&n, in.data() + in_pos + sizeof(type), sizeof(n));
+	return k >= sizeof(type) + sizeof(n) + n;
+}
+
+bool Socket::get_event_noblock (int &type)
+{
+	while (!event_ready())
+		if (!fill(false)) return false;
+	type = get_event();
+	return true;
 }
 
 void Socket::send(const file_tags *tags)
@@ -217,36 +299,145 @@ std::set<str> Socket::get_str_set()
 	}
 	return ret;
 }
+void Socket::send(const strings &v)
+{
+	BufferGuard G(*this);
+	for (auto &s : v) { assert(!s.empty()); send(s); }
+	send("");
+	G.done();
+}
+strings Socket::get_strings()
+{
+	strings ret;
+	while (true)
+	{
+		str s = get_str(); if (s.empty()) break;
+		ret.push_back(std::move(s));
+	}
+	return ret;
+}
 
 
-/* Send the first event from the queue and remove it on success.  If the
- * operation would block return NB_IO_BLOCK.  Return NB_IO_ERR on error
- * or NB_IO_OK on success. */
-bool Socket::send_next_packet_noblock()
+/* These carry nothing but the current value of something, so a newer one
+ * can replace one that is still queued (and last in the queue). */
+static bool coalescable (int type)
 {
-	if (packets.empty()) return false;
-	const std::vector<char> &d = packets.front();
+	switch (type)
+	{
+		case EV_CTIME:
+		case EV_BITRATE:
+		case EV_AVG_BITRATE:
+		case EV_RATE:
+		case EV_CHANNELS:
+		case EV_OPTIONS:
+		case EV_MIXER_VALUE:
+			return true;
+		default:
+			return false;
+	}
+}
 
-	SOCKET_DEBUG("sending packet %X (%d)", *(int*)d.data(), (int)d.size());
+void Socket::finish()
+{
+	assert(buffering == 1);
+	buffering = 0;
+	if (buf.empty()) return;
 
-	/* We must do it in one send() call to be able to handle blocking. */
-	ssize_t res;
-	nonblocking(send, res, s, d.data(), d.size());
+	uint32_t len = buf.size() - sizeof(int) - sizeof(len);
+	memcpy(buf.data() + sizeof(int), &len, sizeof(len));
 
-	if (res == (ssize_t)d.size())
+	const int type = *(const int*)buf.data();
+	if (coalescable(type))
 	{
-		packets.pop();
+		auto i = latest.find(type);
+		if (i != latest.end() && i->second.first >= sent && i->second.second == buf.size()
+		    && i->second.first + i->second.second == out.size())
+		{
+			// overwrite the old one, nothing of it was sent yet. Only if
+			// it is the last one, or the new value would overtake what was
+			// queued after the old one (EV_STATE has the time too).
+			memcpy(out.data() + i->second.first, buf.data(), buf.size());
+			buf.clear();
+			SOCKET_DEBUG(">>> buffering done (replaced %X)", type);
+			return;
+		}
+		latest[type] = std::make_pair(out.size(), buf.size());
+	}
+
+	out.insert(out.end(), buf.begin(), buf.end());
+	ends.push_back(out.size());
+	buf.clear();
+	SOCKET_DEBUG(">>> buffering done (#%d)", (int)ends.size());
+}
+
+/* Send as much of the queued packets as the socket takes, with one send()
+ * call if they fit. Returns true if everything went out. */
+bool Socket::send_pending_noblock()
+{
+	while (sent < out.size())
+	{
+		ssize_t res = ::send(s, out.data() + sent, out.size() - sent, MSG_DONTWAIT);
+		if (res < 0)
+		{
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				SOCKET_DEBUG("Sending events would block");
+				break;
+			}
+			char *err = xstrerror (errno);
+			logit ("send()ing events failed: %s", err);
+			free (err);
+			throw std::runtime_error("send_pending_noblock failed");
+		}
+		sent += res;
+	}
+
+	while (!ends.empty() && ends.front() <= sent)
+	{
+		done = ends.front();
+		ends.pop_front();
+	}
+
+	if (sent == out.size())
+	{
+		out.clear(); ends.clear(); latest.clear();
+		sent = done = 0;
 		return true;
 	}
 
-	if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	// drop the packets that were sent once they take up a lot of space
+	if (done >= 65536 && done * 2 >= out.size())
 	{
-		logit ("Sending event would block");
-		return false;
+		out.erase(out.begin(), out.begin() + done);
+		for (auto &e : ends) e -= done;
+		for (auto i = latest.begin(); i != latest.end(); )
+		{
+			if (i->second.first < done) i = latest.erase(i);
+			else { i->second.first -= done; ++i; }
+		}
+		sent -= done;
+		done = 0;
 	}
+	return false;
+}
 
-	char *err = xstrerror (errno);
-	logit ("send()ing event failed (%zd): %s", res, err);
-	free (err);
-	throw std::runtime_error("send_next_packet_noblock failed");
+/* Blocking send of the rest of the packet that is partially sent. */
+void Socket::send_partial()
+{
+	assert(!ends.empty() && sent > done && sent < ends.front());
+	size_t end = ends.front();
+	while (sent < end)
+	{
+		ssize_t res = ::send(s, out.data() + sent, end - sent, 0);
+		if (res < 0 && errno == EINTR) continue;
+		if (res <= 0)
+		{
+			log_errno ("Socket send() failed", errno);
+			throw std::runtime_error("Socket send() failed!");
+		}
+		sent += res;
+	}
+	done = end;
+	ends.pop_front();
 }
@@ -1,4 +1,5 @@
 #pragma once
+#include <deque>
 #include "playlist.h"
 #include "server/protocol.h"
 
@@ -12,14 +13,22 @@
 // Socket sends data between the client and server. Optionally
 // buffering many smaller pieces into one larger send() call.
 // It can also do packaging, which creates buffered chunks with
-// a header that get stored in a queue until they can be sent
-// without blocking (used by the server for almost everything
-// it sends to the clients).
+// a header that get queued until they can be sent without
+// blocking (used by the server for almost everything it sends
+// to the clients).
 //
 // Main pieces are:
 // - s: a socket handle
-// - buf: the buffer, which can be moved into...
-// - packets: the package queue
+// - buf: the buffer, which gets appended to...
+// - out: the queued packets, back to back, so that as many as
+//   the socket takes go out with one send()
+// - in: what was received but not read yet, recv() fills it in
+//   large chunks
+//
+// Packets are framed: after the type comes the length of the
+// rest, so that the receiver can tell when it has all of one
+// (event_ready()). Answers that are sent directly (EV_DATA,
+// EV_PONG, EV_EXIT, EV_BUSY) have no length.
 //
 // Errors either call fatal (if the option is set in c'tor) or
 // just return false. (TODO: should be exceptions instead).
@@ -28,7 +37,8 @@
 class Socket
 {
 public:
-	Socket(int sock) : s(sock), buffering(0) { assert(sock >= 0); }
+	Socket(int sock) : s(sock), buffering(0), sent(0), done(0), in_pos(0) { assert(sock >= 0); }
+	Socket(Socket &&) = default;
 
 	int fd() const { return s; }
 
@@ -39,21 +49,11 @@ public:
 	void packet(int type)
 	{
 		SOCKET_DEBUG(">>> packaging %X", type);
-		assert(!buffering); buffer(); send(type);
-	}
-	void finish()
-	{
-		assert(buffering == 1);
-		if (!buf.empty())
-		{
-			packets.emplace(std::move(buf));
-			buf.clear();
-		}
-		buffering = 0;
-		SOCKET_DEBUG(">>> buffering done (#%d)", (int)packets.size());
+		assert(!buffering && framed(type)); buffer(); send(type); send((uint32_t)0);
 	}
-	size_t pending() const { return packets.size(); }
-	bool send_next_packet_noblock(); // true:packet sent, false:would block or nothing to send
+	void finish(); // queue the packet
+	size_t pending() const { return out.size() - sent; } // bytes
+	bool send_pending_noblock(); // true: all sent, false: would block
 
 	template<typename T> void send(T* x) { send((const T*)x); }
 
@@ -68,7 +68,8 @@ public:
 		SOCKET_DEBUG(">>> sending \"%s\" %s", s ? s : "NULL", buffering ? " (B)" : "");
 		size_t n = s ? strlen(s) : 0; send(n); send(s, n); }
 	void send(const plist_item *i) { send(i ? i->path : str()); }
-	void send(const plist &pl) { for (auto &i : pl.items) send(i->path); send(""); }
+	void send(const plist &pl) { send(pl, 0, pl.size()); }
+	void send(const plist &pl, size_t i, size_t j); // items i..j-1
 	void send(const file_tags *tags);
 	void send(const tag_changes *tags);
 	void send(ServerCommands c) { send((int)c); }
@@ -77,6 +78,7 @@ public:
 	void send(const std::set<int>    &idx); std::set<int>     get_idx_set();
 	void send(const std::map<int,str> &ch); std::map<int,str> get_int_map();
 	void send(const std::set<str>    &idx); std::set<str>     get_str_set();
+	void send(const strings          &v);   strings           get_strings();
 	void send(const std::map<str,str> &ch); std::map<str,str> get_str_map();
 
 	template<typename T> void get(T &x) {
@@ -90,35 +92,38 @@ public:
 		x.resize(n); read(&x[0], n);
 		SOCKET_DEBUG("<<< getting \"%s\"", x.c_str());
 	}
-	void get(plist &plist)
-	{
-		strings S;
-		while (true) {
-			str s; get(s);
-			if (s.empty()) break;
-			S.push_back(std::move(s));
-		}
-		plist.clear();
-		for (auto &s : S) plist += std::move(s);
-	}
+	void get(plist &pl);
 	int  get_int()  { int  x; get(x); return x; }
 	bool get_bool() { bool x; get(x); return x; }
 	str  get_str()  { str  x; get(x); return x; }
 	file_tags *get_tags();
 	tag_changes *get_tag_changes();
 
-	bool get_int_noblock (int &i);
+	int  get_event(); // type of the next event or answer
+	bool get_event_noblock(int &type); // false if not all of it is here yet
+	bool event_ready() const; // has all of the next event been received?
+	size_t buffered() const { return in.size() - in_pos; }
 
 private:
 	void send(const void *data, size_t n);
 	void read(void *data, size_t n);
+	bool fill(bool block); // recv() more into in, false if that would block
+
+	static bool framed(int type) { return type != EV_DATA && type != EV_PONG && type != EV_EXIT && type != EV_BUSY; }
 
 	int  s; // the actual socket handle
 
 	int  buffering;
 	std::vector<char> buf;
-	
-	std::queue<std::vector<char>> packets;
+
+	std::vector<char> out; // queued packets, out[sent..] is not sent yet
+	size_t sent, done; // done: where the last completely sent packet ends
+	std::deque<size_t> ends; // where the packets in out end
+	std::map<int, std::pair<size_t, size_t>> latest; // type -> (start, size) of the last queued one, see finish()
+	void send_partial(); // finish sending a packet that went out only in part
+
+	std::vector<char> in; // in[in_pos..] was received, but not read yet
+	size_t in_pos;
 
 	struct BufferGuard
 	{
@@ -36,14 +36,41 @@ public:
 		srv.send(CMD_GET_FILE_TAGS);
 		srv.send(path);
 	}
-	void request(const plist &plist, Socket &srv)
+	void request(const plist &plist, Socket &srv, int first = 0) // sends one batch request, starting at item first
 	{
-		for (auto &i : plist.items)
+		std::vector<const plist_item*> todo;
+		const size_t n = plist.items.size();
+		for (size_t k = 0; k < n; ++k)
 		{
+			auto &i = plist.items[(first + k) % n];
 			connect(*i);
 			if (i->tags || i->type != F_SOUND) continue;
-			request(i->path, srv);
+			if (requests.count(i->path) || tags.count(i->path)) continue;
+			requests.insert(i->path);
+			todo.push_back(i.get());
 		}
+		if (todo.empty()) return;
+		srv.buffer();
+		srv.send(CMD_GET_FILE_TAGS_BATCH);
+		for (auto *i : todo) { srv.send(i->path); srv.send((int64_t)i->mtime); }
+		srv.send("");
+		srv.flush();
+	}
+	void refresh(const strings &paths, Socket &srv) // these changed, ask again
+	{
+		strings todo;
+		for (auto &p : paths)
+		{
+			if (!tags.count(p)) continue; // the others get requested as usual
+			requests.insert(p);
+			todo.push_back(p);
+		}
+		if (todo.empty()) return;
+		srv.buffer();
+		srv.send(CMD_GET_FILE_TAGS_BATCH);
+		for (auto &p : todo) { srv.send(p); srv.send((int64_t)-1); }
+		srv.send("");
+		srv.flush();
 	}
 
 	void update(const str &path, std::unique_ptr<file_tags> &&tag)
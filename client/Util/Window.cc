@@ -35,7 +35,7 @@ static void init_lines()
 	}
 }
 
-static str iconv_str(const iconv_t desc, const str &input)
+str Window::iconv_str(const iconv_t desc, const str &input)
 {
 	if (input.empty() || desc == (iconv_t)-1) return input;
 
@@ -182,8 +182,11 @@ void Window::frame(const Rect &r, const str &title, int title_space, bool draw_b
 
 void Window::sanitize_path(str &s)
 {
+	if (str *r = paths.find(s)) { s = *r; return; }
+	str k = s;
 	sanitize(s);
 	if (options::FileNamesIconv) s = iconv_str(files_iconv_desc, s);
+	paths.add(k, str(s));
 }
 
 static str time_str(int sec)
@@ -223,34 +226,54 @@ void Window::put(const str &s)
 	waddstr(win, using_utf8 ? s.c_str() : iconv_str(term_iconv_desc, s).c_str());
 }
 
+Window::Cell &Window::cell(const str &s)
+{
+	if (Cell *c = cells.find(s)) return *c;
+	Cell c;
+	c.width = strwidth(s);
+	c.out = term(s);
+	c.cut_w = -1; c.cut_fmt = 0;
+	return cells.add(s, std::move(c));
+}
+
 void Window::field(const str &s, int W, char fmt)
 {
-	int w = strwidth(s);
+	Cell &c = cell(s);
+	int w = c.width;
 	if (w <= W)
 	{
 		if (fmt == 'R')
 		{
 			while (w++ < W) waddch (win, ' ');
-			put(s);
+			waddstr(win, c.out.c_str());
 		}
 		else if (fmt == 'C')
 		{
 			int k = W-w;
 			for (int i = 0; i < k/2; ++i) waddch (win, ' ');
-			put(s);
+			waddstr(win, c.out.c_str());
 			for (int i = k/2; i < k; ++i) waddch (win, ' ');
 		}
 		else
 		{
-			put(s);
+			waddstr(win, c.out.c_str());
 			while (w++ < W) waddch (win, ' ');
 		}
 		return;
 	}
+
+	if (c.cut_w == W && c.cut_fmt == fmt)
+	{
+		waddstr(win, c.cut.c_str());
+		return;
+	}
 	
+	str &t = c.cut; t.clear();
+	c.cut_w = W; c.cut_fmt = fmt;
 	if (W < 3)
 	{
-		put(strhead(s, W));
+		t = term(strhead(s, W));
+		waddstr(win, t.c_str());
 		return;
 	}
 
@@ -258,24 +281,19 @@ void Window::field(const str &s, int W, char fmt)
 	{
 		case 'r':
 		case 'C':
-			put(strhead(s, W-3));
-			put_ascii("...");
+			t = term(strhead(s, W-3)) + "...";
 			break;
 		case 'l':
 		case 'R':
-		{
-			put_ascii("...");
-			put(strtail(s, W-3));
+			t = "..." + term(strtail(s, W-3));
 			break;
-		}
 		case 'c':
 		{
 			int l = (W-3)/2;
-			put(strhead(s, l));
-			put_ascii("...");
-			put(strtail(s, W-3-l));
+			t = term(strhead(s, l)) + "..." + term(strtail(s, W-3-l));
 			break;
 		}
 		default: assert(false);
 	}
+	waddstr(win, t.c_str());
 }
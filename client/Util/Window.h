@@ -3,6 +3,7 @@
 #include <wctype.h>
 #include <wchar.h>
 #include <iconv.h>
+#include <unordered_map>
 #include "Rect.h"
 #include "themes.h"
 #include "utf8.h"
@@ -66,6 +67,42 @@ public:
 	static chtype ttee;	// top tee: T
 
 private:
+	// Cache for field() and sanitize_path(), so that redrawing the same
+	// strings mostly skips the wide char and iconv conversions. Anything
+	// not drawn during the last generation (CACHE_SIZE new strings) is
+	// dropped.
+	template<typename V> struct Cache
+	{
+		std::unordered_map<str, V> cur, old;
+		V *find(const str &s)
+		{
+			auto i = cur.find(s); if (i != cur.end()) return &i->second;
+			auto j = old.find(s); if (j == old.end()) return NULL;
+			V &v = cur[s] = std::move(j->second);
+			old.erase(j);
+			return &v;
+		}
+		V &add(const str &s, V &&v)
+		{
+			if (cur.size() >= CACHE_SIZE) { old.clear(); old.swap(cur); }
+			return cur[s] = std::move(v);
+		}
+		void clear() { cur.clear(); old.clear(); }
+	};
+	static constexpr size_t CACHE_SIZE = 2048;
+	struct Cell
+	{
+		int  width; // of s in columns
+		str  out;   // s for the terminal
+		int  cut_w; char cut_fmt; // last truncation that was needed, -1 if none
+		str  cut;   // its output, with the "..."
+	};
+	Cache<Cell> cells;
+	Cache<str>  paths; // sanitize_path() results
+	Cell &cell(const str &s);
+	str  term(const str &s) const { return using_utf8 ? s : iconv_str(term_iconv_desc, s); }
+	static str iconv_str(const iconv_t desc, const str &input);
+
 	WINDOW *win;
 	bool    using_utf8;       // terminal is UTF-8 and term_iconv_desc is not needed?
 	iconv_t term_iconv_desc;  // from UTF-8 to terminal
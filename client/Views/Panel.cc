@@ -168,18 +168,158 @@ bool Panel::handle_click(int x, int y, bool dbl)
 	return true;
 }
 
-void Panel::draw() const
+//---------------------------------------------------------------
+// ColumnStats
+//---------------------------------------------------------------
+
+static void count(std::map<int, int> &m, int k, int d)
 {
-	auto &win = iface.win;
+	if ((m[k] += d) <= 0) m.erase(k);
+}
+static void count(std::unordered_map<str, int> &m, const str &k, int d)
+{
+	if ((m[k] += d) <= 0) m.erase(k);
+}
+
+void ColumnStats::clear()
+{
+	rows.clear(); by_path.clear(); dirty.clear();
+	for (auto &c : widths) c.clear();
+	tracks.clear(); artists.clear(); albums.clear();
+	n_tagged = n_untagged = 0;
+	synced = false;
+}
+
+void ColumnStats::read_tags(Row &r, const Client &client)
+{
+	r.tagged = false;
+	if (!with_tags || r.type != F_SOUND) return;
+
+	const plist_item &it = *r.item;
+	r.title = sanitized(client.get_title(it));
+	if (r.title.empty()) { ++n_untagged; return; }
+
+	r.tagged = true;
+	r.artist = sanitized(client.get_artist(it));
+	r.album  = sanitized(client.get_album(it));
+	r.track  = client.get_track(it);
+	r.w0 = (int)strwidth(r.artist);
+	r.w1 = (int)strwidth(r.album);
+	r.w2 = (int)strwidth(r.title);
+
+	++n_tagged;
+	count(widths[0], r.w0, 1);
+	count(widths[1], r.w1, 1);
+	count(widths[2], r.w2, 1);
+	count(tracks, r.track, 1);
+	count(artists, r.artist, 1);
+	count(albums, r.album, 1);
+}
+
+void ColumnStats::drop_tags(Row &r)
+{
+	if (!with_tags || r.type != F_SOUND) return;
+	if (!r.tagged) { --n_untagged; return; }
+
+	--n_tagged;
+	count(widths[0], r.w0, -1);
+	count(widths[1], r.w1, -1);
+	count(widths[2], r.w2, -1);
+	count(tracks, r.track, -1);
+	count(artists, r.artist, -1);
+	count(albums, r.album, -1);
+	r.tagged = false;
+	r.artist.clear(); r.album.clear(); r.title.clear();
+}
+
+void ColumnStats::add(const plist_item &it, const Client &client)
+{
+	Row &r = rows[it.id];
+	r.item = &it;
+	r.pos  = by_path.emplace(it.path, it.id);
+	r.type = it.type;
+	r.seen = stamp;
+	read_tags(r, client);
+}
+
+void ColumnStats::remove(std::unordered_map<uint64_t, Row>::iterator r)
+{
+	drop_tags(r->second);
+	by_path.erase(r->second.pos);
+	rows.erase(r);
+}
+
+void ColumnStats::sync(const plist &items, const Client &client)
+{
+	if (with_tags != options::ReadTags)
+	{
+		clear();
+		with_tags = options::ReadTags;
+	}
+
+	if (!synced || version != items.version)
+	{
+		// the items themselves changed: only new ones or ones with a
+		// new path or type are looked at closely
+		++stamp;
+		for (auto &ip : items.items)
+		{
+			const plist_item &it = *ip;
+			auto r = rows.find(it.id);
+			if (r != rows.end() && (r->second.pos->first != it.path || r->second.type != it.type))
+			{
+				remove(r); r = rows.end();
+			}
+			if (r == rows.end())
+				add(it, client);
+			else
+			{
+				r->second.item = &it;
+				r->second.seen = stamp;
+			}
+		}
+		if (rows.size() > items.size())
+		{
+			for (auto r = rows.begin(); r != rows.end(); )
+			{
+				if (r->second.seen == stamp) { ++r; continue; }
+				auto d = r++; remove(d);
+			}
+		}
+		version = items.version;
+		synced = true;
+	}
+
+	for (auto &p : dirty)
+	{
+		auto range = by_path.equal_range(p);
+		for (auto i = range.first; i != range.second; ++i)
+		{
+			Row &r = rows[i->second];
+			drop_tags(r);
+			read_tags(r, client);
+		}
+	}
+	dirty.clear();
+}
 
+str ColumnStats::common_prefix() const
+{
+	if (by_path.empty()) return str();
+	str s = by_path.begin()->first;
+	intersect(s, by_path.rbegin()->first);
+	return s;
+}
+
+//---------------------------------------------------------------
+// Panel
+//---------------------------------------------------------------
+
+void Panel::scroll_to_sel() const
+{
 	const int N = items.size();
 	const int lookahead = std::min(5, bounds.h/4);
-	
-	#ifndef NDEBUG
-	assert(layout.c0 < 0 || layout.rows == N);
-	layout.rows = N;
-	#endif
-	
+
 	if (sel < 0) xsel = 0;
 	if (sel < -1) sel = -1; if (mark < -1) mark = -1;
 	if (sel >= N) sel = std::max(0, N-1);
@@ -192,11 +332,27 @@ void Panel::draw() const
 
 	if (top + bounds.h > N) top = N-bounds.h;
 	if (top < 0) top = 0;
+}
+
+void Panel::draw() const
+{
+	auto &win = iface.win;
+
+	const int N = items.size();
+	
+	#ifndef NDEBUG
+	assert(layout.c0 < 0 || layout.rows == N);
+	layout.rows = N;
+	#endif
+	
+	scroll_to_sel();
 
 	bool have_up = items.is_dir && N && iface.client.cwd != "/";
 	str mhome = options::MusicDir; if (!mhome.empty()) mhome += '/'; if (mhome.length() < 2) mhome.clear();
 	str uhome = options::Home;     if (!uhome.empty()) uhome += '/'; if (uhome.length() < 2) uhome.clear();
 
+	stats.sync(items, iface.client); // cheap if nothing changed
+
 	if (layout.c0 < 0)
 	{
 		// gather layout data: widths for three columns (artist, album, title)
@@ -210,66 +366,20 @@ void Panel::draw() const
 		int n_tagged = 0;
 		if (layout.readtags)
 		{
-			bool first = true, first_tagged = true;
-			str common_artist, common_album; // of all sound files (empty if any have no tags)
-
-			for (const auto &ip : items.items)
-			{
-				const auto &it = *ip;
-				if (first) { first = false; if (have_up) continue; } // should not have tags anyway...
-
-				if (it.type != F_SOUND) continue;
-				
-				str title = sanitized(iface.client.get_title(it));
-				if (title.empty())
-				{
-					first_tagged = false;
-					common_artist.clear();
-					common_album.clear();
-					continue;
-				}
-
-				++n_tagged;
-				str v0 = sanitized(iface.client.get_artist(it));
-				str v1 = sanitized(iface.client.get_album(it));
-				if (first_tagged)
-				{
-					common_artist = v0;
-					common_album  = v1;
-					first_tagged  = false;
-				}
-				else
-				{
-					if (v0 != common_artist) common_artist.clear();
-					if (v1 != common_album) common_album.clear();
-				}
-				M  = std::max(M,  iface.client.get_track(it));
-				c0 = std::max(c0, (int)strwidth(v0));
-				c1 = std::max(c1, (int)strwidth(v1));
-				c2 = std::max(c2, (int)strwidth(title));
-			}
-			all_same_artist = !common_artist.empty();
-			all_same_album  = !common_album.empty();
+			M  = stats.max_track();
+			c0 = stats.max_width(0);
+			c1 = stats.max_width(1);
+			c2 = stats.max_width(2);
+			n_tagged = stats.tagged();
+			all_same_artist = stats.same_artist();
+			all_same_album  = stats.same_album();
 		}
 
 		layout.prefix_len = 0; // how much to cut off from file paths
 		if (!items.is_dir)
 		{
-			bool first = true;
-			str common_prefix; // of all paths (even those with tags!)
-			for (const auto &ip : items.items)
-			{
-				const auto &it = *ip;
-				if (first)
-				{
-					common_prefix = it.path;
-					first = false;
-				}
-				else
-				{
-					intersect(common_prefix, it.path);
-				}
-			}
+			// the common prefix of all paths (even those with tags!)
+			str common_prefix = stats.common_prefix();
 			layout.prefix_len = (int)common_prefix.length();
 			while (layout.prefix_len > 0 && common_prefix[layout.prefix_len-1] != '/') --layout.prefix_len;
 			if (layout.prefix_len == 1) layout.prefix_len = 0;
@@ -419,27 +529,27 @@ void Panel::draw() const
 		win.color(file_color);
 		win.moveto(y, x0);
 
-		str title = (!is_up_dir && layout.readtags && it.type == F_SOUND) ? sanitized(iface.client.get_title(it)) : str();
+		const ColumnStats::Row *row = (!is_up_dir && layout.readtags) ? stats.row(it) : NULL;
 
-		if (!title.empty())
+		if (row && row->tagged)
 		{
 			if (!layout.hide_artist)
 			{
-				win.field(sanitized(iface.client.get_artist(it)), c0);
+				win.field(row->artist, c0);
 				win.put_ascii("   ");
 			}
 			if (!layout.hide_album)
 			{
-				win.field(sanitized(iface.client.get_album(it)), c1);
+				win.field(row->album, c1);
 				win.put_ascii("   ");
 			}
 
 			if (items.is_dir)
 			{
-				int k = iface.client.get_track(it);
+				int k = row->track;
 				win.put_ascii(k > 0 ? format("%*d ", cn-1, k) : spaces(cn));
 			}
-			win.field(title, c2);
+			win.field(row->title, c2);
 		}
 		else if (is_up_dir && it.type == F_DIR)
 		{
@@ -21,6 +21,64 @@ enum menu_request
 };
 
 class Interface;
+class Client;
+
+//---------------------------------------------------------------
+// Display strings and column statistics for a Panel's items.
+// sync() only looks at items that were added or changed since
+// the last call and at the ones whose tags changed, so keeping
+// the layout current does not cost a pass over all the tags.
+//---------------------------------------------------------------
+
+class ColumnStats
+{
+public:
+	ColumnStats() : synced(false), with_tags(false), version(0), stamp(0), n_tagged(0), n_untagged(0) {}
+
+	struct Row
+	{
+		const plist_item *item;
+		std::multimap<str, uint64_t>::iterator pos; // in by_path
+		file_type type;
+		unsigned  seen;
+		bool      tagged; // sound file with a title
+		str       artist, album, title; // sanitized
+		int       w0, w1, w2, track;
+	};
+
+	void sync(const plist &items, const Client &client);
+	void tags_changed(const str &path) { if (by_path.count(path)) dirty.insert(path); }
+	const Row *row(const plist_item &it) const
+	{
+		auto i = rows.find(it.id);
+		return i == rows.end() ? NULL : &i->second;
+	}
+
+	int  max_width(int column) const { auto &c = widths[column]; return c.empty() ? 0 : c.rbegin()->first; }
+	int  max_track() const { return tracks.empty() ? 0 : tracks.rbegin()->first; }
+	int  tagged() const { return n_tagged; }
+	bool same_artist() const { return !n_untagged && artists.size() == 1 && !artists.begin()->first.empty(); }
+	bool same_album() const { return !n_untagged && albums.size() == 1 && !albums.begin()->first.empty(); }
+	str  common_prefix() const; // of all paths
+
+private:
+	std::unordered_map<uint64_t, Row> rows; // by item id
+	std::multimap<str, uint64_t> by_path; // sorted, which gives the common prefix
+	std::set<str> dirty; // paths with new tags
+	bool     synced, with_tags;
+	unsigned version, stamp;
+
+	// counts for the aggregates, so that they survive removals
+	std::map<int, int> widths[3], tracks;
+	std::unordered_map<str, int> artists, albums;
+	int n_tagged, n_untagged;
+
+	void clear();
+	void add(const plist_item &it, const Client &client);
+	void remove(std::unordered_map<uint64_t, Row>::iterator r);
+	void read_tags(Row &r, const Client &client);
+	void drop_tags(Row &r);
+};
 
 //---------------------------------------------------------------
 // Panel draws the playlist views and handles selection, current
@@ -39,6 +97,7 @@ struct Panel : public View
 	void set_active(bool a) { active = a; }
 	void draw() const override; // no frame, draws just the inside
 	void update_layout() { layout.c0 = -1; }
+	void tags_changed(const str &path) { stats.tags_changed(path); }
 
 	void move_selection(menu_request req);
 	bool handle_click(int x, int y, bool dbl) override;
@@ -48,6 +107,7 @@ struct Panel : public View
 	bool select_path(const str &f); // leave selection as is if not found
 	void select_item(int i);
 	bool item_visible (int i) const { return i >= top && i < top + bounds.h; };
+	void scroll_to_sel() const; // move top so that sel is visible, draw() does this too
 
 	Interface  &iface;
 	plist      &items;
@@ -67,4 +127,5 @@ struct Panel : public View
 		int rows;
 		#endif
 	} layout;
+	mutable ColumnStats stats;
 };
@@ -21,8 +21,8 @@ void interface_fatal (const char *format, ...)
 	fatal ("%s", msg.c_str());
 }
 
-Client::Client(int sock, strings &args)
-: srv(sock), synced(false)
+Client::Client(Socket &&sock, strings &args)
+: srv(std::move(sock)), synced(false)
 , iface(*this, dir_plist, playlist)
 , want_plist_update(false), want_state_update(false)
 , silent_seek_key_last(0.0), silent_seek_pos(-1)
@@ -40,8 +40,8 @@ Client::Client(int sock, strings &args)
 	{
 		srv.send(CMD_GET_MIXER_CHANNEL_NAME);
 		iface.info.update_mixer_name(get_data_str());
-		iface.info.update_mixer_value(get_mixer_value());
 	}
+	iface.info.update_mixer_value(get_mixer_value()); // then EV_MIXER_VALUE
 
 	xsignal(SIGQUIT,  sig_quit);
 	xsignal(SIGTERM,  sig_quit);
@@ -64,7 +64,7 @@ Client::Client(int sock, strings &args)
 		{
 			str p = absolute_path(arg);
 			if (is_dir (p.c_str()))
-				playlist.add_directory(p, true);
+				add_directory(playlist, p);
 			else if (is_plist_file(p.c_str())) {
 				plist tmp; tmp.load_m3u(p);
 				playlist += std::move(tmp);
@@ -113,9 +113,7 @@ Client::Client(int sock, strings &args)
 
 	if (want_sync)
 	{
-		srv.send(CMD_PLIST_GET);
-		wait_for_data();
-		srv.get(playlist);
+		get_plist();
 		synced = true;
 	}
 
@@ -127,7 +125,7 @@ Client::Client(int sock, strings &args)
 		if (idx >= 0) iface.select_song(idx);
 	}
 
-	if (options::ReadTags) tags.request(playlist, srv);
+	if (options::ReadTags) request_tags(playlist);
 }
 
 Client::~Client ()
@@ -148,7 +146,7 @@ void Client::wait_for_data ()
 {
 	SOCKET_DEBUG("waiting for data");
 	while (true) {
-		int event = srv.get_int();
+		int event = srv.get_event();
 		if (event == EV_DATA) break;
 		handle_server_event(event);
 		if (event == EV_EXIT) return;
@@ -156,6 +154,25 @@ void Client::wait_for_data ()
 	SOCKET_DEBUG("found EV_DATA");
 }
 
+/* Get the server's playlist. If playlist is unchanged since the last
+ * time, only what changed on the server since then is sent. */
+void Client::get_plist ()
+{
+	srv.send(CMD_PLIST_GET);
+	srv.send(playlist.version == plist_version ? plist_srv_version : 0);
+	wait_for_data();
+
+	uint32_t version, front, back; srv.get(version); srv.get(front); srv.get(back);
+	plist mid; srv.get(mid);
+	if (front + back > playlist.size())
+		interface_fatal ("Bad playlist diff from the server!");
+
+	playlist.remove(front, playlist.size() - front - back);
+	playlist.insert(std::move(mid), front);
+	plist_srv_version = version;
+	plist_version = playlist.version;
+}
+
 /* Make new cwd path from CWD and this path. */
 void Client::set_cwd(const str &path)
 {
@@ -163,21 +180,31 @@ void Client::set_cwd(const str &path)
 	normalize_path(cwd);
 }
 
-/* Get and show the server state. */
+/* Get and show the server state. Only needed at the start and after
+ * syncing, EV_STATE and the other events keep it current after that. */
 void Client::update_state ()
 {
 	want_state_update = false;
 
-	auto old_state = iface.info.get_state();
 	auto new_state = get_state ();
+	srv.send(CMD_GET_CURRENT);
+	wait_for_data(); int idx = srv.get_int(); str file = srv.get_str();
+	set_state(new_state, get_curr_time(), idx, file);
+
+	iface.info.update_channels(get_channels());
+	iface.info.update_bitrate(get_bitrate());
+	iface.info.update_rate(get_rate());
+}
+
+/* Show the state from update_state() or EV_STATE. */
+void Client::set_state (PlayState new_state, int ctime, int idx, const str &file)
+{
+	auto old_state = iface.info.get_state();
 	iface.info.update_state(new_state);
 
 	/* Silent seeking makes no sense if the state has changed. */
 	if (old_state != new_state) silent_seek_pos = -1;
 
-	srv.send(CMD_GET_CURRENT);
-	wait_for_data(); int idx = srv.get_int(); str file = srv.get_str();
-	
 	if (iface.update_curr_file(file, idx))
 	{
 		silent_seek_pos = -1;
@@ -185,10 +212,21 @@ void Client::update_state ()
 			tags.request(file, srv);
 	}
 
-	iface.info.update_channels(get_channels());
-	iface.info.update_bitrate(get_bitrate());
-	iface.info.update_rate(get_rate());
-	if (silent_seek_pos == -1) iface.info.update_curr_time(get_curr_time ());
+	if (silent_seek_pos == -1) iface.info.update_curr_time(ctime);
+}
+
+/* Ask for the missing tags in pl, starting with the rows on screen (the
+ * server reads them in the order they were asked for). */
+void Client::request_tags (const plist &pl)
+{
+	int first = 0;
+	for (Panel *p : {&iface.left, &iface.right})
+	{
+		if (&p->items != &pl || p->bounds.h <= 0) continue;
+		p->scroll_to_sel();
+		first = p->top;
+	}
+	tags.request(pl, srv, first);
 }
 
 bool Client::go_to_dir (const char *dir)
@@ -210,7 +248,12 @@ bool Client::go_to_dir (const char *dir)
 	/* TODO: use CMD_ABORT_TAGS_REQUESTS (what if we requested tags for the playlist?) */
 
 	if (dir) cwd = dir;
-	if (options::ReadTags) tags.request(dir_plist, srv);
+	if (cwd != watched_dir)
+	{
+		watched_dir = cwd;
+		srv.send(CMD_WATCH_DIR);
+		srv.send(cwd);
+	}
 	if (same)
 	{
 		left.top = top0;
@@ -221,6 +264,7 @@ bool Client::go_to_dir (const char *dir)
 		left.top = 0;
 		iface.select_path(last_dir);
 	}
+	if (options::ReadTags) request_tags(dir_plist);
 
 	iface.redraw(3);
 	iface.status ("");
@@ -243,7 +287,7 @@ bool Client::go_to_playlist (const str &file)
 
 	iface.message ("Playlist loaded.");
 	synced = false;
-	if (options::ReadTags) tags.request(playlist, srv);
+	if (options::ReadTags) request_tags(playlist);
 	iface.redraw(3);
 	return true;
 }
@@ -256,7 +300,27 @@ void Client::set_mixer (int val)
 }
 void Client::adjust_mixer (int diff)
 {
-	set_mixer (get_mixer_value() + diff);
+	set_mixer (iface.info.get_mixer_value() + diff);
+}
+
+/* Add all sound files below dir to pl, from the server's library if it
+ * has them or else by reading the directories. */
+void Client::add_directory (plist &pl, const str &dir)
+{
+	srv.send(CMD_LIBRARY_LIST);
+	srv.send(dir);
+	wait_for_data();
+
+	bool found = srv.get_bool();
+	plist tmp;
+	while (true)
+	{
+		str f = srv.get_str(); if (f.empty()) break;
+		int64_t mtime; srv.get(mtime);
+		tmp.items.emplace_back(new plist_item(f, F_SOUND, (time_t)mtime));
+	}
+	if (!found) { pl.add_directory(dir, true); return; }
+	pl += std::move(tmp);
 }
 
 /* Recursively add the content of a directory to the playlist. */
@@ -274,7 +338,7 @@ void Client::add_to_plist(bool at_end)
 		switch (item.type)
 		{
 			case F_SOUND: pl += item; break;
-			case F_DIR: pl.add_directory(item.path, true); break;
+			case F_DIR: add_directory(pl, item.path); break;
 			case F_PLAYLIST:
 			{
 				plist tmp;
@@ -305,7 +369,7 @@ void Client::add_to_plist(bool at_end)
 		playlist.insert(std::move(pl), pos);
 		iface.select_song(pos < 0 ? playlist.size()-pl.size()-1 : pos);
 		iface.redraw(3);
-		if (options::ReadTags) tags.request(playlist, srv);
+		if (options::ReadTags) request_tags(playlist);
 	}
 
 	iface.left.move_selection(REQ_DOWN);
@@ -526,24 +590,26 @@ void Client::run()
 		FD_SET (srv_sock, &fds);
 		FD_SET (STDIN_FILENO, &fds);
 
-		timespec timeout = {0, coalesce ? 1 : 1000*1000*500}; // = {sec,nanosec}
+		// events that are already received don't wake pselect up
+		const bool ready = srv.event_ready();
+		timespec timeout = {0, ready ? 0 : coalesce ? 1 : 1000*1000*500}; // = {sec,nanosec}
 		int n = pselect (srv_sock + 1, &fds, NULL, NULL, &timeout, NULL);
 		if (n == -1 && !want_quit && errno != EINTR)
 			interface_fatal ("pselect() failed: %s", xstrerror (errno));
 		if (want_quit) break;
 
-		if (n > 0 && FD_ISSET(srv_sock, &fds))
+		if (ready || (n > 0 && FD_ISSET(srv_sock, &fds)))
 		{
 			try {
 				int type;
-				if (srv.get_int_noblock(type))
+				if (srv.get_event_noblock(type))
 				{
 					handle_server_event(type);
 					coalesce = true;
 					continue; // handle all events before redrawing
 				}
 				else
-					debug ("Getting event would block.");
+					debug ("Event is not complete yet.");
 			} catch(std::exception &e) {
 				interface_fatal("Error handling server event: %s", e.what());
 			}
@@ -573,11 +639,9 @@ void Client::run()
 
 		if (want_plist_update && synced)
 		{
-			srv.send(CMD_PLIST_GET);
-			wait_for_data();
+			get_plist();
 			want_plist_update = false;
-			srv.get(playlist);
-			if (options::ReadTags) tags.request(playlist, srv);
+			if (options::ReadTags) request_tags(playlist);
 		}
 		else want_plist_update = false;
 		
@@ -586,9 +650,6 @@ void Client::run()
 			update_state();
 		}
 
-		if (options::ShowMixer)
-			iface.info.update_mixer_value(get_mixer_value());
-
 		iface.draw();
 	}
 
@@ -612,6 +673,7 @@ bool Client::handle_command(key_cmd cmd)
 				srv.send(CMD_SET_FILE_TAGS);
 				srv.send(it.first);
 				srv.send(&it.second);
+				iface.tags_changed(it.first);
 			}
 			tags.changes.clear();
 			return true;
@@ -631,9 +693,11 @@ bool Client::handle_command(key_cmd cmd)
 				else
 				{
 					srv.send(CMD_PLAY);
-					srv.send(iface.selected_song());
-					if (!synced)
+					int idx = iface.selected_song();
+					srv.send(idx);
+					if (!synced && idx >= 0)
 					{
+						srv.send(playlist[idx].path);
 						srv.send(playlist);
 						synced = true;
 					}
@@ -671,8 +735,8 @@ bool Client::handle_command(key_cmd cmd)
 			options::ReadTags ^= 1;
 			iface.status(options::ReadTags ? "ReadTags: yes" : "ReadTags: no");
 			if (options::ReadTags) {
-				tags.request(dir_plist, srv);
-				tags.request(playlist, srv);
+				request_tags(dir_plist);
+				request_tags(playlist);
 			}
 			iface.redraw(3);
 			break;
@@ -719,10 +783,8 @@ bool Client::handle_command(key_cmd cmd)
 			}
 			else
 			{
-				srv.send(CMD_PLIST_GET);
-				wait_for_data();
-				srv.get(playlist);
-				if (options::ReadTags) tags.request(playlist, srv);
+				get_plist();
+				if (options::ReadTags) request_tags(playlist);
 				synced = true;
 				want_state_update = true;
 			}
@@ -834,7 +896,14 @@ void Client::handle_server_event (int type)
 		case EV_EXIT: interface_fatal ("The server exited!"); break;
 		case EV_BUSY: interface_fatal ("The server is busy; too many other clients are connected!"); break;
 
-		case EV_STATE: want_state_update = true; break;
+		case EV_STATE:
+		{
+			auto st = (PlayState)srv.get_int();
+			int t = srv.get_int(), idx = srv.get_int();
+			str file = srv.get_str();
+			set_state(st, t, idx, file);
+			break;
+		}
 		case EV_CTIME: { int tmp = srv.get_int(); if (silent_seek_pos == -1) iface.info.update_curr_time(tmp); } break;
 		case EV_BITRATE: iface.info.update_bitrate(srv.get_int()); break;
 		case EV_RATE:  iface.info.update_rate(srv.get_int()); break;
@@ -920,13 +989,39 @@ void Client::handle_server_event (int type)
 			iface.info.update_mixer_name(srv.get_str());
 			iface.info.update_mixer_value(srv.get_int());
 			break;
+		case EV_MIXER_VALUE: iface.info.update_mixer_value(srv.get_int()); break;
 		case EV_FILE_TAGS:
 		{
 			str file = srv.get_str();
 			file_tags *tag = srv.get_tags();
 			logit ("Received tags for %s", file.c_str());
 			tags.update(file, std::unique_ptr<file_tags>(tag));
-			iface.redraw(3);
+			iface.tags_changed(file);
+			break;
+		}
+		case EV_FILE_TAGS_BATCH:
+		{
+			int n = 0;
+			while (true)
+			{
+				str file = srv.get_str(); if (file.empty()) break;
+				file_tags *tag = srv.get_tags();
+				tags.update(file, std::unique_ptr<file_tags>(tag));
+				iface.tags_changed(file);
+				++n;
+			}
+			logit ("Received tags for %d files", n);
+			iface.redraw(3); // once for the whole chunk
+			break;
+		}
+		case EV_DIR_CHANGED:
+		{
+			str dir = srv.get_str();
+			strings files = srv.get_strings();
+			if (dir != cwd) break;
+			debug ("%d files changed in %s", (int)files.size(), dir.c_str());
+			if (options::ReadTags) tags.refresh(files, srv);
+			go_to_dir(NULL);
 			break;
 		}
 		case EV_FILE_RATING:
@@ -9,13 +9,14 @@
 class Client
 {
 public:
-	Client(int sock, strings &args);
+	Client(Socket &&srv, strings &args); // takes over what srv received
 	~Client();
 	void run ();
 
 	Tags  tags; // for all items in our plists
 	plist playlist, dir_plist;
 	str   cwd; // current directory of dir_plist
+	str   watched_dir; // the cwd we told the server about (CMD_WATCH_DIR)
 	bool  synced; // is our playlist synced with the server's?
 
 	bool handle_command(key_cmd cmd); // does everything that's not purely UI
@@ -30,10 +31,10 @@ public:
 	void jump_to (int sec) { srv.send(CMD_JUMP_TO); srv.send(sec); }
 	void seek_to_percent (int percent) { srv.send(CMD_JUMP_TO); srv.send(-percent); }
 
-	void change_artist(const plist_item &it, const str &val) { tags.set_artist(it, val); }
-	void change_album (const plist_item &it, const str &val) { tags.set_album(it, val); }
-	void change_title (const plist_item &it, const str &val) { tags.set_title(it, val); }
-	void change_track (const plist_item &it, int val) { tags.set_track(it, val); }
+	void change_artist(const plist_item &it, const str &val) { tags.set_artist(it, val); iface.tags_changed(it.path); }
+	void change_album (const plist_item &it, const str &val) { tags.set_album(it, val); iface.tags_changed(it.path); }
+	void change_title (const plist_item &it, const str &val) { tags.set_title(it, val); iface.tags_changed(it.path); }
+	void change_track (const plist_item &it, int val) { tags.set_track(it, val); iface.tags_changed(it.path); }
 	str get_artist(const plist_item &it) const { return tags.get_artist(it); }
 	str get_album (const plist_item &it) const { return tags.get_album(it); }
 	str get_title (const plist_item &it) const { return tags.get_title(it); }
@@ -45,6 +46,10 @@ private:
 
 	bool want_plist_update; // do we need to re-fetch the server plist? Ignored if !synced
 	bool want_state_update; // should we call update_state() again?
+
+	uint32_t plist_srv_version = 0; // what the server called the list we got last
+	unsigned plist_version = 0; // playlist.version right after that
+	void get_plist();
 	
 	int    silent_seek_pos = -1; /* Silent seeking - where we are in seconds. -1 - no seeking. */
 	double silent_seek_key_last; /* when the silent seek key was last used */
@@ -65,12 +70,15 @@ private:
 	
 	void set_cwd(const str &path);
 	void update_state ();
+	void set_state (PlayState st, int ctime, int idx, const str &file);
 	void forward_playlist ();
+	void request_tags (const plist &pl);
 	bool go_to_dir (const char *dir);
 	bool go_to_playlist (const str &file);
 	void set_mixer (int val);
 	void adjust_mixer (int diff);
 	void add_to_plist (bool at_end);
+	void add_directory (plist &pl, const str &dir);
 	void set_rating (int r);
 	void delete_item ();
 	void go_to_playing_file ();
@@ -23,6 +23,11 @@ public:
 		need_redraw = std::max(need_redraw, k);
 		if (k > 2) { left.update_layout(); right.update_layout(); }
 	}
+	void tags_changed(const str &path) // tags or pending changes for path
+	{
+		left.tags_changed(path); right.tags_changed(path);
+		redraw(3);
+	}
 	void resize(); // Handle terminal size change.
 	void handle_input(); // read the next key stroke
 	bool handle_command(key_cmd cmd);
@@ -1,10 +1,18 @@
 #include "fifo_buf.h"
 
+static size_t pow2_ceil(size_t n)
+{
+	size_t k = 1;
+	while (k < n) k <<= 1;
+	return k;
+}
+
 fifo_buf::fifo_buf(size_t n)
-	: size(n)
-	, fill(0)
-	, pos(0)
-	, buf(new char[n])
+	: head(0)
+	, tail(0)
+	, size(pow2_ceil(n))
+	, mask(size-1)
+	, buf(new char[size])
 {
 }
 
@@ -15,63 +23,67 @@ fifo_buf::~fifo_buf()
 
 size_t fifo_buf::put(const char *data, size_t N)
 {
-	size_t n = 0;
+	const size_t h = head.load(std::memory_order_relaxed);
+	const size_t t = tail.load(std::memory_order_acquire);
+	const size_t n = std::min(N, size - (h - t));
+	if (!n) return 0;
 
-	while (fill < size && n < N)
-	{
-		size_t i = (pos + fill) % size; // next free byte
-		size_t k = std::min(N-n, (i >= pos ? size : pos) - i);
+	const size_t i = h & mask;
+	const size_t k = std::min(n, size - i); // up to the end of buf
+	memcpy(buf + i, data, k);
+	memcpy(buf, data + k, n - k);
 
-		memcpy(buf + i, data + n, k);
-		fill += k;
-		n    += k;
-	}
+	head.store(h + n, std::memory_order_seq_cst);
+	return n;
+}
 
+size_t fifo_buf::peek(char *data, size_t N)
+{
+	const size_t t = tail.load(std::memory_order_relaxed);
+	const size_t h = head.load(std::memory_order_acquire);
+	const size_t n = std::min(N, h - t);
+	if (!n) return 0;
+
+	const size_t i = t & mask;
+	const size_t k = std::min(n, size - i);
+	memcpy(data, buf + i, k);
+	memcpy(data + k, buf, n - k);
 	return n;
 }
 
 size_t fifo_buf::get(char *data, size_t N)
 {
-	size_t n = 0;
-
-	while (fill && n < N)
-	{
-		size_t k = pos + fill <= size ? fill : size - pos;
-		if (k > N-n) k = N-n;
-
-		memcpy(data, buf + pos, k);
-		data += k;
-		n += k;
-
-		fill -= k;
-		pos  += k;
-		pos  %= size;
-	}
-
+	const size_t n = peek(data, N);
+	if (n) tail.store(tail.load(std::memory_order_relaxed) + n, std::memory_order_seq_cst);
 	return n;
 }
 
-size_t fifo_buf::peek(char *data, size_t N)
+char *fifo_buf::write_span(size_t &n)
 {
-	size_t fill = this->fill, pos = this->pos;
-
-	// same as get() now
-	size_t n = 0;
-
-	while (fill && n < N)
-	{
-		size_t k = pos + fill <= size ? fill : size - pos;
-		if (k > N-n) k = N-n;
-
-		memcpy(data, buf + pos, k);
-		data += k;
-		n += k;
+	const size_t h = head.load(std::memory_order_relaxed);
+	const size_t t = tail.load(std::memory_order_acquire);
+	const size_t i = h & mask;
+	n = std::min(size - (h - t), size - i);
+	return buf + i;
+}
 
-		fill -= k;
-		pos  += k;
-		pos  %= size;
-	}
+void fifo_buf::commit_write(size_t n)
+{
+	assert(n <= get_space());
+	head.store(head.load(std::memory_order_relaxed) + n, std::memory_order_seq_cst);
+}
 
-	return n;
+const char *fifo_buf::read_span(size_t &n) const
+{
+	const size_t t = tail.load(std::memory_order_relaxed);
+	const size_t h = head.load(std::memory_order_acquire);
+	const size_t i = t & mask;
+	n = std::min(h - t, size - i);
+	return buf + i;
 }
 
+void fifo_buf::commit_read(size_t n)
+{
+	assert(n <= get_fill());
+	tail.store(tail.load(std::memory_order_relaxed) + n, std::memory_order_seq_cst);
+}
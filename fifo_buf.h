@@ -1,5 +1,10 @@
 #pragma once
+#include <atomic>
 
+// Lock-free single-producer/single-consumer ring buffer.
+// put() must only be called from one thread (the producer), get(), peek()
+// and clear() only from one other thread (the consumer). Everything else
+// can be called from anywhere. The size is rounded up to a power of two.
 class fifo_buf
 {
 public:
@@ -7,19 +12,44 @@ public:
 	fifo_buf(const fifo_buf &) = delete;	
 	~fifo_buf();
 
-	void clear() { fill = pos = 0; }
+	// consumer side, or when the producer is known to be idle
+	void clear() { tail.store(head.load(std::memory_order_acquire), std::memory_order_release); }
 
 	// these return number of bytes actually put/got
 	size_t put (const char *data, size_t size);
 	size_t peek(char *data, size_t size);
 	size_t get (char *data, size_t size);
 
-	size_t get_space() const { return size - fill; }
-	size_t get_fill()  const { return fill; }
+	// zero-copy access: get the largest contiguous free (filled) region,
+	// write (use) up to n bytes of it and then commit what was used.
+	// Same thread rules as for put() (get()).
+	char       *write_span(size_t &n);
+	void        commit_write(size_t n);
+	const char *read_span(size_t &n) const;
+	void        commit_read(size_t n);
+
+	size_t get_space() const { return size - get_fill(); }
+	size_t get_fill()  const
+	{
+		// tail first: head can only have moved further since, so this
+		// doesn't wrap, but it can be more than size from a third thread.
+		// seq_cst: out_buf pairs this with read_thread_waiting (the reader
+		// sets that and then checks the fill, the writer moves head and
+		// then checks read_thread_waiting, and one of them must see the other).
+		size_t t = tail.load(std::memory_order_seq_cst);
+		size_t h = head.load(std::memory_order_seq_cst);
+		return std::min(h - t, size);
+	}
 	size_t get_size()  const { return size; }
 
 private:
-	size_t size, fill, pos;
-	char  *buf;
-};
+	enum { CACHE_LINE = 64 };
 
+	// head and tail count all bytes ever written/read and are only
+	// reduced modulo size when indexing into buf. Each sits on its own
+	// cache line so producer and consumer don't share one.
+	alignas(CACHE_LINE) std::atomic<size_t> head; // written by producer
+	alignas(CACHE_LINE) std::atomic<size_t> tail; // written by consumer
+	alignas(CACHE_LINE) const size_t size, mask;
+	char *const buf;
+};
@@ -11,8 +11,11 @@
 
 #include <sys/stat.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <magic.h>
 #include <pthread.h>
+#include <list>
+#include <unordered_map>
 
 #include "client/interface.h"
 #include "server/input/decoder.h"
@@ -23,8 +26,26 @@
 #define READ_LINE_INIT_SIZE	256
 
 static magic_t cookie = NULL;
-static char *cached_file = NULL;
-static char *cached_result = NULL;
+
+/* Recent libmagic results, by what identifies the file's content rather
+ * than by path. magic_mtx guards these and the cookie. */
+#define MAGIC_CACHE_SIZE 1024
+struct magic_key
+{
+	dev_t dev; ino_t ino; time_t mtime;
+	bool operator== (const magic_key &k) const { return dev == k.dev && ino == k.ino && mtime == k.mtime; }
+};
+struct magic_key_hash
+{
+	size_t operator() (const magic_key &k) const
+	{
+		return std::hash<uint64_t>()(((uint64_t)k.dev << 32) ^ (uint64_t)k.ino ^ ((uint64_t)k.mtime << 16));
+	}
+};
+typedef std::list<std::pair<magic_key, str>> magic_lru_list; // most recent first
+static magic_lru_list magic_lru;
+static std::unordered_map<magic_key, magic_lru_list::iterator, magic_key_hash> magic_cache;
+static pthread_mutex_t magic_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 void files_init ()
 {
@@ -45,10 +66,8 @@ void files_init ()
 
 void files_cleanup ()
 {
-	free (cached_file);
-	cached_file = NULL;
-	free (cached_result);
-	cached_result = NULL;
+	magic_cache.clear();
+	magic_lru.clear();
 	magic_close (cookie);
 	cookie = NULL;
 }
@@ -281,26 +300,34 @@ char *file_mime_type (const char *file)
 
 	assert (file != NULL);
 
-	static pthread_mutex_t magic_mtx = PTHREAD_MUTEX_INITIALIZER;
+	struct stat st;
+	if (cookie == NULL || stat (file, &st) != 0) return NULL;
+	magic_key key = {st.st_dev, st.st_ino, st.st_mtime};
 
-	if (cookie != NULL) {
-		LOCK(magic_mtx);
-		if (cached_file && !strcmp (cached_file, file))
-			result = xstrdup (cached_result);
-		else {
-			free (cached_file);
-			free (cached_result);
-			cached_file = cached_result = NULL;
-			result = xstrdup (magic_file (cookie, file));
-			if (result == NULL)
-				logit ("Error interrogating file: %s", magic_error (cookie));
-			else {
-				cached_file = xstrdup (file);
-				cached_result = xstrdup (result);
+	LOCK(magic_mtx);
+	auto i = magic_cache.find(key);
+	if (i != magic_cache.end())
+	{
+		magic_lru.splice(magic_lru.begin(), magic_lru, i->second);
+		result = xstrdup (i->second->second.c_str());
+	}
+	else
+	{
+		result = xstrdup (magic_file (cookie, file));
+		if (result == NULL)
+			logit ("Error interrogating file: %s", magic_error (cookie));
+		else
+		{
+			magic_lru.emplace_front(key, result);
+			magic_cache[key] = magic_lru.begin();
+			if (magic_lru.size() > MAGIC_CACHE_SIZE)
+			{
+				magic_cache.erase(magic_lru.back().first);
+				magic_lru.pop_back();
 			}
 		}
-		UNLOCK(magic_mtx);
 	}
+	UNLOCK(magic_mtx);
 
 	return result;
 }
@@ -378,6 +405,36 @@ time_t get_mtime (const str &file)
 	return (time_t)-1;
 }
 
+/* Get the modification times of many files. Each directory is opened once
+ * and the files in it are stat'ed relative to it, which saves the path
+ * lookups when files from the same directory come one after another (as
+ * they do when they come from a directory listing). */
+void get_mtimes (const strings &files, std::vector<time_t> &mtimes)
+{
+	mtimes.assign(files.size(), (time_t)-1);
+
+	str dir; int dir_fd = -1;
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		const str &f = files[i];
+		size_t k = f.rfind('/');
+		if (k == str::npos) continue;
+
+		if (dir_fd == -1 || f.compare(0, k+1, dir) != 0)
+		{
+			if (dir_fd != -1) close(dir_fd);
+			dir.assign(f, 0, k+1);
+			dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (dir_fd == -1) { mtimes[i] = get_mtime(f); continue; }
+		}
+
+		struct stat st;
+		if (fstatat(dir_fd, f.c_str() + k + 1, &st, 0) == 0)
+			mtimes[i] = st.st_mtime;
+	}
+	if (dir_fd != -1) close(dir_fd);
+}
+
 /* Check that a file which may cause other applications to be invoked
  * is secure against tampering. */
 bool is_secure (const char *file)
@@ -21,6 +21,7 @@ str containing_directory(const str &path);
 str file_name(const str &path);
 
 time_t get_mtime (const str &file);
+void get_mtimes (const strings &files, std::vector<time_t> &mtimes); // (time_t)-1 for errors
 bool can_read_file (const str &file);
 bool is_secure (const char *file);
 char *file_mime_type (const char *file);
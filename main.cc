@@ -23,6 +23,7 @@
 #include "server/input/decoder.h"
 #include "client/client.h"
 #include "server/protocol.h"
+#include "server/status_shm.h"
 #include "Socket.h"
 
 struct parameters
@@ -70,7 +71,7 @@ static int server_connect ()
 static bool ping_server (Socket &srv)
 {
 	srv.send(CMD_PING);
-	return srv.get_int() == EV_PONG;
+	return srv.get_event() == EV_PONG;
 }
 
 /* Check if a directory ./.moc exists and create if needed. */
@@ -169,7 +170,7 @@ static void start_moc (const struct parameters *params, strings &args)
 
 		options::load(GUI);
 		{
-			Client client(server_sock, args);
+			Client client(std::move(srv), args);
 			client.run();
 		}
 		options::save(GUI);
@@ -224,10 +225,15 @@ static void server_command (struct parameters *params, strings &args)
 	else if (params->previous) srv.send(CMD_PREV);
 	else if (params->unpause) srv.send(CMD_UNPAUSE);
 	else if (params->toggle_pause) {
-		srv.send(CMD_GET_STATE);
-		// this should be wait_for_data()...
-		if (srv.get_int() != EV_DATA) fatal("Can't get state");
-		switch (srv.get_int()) {
+		status_info st;
+		if (!status_read(st))
+		{
+			srv.send(CMD_GET_STATE);
+			// this should be wait_for_data()...
+			if (srv.get_int() != EV_DATA) fatal("Can't get state");
+			st.state = srv.get_int();
+		}
+		switch (st.state) {
 			case STATE_STOP:  interface_cmdline_play_first(srv); break;
 			case STATE_PAUSE: srv.send(CMD_UNPAUSE); break;
 			case STATE_PLAY:  srv.send(CMD_PAUSE); break;
@@ -196,13 +196,19 @@ void load(Component who)
 	OPT(RatingSpace);
 	OPT(RatingStar);
 	OPT(ReadTags);
+	OPT(TagReaderThreads);
+	OPT(TagsCacheBackend);
+	OPT(WatchMusicDir);
+	OPT(IndexMusicDir);
 	OPT(MusicDir);
 	OPT(StartInMusicDir);
 	EOPT(Repeat, "off", "all", "one");
 	OPT(Shuffle);
 	OPT(ASCIILines); OPT(HideBorder);
 	OPT(InputBuffer);
+	OPT(NetworkReadAhead);
 	OPT(OutputBuffer);
+	OPT(PrecacheFiles);
 	OPT(HTTPProxy);
 	EOPT(SoundDriver, "SNDIO", "JACK", "ALSA", "OSS", "NULL");
 	OPT(JackClientName);
@@ -307,13 +313,19 @@ Ratio hsplit = std::make_pair(1,1), vsplit = std::make_pair(1,1);
 Layout layout = HSPLIT;
 
 bool ReadTags = true;
+int  TagReaderThreads = 0;
+str  TagsCacheBackend = "snapshot";
+bool WatchMusicDir = true;
+bool IndexMusicDir = true;
 bool StartInMusicDir = false;
 str  LastDir = "";
 RepeatType Repeat = REPEAT_OFF;
 bool Shuffle = false;
 bool ASCIILines = false, HideBorder = false;
 int InputBuffer = 512;
+int NetworkReadAhead = 1024;
 int OutputBuffer = 512;
+int PrecacheFiles = 2;
 str HTTPProxy = "";
 
 SoundDriver_t SoundDriver = SoundDriver_t::AUTO;
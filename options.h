@@ -32,6 +32,10 @@ namespace options
 	extern str    TERM;
 
 	extern bool ReadTags;
+	extern int  TagReaderThreads;
+	extern str  TagsCacheBackend;
+	extern bool WatchMusicDir;
+	extern bool IndexMusicDir;
 	extern bool PlaylistFullPaths;
 	extern bool ShowHiddenFiles;
 	extern bool HideFileExtension;
@@ -44,6 +48,8 @@ namespace options
 	extern str  TimeBarSpace;
 
 	extern int  InputBuffer, OutputBuffer;
+	extern int  NetworkReadAhead;
+	extern int  PrecacheFiles;
 	extern bool UseRealtimePriority;
 	extern RepeatType Repeat;
 	extern bool Shuffle;
@@ -1,6 +1,9 @@
 #include <sys/stat.h>
 #include <dirent.h>
-#include <stack>
+#include <deque>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
 #include <fcntl.h>
 #include <sys/file.h>
 
@@ -9,18 +12,26 @@
 #include "client/client.h" // user_wants_interrupt()
 #include "server/input/decoder.h"
 
-file_type plist_item::ftype (const str &file)
+file_type plist_item::ftype (const str &file, time_t *mtime)
 {
 	struct stat file_stat;
 	const char *f = file.c_str();
 
+	if (mtime) *mtime = (time_t)-1;
 	if (stat(f, &file_stat) == -1) return F_OTHER;
+	if (mtime) *mtime = file_stat.st_mtime;
 	if (S_ISDIR(file_stat.st_mode)) return F_DIR;
 	if (is_sound_file(f)) return F_SOUND;
 	if (is_plist_file(f)) return F_PLAYLIST;
 	return F_OTHER;
 }
 
+uint64_t plist_item::new_id()
+{
+	static std::atomic<uint64_t> last(0);
+	return ++last;
+}
+
 bool plist_item::can_tag() const
 {
 	if (type != F_SOUND) return false;
@@ -50,74 +61,136 @@ void plist::swap(plist &other)
 	}
 	std::swap(items, other.items);
 	std::swap(is_dir, other.is_dir);
+	changed(); other.changed();
+}
+
+bool plist::index() const
+{
+	if (indexed) return true;
+	if (++searches < 2) return false;
+
+	by_path.clear(); by_id.clear();
+	by_path.reserve(items.size()); by_id.reserve(items.size());
+	for (int i = 0, n = (int)items.size(); i < n; ++i)
+	{
+		by_path.emplace(items[i]->path, i); // keeps the first one
+		by_id.emplace(items[i]->id, i);
+	}
+	indexed = true;
+	return true;
+}
+
+int plist::find(const str &file) const
+{
+	const int n = (int)items.size();
+	if (index())
+	{
+		auto i = by_path.find(file);
+		if (i == by_path.end()) return -1;
+		if (i->second < n && items[i->second]->path == file) return i->second;
+		changed(); // someone forgot to call it
+	}
+	for (int i = 0; i < n; ++i)
+		if (items[i]->path == file) return i;
+	return -1;
+}
+
+int plist::find_id(uint64_t id) const
+{
+	const int n = (int)items.size();
+	if (index())
+	{
+		auto i = by_id.find(id);
+		if (i == by_id.end()) return -1;
+		if (i->second < n && items[i->second]->id == id) return i->second;
+		changed();
+	}
+	for (int i = 0; i < n; ++i)
+		if (items[i]->id == id) return i;
+	return -1;
 }
 
 void plist::clear()
 {
 	if (tags) for (auto &it : items) tags->release(*it);
 	items.clear();
+	changed();
 }
 void plist::remove(int i, int n)
 {
 	if (i < 0 || n <= 0 || (size_t)(i+n) > items.size()) return;
 	if (tags) for (int j = i, k = i+n; j < k; ++j) tags->release(*items[j]);
 	items.erase(items.begin() + i, items.begin() + i + n);
+	changed();
 }
 void plist::remove(const std::set<int> &idx)
 {
 	int j = 0;
+	auto k = idx.begin();
 	for (int i = 0, n = (int)items.size(); i < n; ++i)
 	{
-		if (idx.count(i)) continue;
+		while (k != idx.end() && *k < i) ++k;
+		if (k != idx.end() && *k == i) continue;
 		std::swap(items[i], items[j++]);
 	}
 	items.resize(j);
+	changed();
 }
 int plist::remove(const std::set<str> &files, int i0)
 {
-	int j = 0;
+	if (files.empty()) return i0;
+	std::unordered_set<str> gone(files.begin(), files.end());
+	int j = 0, i1 = i0;
 	for (int i = 0, n = (int)items.size(); i < n; ++i)
 	{
-		if (files.count(items[i]->path)) continue;
+		if (gone.count(items[i]->path)) { if (i0 > i) --i1; continue; }
 		std::swap(items[i], items[j++]);
-		if (i0 > i) --i0;
 	}
 	items.resize(j);
-	return i0;
+	changed();
+	return i1;
 }
 void plist::replace(const std::map<str, str> &mod)
 {
-	for (int i = 0, n = (int)items.size(); i < n; ++i)
+	if (mod.empty()) return;
+	std::unordered_map<str, const str*> m; m.reserve(mod.size());
+	for (auto &it : mod) m.emplace(it.first, &it.second);
+	for (auto &i : items)
 	{
-		auto it = mod.find(items[i]->path);
-		if (it == mod.end()) continue;
-		items[i]->path = it->second;
+		auto it = m.find(i->path);
+		if (it != m.end()) i->path = *it->second;
 	}
+	changed();
 }
 
 void plist::move(int i, int j)
 {
 	int n = (int)items.size();
 	if (i == j || i < 0 || j < 0 || i >= n || j >= n) return;
-	while (i < j) { std::swap(items[i], items[i+1]); ++i; }
-	while (i > j) { std::swap(items[i], items[i-1]); --i; }
+	auto a = items.begin() + i, b = items.begin() + j;
+	if (i < j) std::rotate(a, a+1, b+1);
+	else       std::rotate(b, a, a+1);
+	changed();
 }
 
 plist & plist::operator+= (const plist &other)
 {
 	for (auto &i : other.items)
 		items.emplace_back(new plist_item(*i));
+	changed();
 	return *this;
 }
 plist & plist::operator+= (const plist_item &i)
 {
 	items.emplace_back(new plist_item(i));
+	changed();
 	return *this;
 }
 plist & plist::operator+= (plist &&other)
 {
 	for (auto &i : other.items)
 		items.emplace_back(std::move(i));
+	changed();
 	return *this;
 }
 
@@ -133,6 +206,7 @@ void plist::insert(const plist &other, int pos)
 	auto j = items.begin() + pos;
 	for (auto &i : other.items)
 		items.emplace(j++, new plist_item(*i));
+	changed();
 }
 void plist::insert(plist &&other, int pos)
 {
@@ -145,6 +219,7 @@ void plist::insert(plist &&other, int pos)
  	items.insert(items.begin() + pos,
 		std::make_move_iterator(std::begin(other.items)),
 		std::make_move_iterator(std::end(other.items)));
+	changed();
 }
 void plist::insert(const str &f, int pos)
 {
@@ -155,7 +230,8 @@ void plist::insert(const str &f, int pos)
 	}
 
 	auto j = items.begin() + pos;
-	items.emplace(j++, new plist_item(f));
+	items.emplace(j, new plist_item(f));
+	changed();
 }
 
 void plist::shuffle ()
@@ -165,6 +241,7 @@ void plist::shuffle ()
 		int j = random_int(i, n);
 		std::swap(items[i], items[j]);
 	}
+	changed();
 }
 
 bool operator< (const plist_item &a, const plist_item &b)
@@ -240,8 +317,27 @@ bool plist::load_directory(const str &directory_, bool include_updir)
 		if (!up && !options::ShowHiddenFiles && *entry->d_name == '.') continue;
 
 		str p = format("%s/%s", prefix, entry->d_name);
-		if (up) normalize_path(p);
-		items.emplace_back(new plist_item(p));
+		if (up) { normalize_path(p); items.emplace_back(new plist_item(p, F_DIR)); continue; }
+
+		/* d_type saves the stat() for most things, only sound files
+		 * need one for their mtime (which the tags cache uses) */
+		file_type t = F_OTHER; time_t mtime = (time_t)-1;
+		if (entry->d_type == DT_DIR)
+			t = F_DIR;
+		else if (entry->d_type == DT_REG && !is_sound_file(p))
+			t = is_plist_file(p) ? F_PLAYLIST : F_OTHER;
+		else
+		{
+			struct stat st;
+			if (fstatat(dirfd(dir), entry->d_name, &st, 0) == 0)
+			{
+				mtime = st.st_mtime;
+				t = S_ISDIR(st.st_mode) ? F_DIR :
+				    is_sound_file(p) ? F_SOUND :
+				    is_plist_file(p) ? F_PLAYLIST : F_OTHER;
+			}
+		}
+		items.emplace_back(new plist_item(p, t, mtime));
 	}
 
 	closedir (dir);
@@ -250,61 +346,215 @@ bool plist::load_directory(const str &directory_, bool include_updir)
 	return true;
 }
 
-bool plist::add_directory (const str &directory, bool recursive)
+/* add_directory() reads the tree with a few threads. Every directory is
+ * a job that lists its sound files and subdirectories into its thread's
+ * own results. Those are put together at the end, in the order of a
+ * sequential walk: for each directory the subdirectories first, then
+ * its own files.
+ *
+ * A directory that can be reached by several paths (symlinks) is read
+ * only once, by whichever path a thread gets to first. The others become
+ * aliases of it. Which path a directory shows up under and which copies
+ * are dropped is decided in collect(), in sequential order, so the result
+ * does not depend on the threads. */
+namespace {
+typedef std::pair<dev_t, ino_t> Inode;
+struct DirNode
 {
-	is_dir = false;
+	str path;
+	Inode inode;
+	bool alias; // of done[inode], not read
+	std::vector<std::unique_ptr<plist_item>> files; // sorted
+	strings subdirs; // sorted
+};
+struct TreeWalk
+{
+	pthread_mutex_t mtx;
+	pthread_cond_t  cond;
+	std::deque<str> todo;
+	int  busy; // jobs being worked on
+	std::atomic<bool> stop; // interrupted
+	bool recursive;
+	std::map<Inode, str> done; // path that each directory was read as
+
+	struct Worker { TreeWalk *walk; std::vector<DirNode> nodes; };
+	std::vector<Worker> workers;
+};
+}
 
-	std::stack<str> todo;
-	std::set<ino_t> done;
-	todo.push(directory);
-	plist added;
-	while (!todo.empty())
+/* Read one directory, d_type saves most of the stat() calls. */
+static void walk_dir (TreeWalk &w, const str &path, std::vector<DirNode> &out)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0)
 	{
-		if (user_wants_interrupt()) {
-			error ("Interrupted! Not all files read!");
-			break;
-		}
+		char *err = xstrerror (errno);
+		error ("Can't read \"%s\" (Error: \"%s\")", path.c_str(), err);
+		free (err);
+		if (fd >= 0) close(fd);
+		return;
+	}
+	DirNode node; node.path = path;
+	node.inode = Inode(st.st_dev, st.st_ino);
+	LOCK (w.mtx);
+	node.alias = !w.done.emplace(node.inode, path).second;
+	UNLOCK (w.mtx);
+	if (node.alias)
+	{
+		close(fd);
+		out.push_back(std::move(node));
+		return;
+	}
 
-		str d = todo.top(); todo.pop();
-		const char *dir = d.c_str();
-		
-		struct stat st;
-		if (stat (dir, &st)) {
-			char *err = xstrerror (errno);
-			error ("Can't stat \"%s\" (Error: \"%s\")", dir, err);
-			free (err);
-			continue;
-		}
-		if (done.count(st.st_ino))
+	DIR *dir = fdopendir(fd);
+	if (!dir) { close(fd); return; }
+
+	std::vector<plist_item> subdirs;
+	const char *prefix = (path == "/" ? "" : path.c_str());
+	while (dirent *e = readdir(dir))
+	{
+		if (w.stop) break;
+		const char *name = e->d_name;
+		if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+		if (!options::ShowHiddenFiles && name[0] == '.') continue;
+
+		str p = format("%s/%s", prefix, name);
+		bool is_dir = (e->d_type == DT_DIR);
+		if (e->d_type == DT_LNK || e->d_type == DT_UNKNOWN)
 		{
-			logit ("Detected symlink loop on %s", dir);
-			continue;
+			struct stat fst;
+			if (fstatat(dirfd(dir), name, &fst, 0) != 0) continue;
+			is_dir = S_ISDIR(fst.st_mode);
 		}
+		else if (!is_dir && e->d_type != DT_REG) continue;
 
-		plist p; p.load_directory(d, false);
-		for (int i = 0, n = (int)p.items.size(); i < n; ++i)
+		if (is_dir)
 		{
-			auto &it = p.items[i];
-			switch (it->type)
-			{
-				case F_DIR:
-				{
-					if (recursive) todo.push(it->path);
-					// fallthrough
-				}
-				case F_PLAYLIST:
-				case F_OTHER:
-					p.items.erase(p.items.begin() + i);
-					--i; --n;
-					break;
-				default: break;
-			}
+			if (w.recursive) subdirs.emplace_back(p, F_DIR);
 		}
+		else if (is_sound_file(p))
+			node.files.emplace_back(new plist_item(p, F_SOUND));
+	}
+	closedir(dir);
+
+	std::sort(node.files.begin(), node.files.end(),
+		[](const std::unique_ptr<plist_item>&a, const std::unique_ptr<plist_item>&b)
+		{ return *a < *b; });
+	std::sort(subdirs.begin(), subdirs.end());
+	for (auto &d : subdirs) node.subdirs.push_back(std::move(d.path));
+
+	if (!node.subdirs.empty())
+	{
+		LOCK (w.mtx);
+		for (auto &d : node.subdirs) w.todo.push_back(d);
+		pthread_cond_broadcast (&w.cond);
+		UNLOCK (w.mtx);
+	}
+	out.push_back(std::move(node));
+}
+
+static void *walk_thread (void *arg)
+{
+	auto &me = *(TreeWalk::Worker *)arg;
+	TreeWalk &w = *me.walk;
+
+	LOCK (w.mtx);
+	while (!w.stop && (!w.todo.empty() || w.busy))
+	{
+		if (w.todo.empty()) { pthread_cond_wait (&w.cond, &w.mtx); continue; }
+		str d = std::move(w.todo.front()); w.todo.pop_front();
+		++w.busy;
+		UNLOCK (w.mtx);
+		walk_dir (w, d, me.nodes);
+		LOCK (w.mtx);
+		if (!--w.busy && w.todo.empty()) pthread_cond_broadcast (&w.cond);
+	}
+	UNLOCK (w.mtx);
+	return NULL;
+}
 
-		p += std::move(added);
-		added.swap(p);
+/* p is under from, move it under to. */
+static str rebase (const str &p, const str &from, const str &to)
+{
+	if (from == to) return p;
+	return to + p.substr(from == "/" ? 0 : from.length());
+}
+
+/* Put the files of the directory read as path into out, as if it was
+ * read as shown. Every directory is used the first time it comes up. */
+static void collect (TreeWalk &w, std::unordered_map<str, DirNode*> &nodes,
+		const str &path, const str &shown, std::set<Inode> &used, plist &out)
+{
+	auto i = nodes.find(path); if (i == nodes.end()) return;
+	DirNode &n = *i->second;
+	if (!used.insert(n.inode).second)
+	{
+		logit ("Detected symlink loop on %s", shown.c_str());
+		return;
+	}
+	if (n.alias)
+	{
+		const str &real = w.done[n.inode];
+		used.erase(n.inode);
+		collect (w, nodes, real, shown, used, out);
+		return;
+	}
+	for (auto &d : n.subdirs) collect (w, nodes, d, rebase(d, path, shown), used, out);
+	for (auto &f : n.files)
+	{
+		f->path = rebase(f->path, path, shown);
+		out.items.push_back(std::move(f));
+	}
+}
+
+bool plist::add_directory (const str &directory, bool recursive)
+{
+	is_dir = false;
+
+	TreeWalk w;
+	pthread_mutex_init (&w.mtx, NULL);
+	pthread_cond_init (&w.cond, NULL);
+	w.busy = 0; w.stop = false; w.recursive = recursive;
+	w.todo.push_back(directory);
+
+	int n = recursive ? std::min(16L, std::max(4L, sysconf(_SC_NPROCESSORS_ONLN))) : 1;
+	w.workers.resize(n);
+	std::vector<pthread_t> threads;
+	for (auto &wk : w.workers)
+	{
+		wk.walk = &w;
+		pthread_t tid;
+		if (pthread_create (&tid, NULL, walk_thread, &wk) == 0) threads.push_back(tid);
+	}
+	if (threads.empty()) walk_thread (&w.workers[0]);
+
+	// wait here, so that we notice interrupts
+	LOCK (w.mtx);
+	while (!w.stop && (!w.todo.empty() || w.busy))
+	{
+		struct timespec t;
+		clock_gettime (CLOCK_REALTIME, &t);
+		t.tv_nsec += 100000000;
+		if (t.tv_nsec >= 1000000000) { t.tv_nsec -= 1000000000; ++t.tv_sec; }
+		pthread_cond_timedwait (&w.cond, &w.mtx, &t);
+
+		if (user_wants_interrupt()) {
+			error ("Interrupted! Not all files read!");
+			w.stop = true;
+			pthread_cond_broadcast (&w.cond);
+		}
 	}
-	*this += std::move(added);
+	UNLOCK (w.mtx);
+	for (pthread_t tid : threads) pthread_join (tid, NULL);
+	pthread_cond_destroy (&w.cond);
+	pthread_mutex_destroy (&w.mtx);
+
+	std::unordered_map<str, DirNode*> nodes;
+	for (auto &wk : w.workers) for (auto &d : wk.nodes) nodes[d.path] = &d;
+	std::set<Inode> used;
+	collect (w, nodes, directory, directory, used, *this);
+	changed();
 	return true;
 }
 
@@ -345,6 +595,7 @@ bool plist::load_m3u (const str &fname)
 	}
 
 	fclose (file);
+	changed();
 	return true;
 }
 
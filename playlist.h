@@ -1,5 +1,6 @@
 #pragma once
 #include <memory>
+#include <unordered_map>
 #include "file_tags.h"
 
 enum file_type
@@ -13,18 +14,23 @@ enum file_type
 class plist_item
 {
 public:
-	static file_type ftype(const str &path);
+	static file_type ftype(const str &path, time_t *mtime = NULL);
 
-	explicit plist_item(str &&p) : path(p), type(ftype(path)), tags(NULL) { assert(!path.empty() && path[0] == '/'); }
-	explicit plist_item(const str &p) : path(p), type(ftype(path)), tags(NULL) { assert(!path.empty() && path[0] == '/'); }
-	plist_item(const str &p, file_type t) : path(p), type(t), tags(NULL) { assert(!path.empty() && path[0] == '/'); }
-	plist_item(const plist_item &i) : path(i.path), type(i.type), tags(i.tags) { if (tags) ++tags->usage; }
+	explicit plist_item(str &&p) : path(p), type(ftype(path, &mtime)), tags(NULL), id(new_id()) { assert(!path.empty() && path[0] == '/'); }
+	explicit plist_item(const str &p) : path(p), type(ftype(path, &mtime)), tags(NULL), id(new_id()) { assert(!path.empty() && path[0] == '/'); }
+	plist_item(const str &p, file_type t, time_t mt = (time_t)-1) : path(p), type(t), mtime(mt), tags(NULL), id(new_id()) { assert(!path.empty() && path[0] == '/'); }
+	plist_item(const plist_item &i) : path(i.path), type(i.type), mtime(i.mtime), tags(i.tags), id(new_id()) { if (tags) ++tags->usage; }
 
 	bool can_tag() const; // can we write tags for this?
 
 	str       path; // absolute path
 	file_type type;
+	time_t    mtime; // from when type was found, (time_t)-1 if unknown
 	mutable file_tags *tags; // not owned, not deleted!
+	uint64_t  id; // unique, copies get a new one
+
+private:
+	static uint64_t new_id();
 };
 bool operator< (const plist_item &a, const plist_item &b);
 
@@ -33,9 +39,9 @@ class Tags;
 struct plist
 {
 public:
-	plist(Tags *tags = NULL) : is_dir(false), tags(tags) {}
+	plist(Tags *tags = NULL) : is_dir(false), tags(tags), version(0), indexed(false), searches(0) {}
 	plist(const plist &) = delete;
-	plist(plist &&p) : is_dir(p.is_dir), tags(p.tags) { items.swap(p.items); }
+	plist(plist &&p) : is_dir(p.is_dir), tags(p.tags), version(0), indexed(false), searches(0) { items.swap(p.items); p.changed(); }
 	~plist();
 
 	bool empty() const { return items.empty(); }
@@ -59,9 +65,9 @@ public:
 	plist & operator+= (const plist &other);
 	plist & operator+= (plist &&other);
 	plist & operator+= (const plist_item &i);
-	plist & operator+= (str &&f) { items.emplace_back(new plist_item(f)); return *this; }
-	plist & operator+= (const str &f) { items.emplace_back(new plist_item(f)); return *this; }
-	plist & operator+= (const char *f) { items.emplace_back(new plist_item(f)); return *this; }
+	plist & operator+= (str &&f) { items.emplace_back(new plist_item(f)); changed(); return *this; }
+	plist & operator+= (const str &f) { items.emplace_back(new plist_item(f)); changed(); return *this; }
+	plist & operator+= (const char *f) { items.emplace_back(new plist_item(f)); changed(); return *this; }
 
 	void insert(const plist &other, int pos); // pos = -1 to add
 	void insert(plist &&other, int pos); // pos = -1 to add
@@ -78,12 +84,8 @@ public:
 		return sum;
 	}
 
-	int find(const str &file) const
-	{
-		for (int i = 0, n = (int)items.size(); i < n; ++i)
-			if (items[i]->path == file) return i;
-		return -1;
-	}
+	int find(const str &file) const; // first index of file or -1
+	int find_id(uint64_t id) const; // index of the item with that id or -1
 
 	void shuffle();
 	void sort()
@@ -91,21 +93,35 @@ public:
 		std::sort(items.begin(), items.end(), 
 		[](const std::unique_ptr<plist_item>&a, const std::unique_ptr<plist_item>&b)
 		{ return *a < *b; });
+		changed();
 	}
 	bool move_to_front(const char *item)
 	{
-		for (auto &i : items)
-		{
-			if (i->path != item) continue;
-			std::swap(i, items[0]);
-			return true;
-		}
-		return false;
+		int i = find(str(item));
+		if (i < 0) return false;
+		std::swap(items[i], items[0]);
+		changed();
+		return true;
 	}
 
+	// Call this after changing items or their paths directly (the methods
+	// here do it themselves).
+	void changed() const { indexed = false; searches = 0; ++version; }
+	mutable unsigned version; // counts changes, for views that cache things per item
+
 	std::vector<std::unique_ptr<plist_item> > items;
 	Tags *tags; // can be NULL
 	bool is_dir; // otherwise it's a playlist
+
+private:
+	// Lookup tables for find() and find_id(). They are only built when
+	// the list is searched more than once between changes (a single search
+	// is cheaper as a plain loop).
+	bool index() const;
+	mutable std::unordered_map<str, int> by_path; // first position
+	mutable std::unordered_map<uint64_t, int> by_id;
+	mutable bool indexed;
+	mutable int  searches; // since the last change
 };
 
 inline void swap(plist &a, plist &b) { a.swap(b); }
@@ -25,6 +25,7 @@
 #include "audio.h"
 #include "input/io.h"
 #include "output/audio_conversion.h"
+#include "output/conv_kernels.h"
 
 static pthread_t playing_thread = 0;  /* tid of play thread */
 static int play_thread_running = 0;
@@ -62,6 +63,10 @@ static struct sound_params req_sound_params = { 0, 0, 0 };
 static struct audio_conversion sound_conv;
 static int need_audio_conversion = 0;
 
+/* Copy of the sound that the equalizer and softmixer work on, allocated
+ * in audio_open() so audio_send_pcm() never has to. */
+static std::vector<char> dsp_buf;
+
 static int current_mixer = 0;
 
 /* Check if the two sample rates don't differ so much that we can't play. */
@@ -189,12 +194,14 @@ static void *play_thread (void *unused)
 {
 	logit ("Entering playing thread");
 
+	bool gapless = false; // the last file is still in the buffer
 	while (true) {
 
 		LOCK (plist_mtx);
 		if (playlist.stopped()) { UNLOCK(plist_mtx); break; }
 		str file = playlist.path(playlist.current());
-		str next = playlist.path(playlist.next());
+		std::vector<str> next;
+		playlist.upcoming(options::PrecacheFiles, next);
 		UNLOCK (plist_mtx);
 
 		play_next = 0;
@@ -202,15 +209,20 @@ static void *play_thread (void *unused)
 
 		if (!file.empty()) {
 			logit ("Playing %s", file.c_str());
-			out_buf_time_set (out_buf, 0.0);
+			if (!gapless) out_buf_time_set (out_buf, 0);
 
-			const char *next_file = next.empty() ? NULL : next.c_str();
-			player (file.c_str(), next_file, out_buf);
+			gapless = player (file.c_str(), next, out_buf, gapless);
 
-			set_info_rate (0);
-			set_info_bitrate (0);
-			set_info_channels (1);
-			out_buf_time_set (out_buf, 0.0);
+			if (!gapless) {
+				set_info_rate (0);
+				set_info_bitrate (0);
+				set_info_channels (1);
+				out_buf_time_set (out_buf, 0);
+			}
+		}
+		else if (gapless) {
+			out_buf_wait (out_buf);
+			gapless = false;
 		}
 
 		LOCK (plist_mtx);
@@ -238,6 +250,11 @@ static void *play_thread (void *unused)
 		if (stopped) break;
 	}
 
+	if (gapless) {
+		if (stop_playing) out_buf_stop (out_buf);
+		else out_buf_wait (out_buf);
+	}
+
 	prev_state = state;
 	state = STATE_STOP;
 	state_change ();
@@ -445,6 +462,10 @@ int audio_open (struct sound_params *sound_params)
 		}
 		audio_opened = 1;
 
+		if (dsp_buf.size () < AUDIO_MAX_PLAY_BYTES)
+			dsp_buf.resize (AUDIO_MAX_PLAY_BYTES);
+		equalizer_prepare (driver_sound_params, AUDIO_MAX_PLAY_BYTES);
+
 		#ifndef NDEBUG
 		char fmt_name[SFMT_STR_MAX];
 		#endif
@@ -464,23 +485,30 @@ int audio_open (struct sound_params *sound_params)
 int audio_send_buf (const char *buf, const size_t size)
 {
 	size_t out_data_len = size;
-	int res;
-	char *converted = NULL;
+	const char *converted = NULL;
 
-	if (need_audio_conversion)
-		converted = audio_conv (&sound_conv, buf, size, &out_data_len);
+	if (!need_audio_conversion)
+		return out_buf_put (out_buf, buf, size);
 
-	if (need_audio_conversion && converted)
-		res = out_buf_put (out_buf, converted, out_data_len);
-	else if (!need_audio_conversion)
-		res = out_buf_put (out_buf, buf, size);
-	else
-		res = 0;
+	converted = audio_conv (&sound_conv, buf, size, &out_data_len);
+	return converted ? out_buf_put (out_buf, converted, out_data_len) : 0;
+}
 
-	if (converted)
-		free (converted);
+/* Get a pointer into the output buffer where up to size bytes of sound in
+ * the format sp can be written directly, to be passed on with
+ * audio_commit_buf(). Returns NULL if that is not possible right now
+ * (no space, or the sound would need conversion first). */
+char *audio_reserve_buf (const sound_params &sp, size_t &size)
+{
+	size = 0;
+	if (!audio_opened || need_audio_conversion || sp != req_sound_params)
+		return NULL;
+	return out_buf_reserve (out_buf, &size);
+}
 
-	return res;
+void audio_commit_buf (const size_t size)
+{
+	out_buf_commit (out_buf, size);
 }
 
 /* Get the current audio format bytes per frame value.
@@ -504,51 +532,31 @@ int audio_get_buf_fill ()
 	return hw->get_buff_fill ();
 }
 
-int audio_send_pcm (const char *buf, const size_t size)
+/* Play (part of) the sound in buf. Returns the number of bytes played,
+ * which can be less than size. */
+int audio_send_pcm (const char *buf, size_t size)
 {
-	char *softmixed = NULL;
-	char *equalized = NULL;
+	const bool eq = equalizer_is_active ();
+	const bool sm = softmixer_is_active () || softmixer_is_mono ();
 
-	if (equalizer_is_active ())
+	if (eq || sm)
 	{
-		equalized = (char*) xmalloc (size);
-		memcpy (equalized, buf, size);
+		/* only as many whole frames as fit into dsp_buf */
+		const size_t bpf = audio_get_bpf ();
+		size = MIN(size, dsp_buf.size () - dsp_buf.size () % bpf);
+		memcpy (dsp_buf.data (), buf, size);
 
-		equalizer_process_buffer (equalized, size, driver_sound_params);
+		if (eq) equalizer_process_buffer (dsp_buf.data (), size, driver_sound_params);
+		if (sm) softmixer_process_buffer (dsp_buf.data (), size, driver_sound_params);
 
-		buf = equalized;
+		buf = dsp_buf.data ();
 	}
 
-	if (softmixer_is_active () || softmixer_is_mono ())
-	{
-		if (equalized)
-		{
-			softmixed = equalized;
-		}
-		else
-		{
-			softmixed = (char*) xmalloc (size);
-			memcpy (softmixed, buf, size);
-		}
-
-		softmixer_process_buffer (softmixed, size, driver_sound_params);
-
-		buf = softmixed;
-	}
-
-	int played;
-
-	played = hw->play (buf, size);
+	int played = hw->play (buf, size);
 
 	if (played < 0)
 		fatal ("Audio output error!");
 
-	if (softmixed && !equalized)
-		free (softmixed);
-
-	if (equalized)
-		free (equalized);
-
 	return played;
 }
 
@@ -558,6 +566,19 @@ int audio_get_time ()
 	return state != STATE_STOP ? out_buf_time_get (out_buf) : 0;
 }
 
+/* Same in nanoseconds. */
+int64_t audio_get_time_ns ()
+{
+	return state != STATE_STOP ? out_buf_time_ns (out_buf) : 0;
+}
+
+/* Same in frames at the device's rate (put into *rate, 0 if unknown). */
+int64_t audio_get_frames (int *rate)
+{
+	if (state == STATE_STOP) { *rate = 0; return 0; }
+	return out_buf_frames_get (out_buf, rate);
+}
+
 void audio_close ()
 {
 	if (audio_opened) {
@@ -640,6 +661,8 @@ void audio_initialize ()
 			       "Consider setting Allow24bitOutput to yes.");
 	}
 
+	logit ("Using %s sample conversion kernels", conv_kernels().name);
+
 	out_buf = out_buf_new (options::OutputBuffer * 1024);
 
 	equalizer_init();
@@ -778,11 +801,42 @@ void audio_files_mv(const str &file, const str &new_path)
 	UNLOCK (plist_mtx);
 }
 
-void audio_send_plist(Socket &socket)
+/* What the last CMD_PLIST_GET got (any client), so that a client that
+ * still has that only gets the changes. plist_sent_version counts the
+ * different lists that were sent, 0 means none. Guarded by plist_mtx. */
+static strings plist_sent;
+static uint32_t plist_sent_version = 0;
+
+/* Send the playlist as a diff to plist_sent if the client has that, or
+ * all of it. The diff keeps the longest common front and back and
+ * replaces what is between them, which is what adding, deleting or
+ * replacing a range of items looks like. */
+void audio_send_plist(Socket &socket, uint32_t version)
 {
 	LOCK (plist_mtx);
 	try{
-		socket.send(playlist.list());
+		const plist &pl = playlist.list();
+		const size_t n = pl.size(), m = plist_sent.size();
+		size_t front = 0, back = 0;
+		while (front < n && front < m && pl[front].path == plist_sent[front]) ++front;
+		while (back < n - front && back < m - front && pl[n-1-back].path == plist_sent[m-1-back]) ++back;
+
+		const bool diff = version && version == plist_sent_version;
+		if (front != n || n != m)
+		{
+			strings mid;
+			for (size_t i = front; i < n - back; ++i) mid.push_back(pl[i].path);
+			plist_sent.erase(plist_sent.begin() + front, plist_sent.end() - back);
+			plist_sent.insert(plist_sent.begin() + front,
+				std::make_move_iterator(mid.begin()), std::make_move_iterator(mid.end()));
+			if (!++plist_sent_version) ++plist_sent_version;
+		}
+		if (!diff) front = back = 0;
+
+		socket.send(plist_sent_version);
+		socket.send((uint32_t)front);
+		socket.send((uint32_t)back);
+		socket.send(pl, front, n - back);
 	}
 	catch (...)
 	{
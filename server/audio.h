@@ -6,7 +6,6 @@
 #include "../playlist.h"
 class Socket;
 
-// TODO: use indices a lot more and support the same file being in a playlist more than once
 
 /** Sound formats.
  *
@@ -214,13 +213,17 @@ void audio_fail_file (const str &path);
 
 int  audio_open (struct sound_params *sound_params);
 int  audio_send_buf (const char *buf, const size_t size);
-int  audio_send_pcm (const char *buf, const size_t size);
+char *audio_reserve_buf (const sound_params &sp, size_t &size);
+void audio_commit_buf (const size_t size);
+int  audio_send_pcm (const char *buf, size_t size);
 void audio_reset ();
 int  audio_get_bpf ();
 int  audio_get_bps ();
 int  audio_get_buf_fill ();
 void audio_close ();
 int  audio_get_time ();
+int64_t audio_get_time_ns ();
+int64_t audio_get_frames (int *rate);
 int  audio_get_state ();
 int  audio_get_prev_state ();
 void audio_plist_add (const str &file);
@@ -231,7 +234,7 @@ void audio_get_current(str &path, int &idx);
 void audio_set_mixer (const int val);
 int  audio_get_mixer ();
 void audio_plist_delete (int idx, int n);
-void audio_send_plist(Socket &socket);
+void audio_send_plist(Socket &socket, uint32_t version); // version the client has
 void audio_state_started_playing ();
 str  audio_get_mixer_channel_name ();
 void audio_toggle_mixer_channel ();
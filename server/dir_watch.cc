@@ -0,0 +1,336 @@
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <deque>
+#include <atomic>
+#include <unordered_map>
+
+#include "dir_watch.h"
+#include "server.h"
+#include "tags_cache.h"
+#include "library.h"
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+		IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct Dir
+{
+	str  path;
+	bool tree;     // part of the MusicDir tree
+	bool verified; // cached tags in here were checked since it is watched
+	int  shown;    // by how many clients
+};
+
+static tags_cache *tc = NULL;
+static int ino_fd = -1; /* inotify instance */
+static int wake_fd = -1; /* eventfd to wake the thread up for new work or exit */
+static pthread_t watch_tid;
+static std::atomic<bool> stop(false);
+
+/* All below are guarded by mtx */
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static std::unordered_map<int, Dir> dirs; // by watch descriptor
+static std::unordered_map<str, int> wds; // path -> watch descriptor
+static std::deque<str> todo; // tree directories to walk
+static bool tree_full = false; // ran out of inotify watches
+
+static void wake_up ()
+{
+	if (eventfd_write (wake_fd, 1) < 0)
+		log_errno ("Can't wake up the dir watch thread", errno);
+}
+
+static str sub_path (const str &dir, const char *name)
+{
+	return dir == "/" ? "/" + str(name) : dir + "/" + name;
+}
+
+/* Add a watch for path, mtx must be locked. Returns the watch descriptor
+ * or -1. */
+static int add_watch (const str &path, bool tree)
+{
+	auto i = wds.find(path);
+	if (i != wds.end())
+	{
+		dirs[i->second].tree |= tree;
+		return i->second;
+	}
+
+	int wd = inotify_add_watch (ino_fd, path.c_str(), WATCH_MASK);
+	if (wd < 0)
+	{
+		if (errno == ENOSPC && tree && !tree_full)
+		{
+			tree_full = true;
+			logit ("Out of inotify watches, not watching all of the music directory");
+		}
+		else if (errno != ENOSPC && errno != ENOENT)
+		{
+			char *err = xstrerror (errno);
+			logit ("Can't watch %s: %s", path.c_str(), err);
+			free (err);
+		}
+		return -1;
+	}
+
+	auto j = dirs.find(wd);
+	if (j != dirs.end())
+	{
+		// same directory through another path (symlink), keep the first
+		debug ("%s is already watched as %s", path.c_str(), j->second.path.c_str());
+		j->second.tree |= tree;
+		return wd;
+	}
+
+	wds[path] = wd;
+	Dir &d = dirs[wd];
+	d.path = path; d.tree = tree; d.verified = false; d.shown = 0;
+	return wd;
+}
+
+/* Forget about a watch, mtx must be locked. */
+static void drop_watch (int wd, bool rm)
+{
+	auto i = dirs.find(wd); if (i == dirs.end()) return;
+	wds.erase(i->second.path);
+	dirs.erase(i);
+	if (rm) inotify_rm_watch (ino_fd, wd);
+}
+
+/* Stop watching path and everything below it (it was moved away or
+ * deleted), mtx must be locked. */
+static void drop_tree (const str &path)
+{
+	str prefix = path + "/";
+	std::vector<int> gone;
+	for (auto &d : dirs)
+		if (d.second.path == path || !d.second.path.compare(0, prefix.length(), prefix))
+			gone.push_back(d.first);
+	for (int wd : gone) drop_watch (wd, true);
+}
+
+/* Watch the next directory from todo and check the cached tags of the
+ * files in it. Subdirectories are added to todo. Symlinks to directories
+ * are not followed (there might be loops). */
+static void walk_one ()
+{
+	LOCK (mtx);
+	if (todo.empty()) { UNLOCK (mtx); return; }
+	str path = std::move(todo.front()); todo.pop_front();
+	// watch it before reading it, so nothing falls through the cracks
+	int wd = tree_full ? -1 : add_watch (path, true);
+	UNLOCK (mtx);
+	if (wd < 0) return;
+
+	DIR *dir = opendir (path.c_str());
+	if (!dir) return;
+
+	strings subdirs;
+	dirent *e;
+	while ((e = readdir(dir)))
+	{
+		if (e->d_name[0] == '.' && (!e->d_name[1] || (e->d_name[1] == '.' && !e->d_name[2])))
+			continue;
+		str p = sub_path(path, e->d_name);
+
+		if (e->d_type == DT_DIR) { subdirs.push_back(std::move(p)); continue; }
+		if (e->d_type != DT_REG && e->d_type != DT_LNK && e->d_type != DT_UNKNOWN) continue;
+		if (!is_sound_file(p)) continue;
+
+		struct stat st;
+		if (fstatat (dirfd(dir), e->d_name, &st, 0) != 0) continue;
+		if (S_ISDIR(st.st_mode))
+		{
+			if (e->d_type == DT_UNKNOWN) subdirs.push_back(std::move(p));
+			continue;
+		}
+		tc->validate(p, st.st_mtime);
+	}
+	closedir (dir);
+
+	LOCK (mtx);
+	auto i = dirs.find(wd);
+	if (i != dirs.end()) i->second.verified = true;
+	for (auto &s : subdirs) todo.push_back(std::move(s));
+	UNLOCK (mtx);
+}
+
+/* Read and handle everything from the inotify fd. */
+static void read_events ()
+{
+	alignas(struct inotify_event) char buf[16384];
+	std::map<str, std::set<str>> changed; // by directory
+	std::set<str> tree_changed; // for the library
+
+	while (true)
+	{
+		ssize_t n = read (ino_fd, buf, sizeof(buf));
+		if (n <= 0)
+		{
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0 && errno != EAGAIN) log_errno ("Can't read inotify events", errno);
+			break;
+		}
+
+		for (char *p = buf; p < buf + n; )
+		{
+			auto *ev = (struct inotify_event *)p;
+			p += sizeof(struct inotify_event) + ev->len;
+
+			LOCK (mtx);
+			if (ev->mask & IN_Q_OVERFLOW)
+			{
+				// lost events: check everything again
+				logit ("inotify queue overflow");
+				for (auto &d : dirs)
+				{
+					d.second.verified = false;
+					if (d.second.shown) changed[d.second.path];
+				}
+				todo.clear();
+				if (options::WatchMusicDir && !options::MusicDir.empty())
+					todo.push_back(options::MusicDir);
+				UNLOCK (mtx);
+				continue;
+			}
+			if (ev->mask & IN_IGNORED)
+			{
+				drop_watch (ev->wd, false);
+				UNLOCK (mtx);
+				continue;
+			}
+			auto i = dirs.find(ev->wd);
+			if (i == dirs.end()) { UNLOCK (mtx); continue; }
+			str dir = i->second.path;
+			bool tree = i->second.tree, shown = i->second.shown;
+			if (ev->mask & IN_MOVE_SELF)
+			{
+				// the old path is wrong now, the parent gets IN_MOVED_FROM
+				drop_watch (ev->wd, true);
+				UNLOCK (mtx);
+				continue;
+			}
+			if (!ev->len) { UNLOCK (mtx); continue; }
+
+			str path = sub_path(dir, ev->name);
+			if (ev->mask & IN_ISDIR)
+			{
+				if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+					drop_tree (path);
+				else if (tree && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+					todo.push_back(path);
+				UNLOCK (mtx);
+			}
+			else
+			{
+				UNLOCK (mtx);
+				if (ev->mask != IN_CREATE) // empty so far
+					tc->invalidate(path);
+			}
+			if (shown) changed[dir].insert(path);
+			if (tree) tree_changed.insert(dir);
+		}
+	}
+
+	for (auto &d : tree_changed) library_dir_changed (d);
+
+	for (auto &c : changed)
+		dir_changed (c.first, strings(c.second.begin(), c.second.end()));
+}
+
+static void *watch_thread (void *)
+{
+	logit ("Dir watch thread started");
+
+	struct pollfd fds[2];
+	fds[0].fd = ino_fd;  fds[0].events = POLLIN;
+	fds[1].fd = wake_fd; fds[1].events = POLLIN;
+
+	while (true)
+	{
+		LOCK (mtx);
+		bool idle = todo.empty();
+		UNLOCK (mtx);
+
+		// walking the tree goes one directory at a time between events
+		int rc = poll (fds, 2, idle ? -1 : 0);
+		if (rc < 0 && errno != EINTR) fatal ("poll() failed: %s", xstrerror (errno));
+
+		if (rc > 0 && (fds[1].revents & POLLIN))
+		{
+			eventfd_t w;
+			eventfd_read (wake_fd, &w);
+		}
+		if (stop) break;
+		if (rc > 0 && (fds[0].revents & POLLIN)) read_events ();
+		walk_one ();
+	}
+
+	logit ("Exiting dir watch thread");
+	return NULL;
+}
+
+void dir_watch_init (tags_cache *cache)
+{
+	assert (cache && ino_fd == -1);
+	tc = cache;
+
+	ino_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+	if (ino_fd == -1)
+	{
+		log_errno ("inotify_init1() failed, not watching directories", errno);
+		return;
+	}
+	wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd == -1) fatal ("eventfd() failed: %s", xstrerror (errno));
+
+	if (options::WatchMusicDir && !options::MusicDir.empty())
+		todo.push_back(options::MusicDir);
+
+	int rc = pthread_create (&watch_tid, NULL, watch_thread, NULL);
+	if (rc != 0) fatal ("Can't create dir watch thread: %s", xstrerror (rc));
+}
+
+void dir_watch_exit ()
+{
+	if (ino_fd == -1) return;
+
+	stop = true;
+	wake_up ();
+	int rc = pthread_join (watch_tid, NULL);
+	if (rc != 0) fatal ("pthread_join() on dir watch thread failed: %s", xstrerror (rc));
+
+	close (ino_fd); ino_fd = -1;
+	close (wake_fd); wake_fd = -1;
+	dirs.clear(); wds.clear(); todo.clear();
+	tc = NULL;
+}
+
+void dir_watch_show (const str &dir)
+{
+	if (ino_fd == -1) return;
+	LockGuard g(mtx);
+	int wd = add_watch (dir, false);
+	if (wd >= 0) ++dirs[wd].shown;
+}
+
+void dir_watch_hide (const str &dir)
+{
+	if (ino_fd == -1) return;
+	LockGuard g(mtx);
+	auto i = wds.find(dir); if (i == wds.end()) return;
+	Dir &d = dirs[i->second];
+	if (--d.shown <= 0 && !d.tree) drop_watch (i->second, true);
+}
+
+bool dir_watch_verified (const str &file)
+{
+	if (ino_fd == -1) return false;
+	str dir = containing_directory(file);
+	LockGuard g(mtx);
+	auto i = wds.find(dir); if (i == wds.end()) return false;
+	return dirs[i->second].verified;
+}
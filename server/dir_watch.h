@@ -0,0 +1,25 @@
+#pragma once
+class tags_cache;
+
+/* Watching directories with inotify.
+ *
+ * The MusicDir tree is watched if options::WatchMusicDir is set, and so
+ * is every directory that a client shows. When a file changes, its entry
+ * in the tags cache is dropped right away and clients that show the
+ * directory get an EV_DIR_CHANGED (through dir_changed()).
+ *
+ * Entries in the tags cache for files in the watched tree are checked
+ * once when the tree is walked. After that they can be trusted without
+ * a stat(), see dir_watch_verified().
+ */
+
+void dir_watch_init (tags_cache *tc);
+void dir_watch_exit ();
+
+/* A client started or stopped showing dir. */
+void dir_watch_show (const str &dir);
+void dir_watch_hide (const str &dir);
+
+/* Would a change to file have been noticed (so that its cached tags are
+ * current if there are any)? */
+bool dir_watch_verified (const str &file);
@@ -13,6 +13,7 @@
 #include "inputs.h"
 #include <taglib/fileref.h>
 #include <taglib/tag.h>
+#include <unordered_map>
 
 //-----------------------------------------------------------------------------
 // Decoder methods
@@ -158,43 +159,45 @@ struct decoder_preference
 static std::vector<decoder_preference> preferences;
 static std::vector<int> default_decoder_list;
 
-/* Return the index of the first decoder able to handle audio with the
- * given filename extension and/or MIME media type, or -1 if none can. */
-static Decoder* find_decoder (const char *file, str *mime)
+/* preferences by lowercase "type/subtype" for MIME types and ".ext" for
+ * extensions (set up in decoder_init) */
+static std::unordered_map<str, const decoder_preference*> preference_map;
+
+/* What find_decoder() found, by MIME type and extension as they were
+ * (some decoders match extensions case sensitively). The decoders can
+ * only tell if they take a given extension, so this fills up as files
+ * are seen instead of being made up front. */
+static std::unordered_map<str, Decoder*> lookup_cache;
+static pthread_rwlock_t lookup_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static str lower (str s)
+{
+	for (char &c : s) c = tolower((unsigned char)c);
+	return s;
+}
+
+static const std::vector<int> *preferred (const str &key)
+{
+	auto i = preference_map.find(key);
+	return i == preference_map.end() ? NULL : &i->second->decoder_list;
+}
+
+/* Return the first decoder able to handle audio with the given filename
+ * extension and/or MIME media type, or NULL if none can. */
+static Decoder* match_decoder (const str *mime, const char *ext)
 {
 	const std::vector<int> *decoder_list = NULL;
 
 	// lookup by mime type first, if we have it
-	str m, type, subtype;
-	if (mime && !mime->empty())
-	{
-		type = *mime;
-		split_mime(type, subtype);
-	}
-	else if (options::UseMimeMagic && file && *file)
+	if (mime)
 	{
-		m = type = file_mime_type(file);
+		str type = *mime, subtype;
 		split_mime(type, subtype);
-		mime = m.empty() ? NULL : &m;
-	}
-	else mime = NULL;
-	if (!type.empty()) for (auto &pref : preferences)
-	{
-		if (strcasecmp(pref.type.c_str(), type.c_str()) ||
-		    strcasecmp(pref.subtype.c_str(), subtype.c_str())) continue;
-		decoder_list = &pref.decoder_list;
-		break;
+		decoder_list = preferred(lower(type + "/" + subtype));
 	}
 
 	// if not found, try extension
-	const char *ext = file ? ext_pos(file) : NULL;
-	if (!decoder_list && ext) for (auto &pref : preferences)
-	{
-		if (!pref.subtype.empty() || strcasecmp(pref.type.c_str(), ext)) continue;
-		decoder_list = &pref.decoder_list;
-		break;
-	}
-	if (!mime && !ext) return NULL;
+	if (!decoder_list && ext) decoder_list = preferred(lower(str(".") + ext));
 
 	// try all of them, if we have no preference
 	if (!decoder_list) decoder_list = &default_decoder_list;
@@ -210,6 +213,35 @@ static Decoder* find_decoder (const char *file, str *mime)
 	return NULL;
 }
 
+static Decoder* find_decoder (const char *file, str *mime)
+{
+	str m;
+	if (!mime || mime->empty())
+	{
+		mime = NULL;
+		char *t = (options::UseMimeMagic && file && *file) ? file_mime_type(file) : NULL;
+		if (t) { m = t; free(t); }
+		if (!m.empty()) mime = &m;
+	}
+
+	const char *ext = file ? ext_pos(file) : NULL;
+	if (!mime && !ext) return NULL;
+
+	str key = (mime ? *mime : str()) + "|" + (ext ? ext : "");
+	pthread_rwlock_rdlock (&lookup_lock);
+	auto i = lookup_cache.find(key);
+	bool found = (i != lookup_cache.end());
+	Decoder *d = found ? i->second : NULL;
+	pthread_rwlock_unlock (&lookup_lock);
+	if (found) return d;
+
+	d = match_decoder(mime, ext);
+	pthread_rwlock_wrlock (&lookup_lock);
+	lookup_cache.emplace(std::move(key), d);
+	pthread_rwlock_unlock (&lookup_lock);
+	return d;
+}
+
 bool is_sound_file (const str &name)
 {
 	return find_decoder(name.c_str(), NULL);
@@ -269,10 +301,19 @@ void decoder_init()
 	"oga(vorbis,*,ffmpeg)", "ogg(vorbis,*,ffmpeg)", "ogv(ffmpeg)", "application/ogg(vorbis)",
 	"audio/ogg(vorbis)", "flac(flac,*,ffmpeg)", "opus(ffmpeg)", "spx(speex)", "noise(noise)"};
 	for (auto *s : PreferredDecoders) preferences.emplace_back(s);
+
+	// the first one wins, like the linear search did
+	for (auto &pref : preferences)
+	{
+		str key = pref.subtype.empty() ? "." + pref.type : pref.type + "/" + pref.subtype;
+		preference_map.emplace(lower(key), &pref);
+	}
 }
 
 void decoder_cleanup ()
 {
+	lookup_cache.clear();
+	preference_map.clear();
 	preferences.clear();
 	default_decoder_list.clear();
 	for (auto &p : plugins) delete p.decoder;
@@ -9,32 +9,106 @@
  *
  */
 
-/* TODO:
- * - handle SIGBUS (mmap() read error)
- */
-
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <inttypes.h>
-#ifdef HAVE_MMAP
-# include <sys/mman.h>
-#endif
+#include <setjmp.h>
+#include <signal.h>
+#include <atomic>
 #include "io.h"
 
+/* f_type of file systems that get the readahead buffer instead of mmap() */
+static bool network_fs (int fd)
+{
+	struct statfs fs;
+	if (fstatfs(fd, &fs) != 0) return false;
+	switch ((uint32_t)fs.f_type)
+	{
+		case 0x6969:     // NFS
+		case 0x517B:     // SMB
+		case 0xFF534D42: // CIFS
+		case 0xFE534D42: // SMB2
+		case 0x65735546: // FUSE (sshfs, ...)
+		case 0x564C:     // NCP
+		case 0x73757245: // Coda
+		case 0x01021997: // 9P
+			return true;
+	}
+	return false;
+}
+
+/* Reading a mapped file that got shorter since raises SIGBUS. Copies from
+ * the mapping go through mapped_copy(), which catches it and returns false
+ * so we can switch to pread(). A SIGBUS anywhere else is not ours and
+ * kills us as usual. */
+static thread_local sigjmp_buf *bus_jmp = NULL;
+
+static void sig_bus (int sig)
+{
+	if (bus_jmp) siglongjmp (*bus_jmp, 1);
+	signal (SIGBUS, SIG_DFL);
+	raise (SIGBUS);
+}
+
+static void catch_sig_bus () { xsignal (SIGBUS, sig_bus); }
+
+static bool mapped_copy (void *dst, const char *src, size_t n)
+{
+	sigjmp_buf jmp;
+	if (sigsetjmp (jmp, 1))
+	{
+		bus_jmp = NULL;
+		return false;
+	}
+	bus_jmp = &jmp;
+	std::atomic_signal_fence (std::memory_order_seq_cst);
+	memcpy (dst, src, n);
+	std::atomic_signal_fence (std::memory_order_seq_cst);
+	bus_jmp = NULL;
+	return true;
+}
+
 io_stream::io_stream(const char *file)
 : fd(-1)
 , pos(0)
 , size(0)
 , eof(false)
+, map(NULL)
+, ra_pos(0)
+, ra_len(0)
 {
-	fd = open (file, O_RDONLY);
+	fd = open (file, O_RDONLY | O_CLOEXEC);
 	if (fd >= 0)
 	{
 		struct stat file_stat;
 		if (fstat(fd, &file_stat) != -1)
 		{
 			size = file_stat.st_size;
+			posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+			if (!S_ISREG(file_stat.st_mode) || !size || (uint64_t)size > SIZE_MAX)
+				return;
+			if (network_fs (fd))
+			{
+				if (options::NetworkReadAhead > 0)
+					ra.resize((size_t)options::NetworkReadAhead * 1024);
+				return;
+			}
+
+			static pthread_once_t once = PTHREAD_ONCE_INIT;
+			pthread_once (&once, catch_sig_bus);
+
+			void *p = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+			if (p != MAP_FAILED)
+			{
+				map = (const char *)p;
+				madvise (p, size, MADV_SEQUENTIAL);
+			}
+			else
+				log_errno ("mmap() failed, reading the file instead", errno);
 			return;
 		}
 		close(fd);
@@ -47,9 +121,22 @@ io_stream::io_stream(const char *file)
 
 io_stream::~io_stream()
 {
+	unmap();
 	if (fd >= 0) close(fd);
 }
 
+/* Stop using the mapping (after a SIGBUS). */
+void io_stream::unmap()
+{
+	if (!map) return;
+	munmap ((void *)map, size);
+	map = NULL;
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != -1) size = file_stat.st_size;
+	if (pos > size) pos = size;
+}
+
 off_t io_stream::seek(off_t offset, int whence)
 {
 	off_t new_pos = 0;
@@ -59,23 +146,60 @@ off_t io_stream::seek(off_t offset, int whence)
 	case SEEK_END: new_pos = size + offset; break;
 	default: fatal ("Bad whence value: %d", whence);
 	}
-	new_pos = CLAMP(0, new_pos, size);
-	off_t res = lseek(fd, new_pos, SEEK_SET);
-	if (res != -1)
+	pos = CLAMP(0, new_pos, size);
+	eof = (pos >= size);
+	debug ("Seek to: %" PRId64, (int64_t)pos);
+
+	// decoders read on from there
+	if (map && !eof)
 	{
-		pos = res;
-		eof = (pos >= size);
-		debug ("Seek to: %" PRId64, res);
+		static const off_t page = sysconf(_SC_PAGESIZE);
+		off_t p = pos - pos % page;
+		madvise ((void *)(map + p), std::min(size - p, (off_t)(256*1024)), MADV_WILLNEED);
 	}
-	else
-		logit ("Seek error");
-	return res;
+	return pos;
+}
+
+ssize_t io_stream::get(void *buf, size_t count)
+{
+	if (map)
+	{
+		size_t n = (size_t)std::min((off_t)count, size - pos);
+		if (mapped_copy (buf, map + pos, n)) return n;
+		logit ("File got truncated while it was read");
+		unmap();
+	}
+
+	if (ra.empty() || count >= ra.size())
+	{
+		ssize_t res;
+		do res = pread (fd, buf, count, pos); while (res < 0 && errno == EINTR);
+		return res;
+	}
+
+	size_t done = 0;
+	while (done < count)
+	{
+		const off_t at = pos + done;
+		if (at < ra_pos || at >= ra_pos + (off_t)ra_len)
+		{
+			ssize_t res;
+			do res = pread (fd, ra.data(), ra.size(), at); while (res < 0 && errno == EINTR);
+			if (res < 0) return done ? (ssize_t)done : -1;
+			ra_pos = at; ra_len = res;
+			if (!res) break;
+		}
+		size_t k = std::min(count - done, (size_t)(ra_pos + ra_len - at));
+		memcpy ((char *)buf + done, ra.data() + (at - ra_pos), k);
+		done += k;
+	}
+	return done;
 }
 
 ssize_t io_stream::read(void *buf, size_t count)
 {
 	assert(buf);
-	ssize_t res = ::read(fd, buf, count);
+	ssize_t res = get(buf, count);
 	if (res < 0) return -1;
 	if (res == 0) eof = 1;
 	pos += res;
@@ -85,8 +209,5 @@ ssize_t io_stream::read(void *buf, size_t count)
 ssize_t io_stream::peek(void *buf, size_t count)
 {
 	assert(buf);
-	ssize_t res = ::read(fd, buf, count);
-	if (res < 0) return -1;
-	if (lseek(fd, -res, SEEK_CUR) < 0) return -1;
-	return res;
+	return get(buf, count);
 }
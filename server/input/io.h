@@ -17,6 +17,18 @@ struct io_stream
 	off_t   pos;        /* current position in the file from the user point of view */
 	off_t   size;       /* size of the file */
 	bool    eof;        /* was the end of file reached? */
+
+private:
+	/* Local files are mapped, files on network file systems are read in
+	 * large chunks (options::NetworkReadAhead) and anything else (or when
+	 * mapping fails) with a pread() per request. */
+	const char *map;    /* all of the file or NULL */
+	std::vector<char> ra; /* readahead buffer, empty if not used */
+	off_t   ra_pos;     /* file offset of ra[0] */
+	size_t  ra_len;     /* how much of ra is valid */
+
+	ssize_t get(void *buf, size_t count); /* read at pos without moving it */
+	void    unmap();
 };
 
 inline ssize_t io_read(io_stream *s, void *buf, size_t count) { assert(s); return s->read(buf, count); }
@@ -0,0 +1,514 @@
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <deque>
+#include <atomic>
+#include <unordered_map>
+
+#include "library.h"
+#include "tags_cache.h"
+#include "../playlist.h"
+
+#define LIBRARY_FILE	"library"
+#define LIBRARY_MAGIC	"AMOCLIB3"
+
+/* Don't write the file more often than this (seconds) */
+#define SAVE_INTERVAL	60
+
+struct Entry
+{
+	str       name;
+	file_type type; // F_DIR, F_SOUND or F_PLAYLIST
+	uint64_t  size;
+	time_t    mtime;
+};
+
+typedef std::pair<dev_t, ino_t> Inode;
+
+struct Dir
+{
+	int64_t mtime; // in ns, when we last read it (seconds are too coarse here)
+	Inode   inode;
+	str     alias; // the same directory is read under this path (symlinks)
+	std::vector<Entry> entries; // sorted like plist::sort(), empty for aliases
+};
+
+struct Job
+{
+	str  path;
+	bool deep; // read subdirectories too
+};
+
+static tags_cache *tc = NULL;
+static std::vector<pthread_t> threads;
+
+/* All below are guarded by mtx */
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  cond = PTHREAD_COND_INITIALIZER;
+static std::unordered_map<str, Dir> dirs; // by path
+static std::map<Inode, str> inodes; // which path a directory is read as
+static std::deque<Job> todo;
+static int  busy = 0; // jobs being worked on
+static bool ready = false; // dirs has all of MusicDir, checked since we started
+static bool dirty = false; // dirs changed since it was saved
+static bool saving = false; // a thread is writing the file
+static std::atomic<bool> stop(false);
+static time_t last_save = 0;
+
+static str sub_path (const str &dir, const str &name)
+{
+	return dir == "/" ? "/" + name : dir + "/" + name;
+}
+
+/* Remove path and everything below it, mtx must be locked. */
+static void remove_tree (const str &path)
+{
+	auto i = dirs.find(path); if (i == dirs.end()) return;
+	for (auto &e : i->second.entries)
+		if (e.type == F_DIR) remove_tree (sub_path(path, e.name));
+
+	auto k = inodes.find(i->second.inode);
+	if (i->second.alias.empty() && k != inodes.end() && k->second == path)
+	{
+		// its aliases have to be read themselves now
+		inodes.erase(k);
+		for (auto &d : dirs) if (d.second.alias == path)
+		{
+			d.second.mtime = -1;
+			todo.push_back(Job{d.first, true});
+		}
+	}
+	dirs.erase(i);
+	dirty = true;
+}
+
+/* The path that the directory at path is read as, if that isn't path
+ * itself (else ""). mtx must be locked. Claims that were overtaken by
+ * events (the directory there is gone or another one) are replaced. */
+static str holder (const str &path, const Inode &inode)
+{
+	auto r = inodes.emplace(inode, path);
+	if (r.second || r.first->second == path) return str();
+	auto i = dirs.find(r.first->second);
+	if (i != dirs.end() && i->second.alias.empty() && i->second.inode == inode)
+		return r.first->second;
+	r.first->second = path;
+	return str();
+}
+
+//----------------------------------------------------------------------
+// the file
+//----------------------------------------------------------------------
+
+template<typename T> static void put (FILE *f, T x) { fwrite(&x, sizeof(T), 1, f); }
+static void put (FILE *f, const str &s) { put(f, (uint32_t)s.length()); fwrite(s.data(), 1, s.length(), f); }
+
+template<typename T> static bool get (FILE *f, T &x) { return fread(&x, sizeof(T), 1, f) == 1; }
+static bool get (FILE *f, str &s)
+{
+	uint32_t n; if (!get(f, n) || n > 4096) return false;
+	s.resize(n); return fread(&s[0], 1, n, f) == n;
+}
+
+template<typename T> static void put (str &f, T x) { f.append((const char *)&x, sizeof(T)); }
+static void put (str &f, const str &s) { put(f, (uint32_t)s.length()); f.append(s); }
+
+/* The file's contents, mtx must be locked. */
+static str serialize ()
+{
+	str f;
+	f.append(LIBRARY_MAGIC, 8);
+	put(f, options::MusicDir);
+	put(f, (uint8_t)options::ShowHiddenFiles);
+	put(f, (uint64_t)dirs.size());
+	for (auto &d : dirs)
+	{
+		put(f, d.first);
+		put(f, d.second.mtime);
+		put(f, (uint64_t)d.second.inode.first);
+		put(f, (uint64_t)d.second.inode.second);
+		put(f, d.second.alias);
+		put(f, (uint32_t)d.second.entries.size());
+		for (auto &e : d.second.entries)
+		{
+			put(f, e.name);
+			put(f, (uint8_t)e.type);
+			put(f, e.size);
+			put(f, (int64_t)e.mtime);
+		}
+	}
+	return f;
+}
+
+/* Write data to the file, without mtx locked (it takes a while). */
+static bool write_file (const str &data, size_t n_dirs)
+{
+	str path = options::run_file_path(LIBRARY_FILE), tmp = path + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (!f) { log_errno ("Can't write the library", errno); return false; }
+
+	bool ok = fwrite(data.data(), 1, data.length(), f) == data.length();
+	ok = ok && fflush(f) == 0 && fdatasync(fileno(f)) == 0;
+	ok = (fclose(f) == 0) && ok;
+	if (ok && rename(tmp.c_str(), path.c_str()) != 0) ok = false;
+	if (!ok)
+	{
+		log_errno ("Can't write the library", errno);
+		unlink(tmp.c_str());
+		return false;
+	}
+
+	debug ("Library saved (%d directories)", (int)n_dirs);
+	return true;
+}
+
+/* Save dirs, mtx must be locked. It is unlocked while writing. */
+static void save ()
+{
+	if (saving) return;
+	saving = true;
+	dirty = false;
+	last_save = time(NULL);
+	str data = serialize();
+	size_t n = dirs.size();
+
+	UNLOCK (mtx);
+	bool ok = write_file (data, n);
+	LOCK (mtx);
+
+	if (!ok) dirty = true;
+	saving = false;
+}
+
+/* Read the file into dirs (before the threads start). */
+static bool load ()
+{
+	FILE *f = fopen(options::run_file_path(LIBRARY_FILE).c_str(), "r");
+	if (!f) return false;
+
+	char magic[8]; str root; uint8_t show_hidden; uint64_t n;
+	bool ok = fread(magic, 1, 8, f) == 8 && !memcmp(magic, LIBRARY_MAGIC, 8)
+		&& get(f, root) && root == options::MusicDir
+		&& get(f, show_hidden) && show_hidden == options::ShowHiddenFiles && get(f, n);
+
+	for (uint64_t i = 0; ok && i < n; ++i)
+	{
+		str path, alias; int64_t mtime; uint64_t dev, ino; uint32_t m;
+		ok = get(f, path) && get(f, mtime) && get(f, dev) && get(f, ino) && get(f, alias) && get(f, m);
+		if (!ok) break;
+
+		Dir &d = dirs[path];
+		d.mtime = mtime;
+		d.inode = Inode((dev_t)dev, (ino_t)ino);
+		d.alias = std::move(alias);
+		if (d.alias.empty()) inodes[d.inode] = path;
+		d.entries.resize(m);
+		for (auto &e : d.entries)
+		{
+			uint8_t t; int64_t mt;
+			ok = get(f, e.name) && get(f, t) && get(f, e.size) && get(f, mt);
+			if (!ok) break;
+			e.type = (file_type)t; e.mtime = (time_t)mt;
+		}
+	}
+	fclose(f);
+
+	if (!ok)
+	{
+		logit ("Library file is damaged or for other options, rebuilding it");
+		dirs.clear(); inodes.clear();
+		return false;
+	}
+	logit ("Library loaded (%d directories)", (int)dirs.size());
+	return true;
+}
+
+//----------------------------------------------------------------------
+// reading directories
+//----------------------------------------------------------------------
+
+/* Same rule as plist::add_directory. */
+static bool hidden (const char *name)
+{
+	if (name[0] != '.') return false;
+	if (!name[1] || (name[1] == '.' && !name[2])) return true;
+	return !options::ShowHiddenFiles;
+}
+
+/* Check the mtimes and sizes of the sound files in an unchanged
+ * directory. */
+static void refresh (int fd, const str &path, int64_t mtime, std::vector<Entry> &entries)
+{
+	strings changed; std::vector<time_t> mtimes;
+	for (auto &e : entries)
+	{
+		if (e.type != F_SOUND) continue;
+		struct stat st;
+		if (fstatat(fd, e.name.c_str(), &st, 0) != 0) { e.mtime = (time_t)-1; continue; }
+		if (st.st_mtime == e.mtime && (uint64_t)st.st_size == e.size) continue;
+		e.mtime = st.st_mtime; e.size = st.st_size;
+		changed.push_back(sub_path(path, e.name));
+		mtimes.push_back(e.mtime);
+	}
+	if (changed.empty()) return;
+
+	LOCK (mtx);
+	auto i = dirs.find(path);
+	if (i != dirs.end() && i->second.alias.empty() && i->second.mtime == mtime)
+	{
+		i->second.entries = std::move(entries);
+		dirty = true;
+	}
+	UNLOCK (mtx);
+
+	if (options::ReadTags) for (size_t i = 0; i < changed.size() && !stop; ++i)
+		tc->get_immediate(changed[i], mtimes[i]);
+}
+
+/* Read one directory. Unchanged directories are not read again (their
+ * subdirectories still are if deep is set). */
+static void scan (const Job &job)
+{
+	const str &path = job.path;
+
+	int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		if (fd >= 0) close(fd);
+		LockGuard g(mtx);
+		remove_tree (path);
+		return;
+	}
+
+	const int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	const Inode inode(st.st_dev, st.st_ino);
+
+	LOCK (mtx);
+	auto old = dirs.find(path);
+
+	// the same directory through another path (symlinks) is only read once
+	str h = holder(path, inode);
+	if (!h.empty())
+	{
+		if (old != dirs.end()) for (auto &e : old->second.entries)
+			if (e.type == F_DIR) remove_tree (sub_path(path, e.name));
+		Dir &d = dirs[path];
+		d.mtime = mtime; d.inode = inode; d.alias = h; d.entries.clear();
+		dirty = true;
+		UNLOCK (mtx);
+		close(fd);
+		return;
+	}
+
+	if (old != dirs.end() && old->second.mtime == mtime && old->second.alias.empty())
+	{
+		if (job.deep) for (auto &e : old->second.entries)
+			if (e.type == F_DIR) todo.push_back(Job{sub_path(path, e.name), true});
+		if (ready)
+		{
+			UNLOCK (mtx);
+			close(fd);
+			return;
+		}
+		// Files can change without changing the directory, so the first
+		// time after a restart their mtimes are checked.
+		std::vector<Entry> entries = old->second.entries;
+		UNLOCK (mtx);
+		refresh (fd, path, mtime, entries);
+		close(fd);
+		return;
+	}
+	std::map<str, Entry> known; // what we had before
+	if (old != dirs.end()) for (auto &e : old->second.entries) known[e.name] = e;
+	UNLOCK (mtx);
+
+	DIR *dir = fdopendir(fd);
+	if (!dir) { close(fd); return; }
+
+	std::vector<plist_item> items;
+	std::map<str, Entry> found;
+	strings changed; std::vector<time_t> mtimes; // need new tags
+	while (dirent *de = readdir(dir))
+	{
+		if (hidden(de->d_name)) continue;
+		str p = sub_path(path, de->d_name);
+
+		Entry e; e.name = de->d_name; e.size = 0; e.mtime = (time_t)-1;
+		if (de->d_type == DT_DIR)
+			e.type = F_DIR;
+		else if (de->d_type != DT_REG && de->d_type != DT_LNK && de->d_type != DT_UNKNOWN)
+			continue;
+		else if (is_plist_file(p))
+			e.type = F_PLAYLIST;
+		else if (is_sound_file(p))
+		{
+			struct stat fst;
+			if (fstatat(dirfd(dir), de->d_name, &fst, 0) != 0 || !S_ISREG(fst.st_mode)) continue;
+			e.type = F_SOUND; e.size = fst.st_size; e.mtime = fst.st_mtime;
+			auto k = known.find(e.name);
+			if (k == known.end() || k->second.mtime != e.mtime || k->second.size != e.size)
+			{
+				changed.push_back(p);
+				mtimes.push_back(e.mtime);
+			}
+		}
+		else if (de->d_type != DT_REG)
+		{
+			// symlinks to directories are followed like add_directory()
+			// does, loops are caught by holder()
+			struct stat lst;
+			if (fstatat(dirfd(dir), de->d_name, &lst, 0) != 0 || !S_ISDIR(lst.st_mode)) continue;
+			e.type = F_DIR;
+		}
+		else continue;
+
+		items.emplace_back(p, e.type, e.mtime);
+		found[e.name] = std::move(e);
+	}
+	closedir(dir);
+
+	std::sort(items.begin(), items.end());
+	Dir d; d.mtime = mtime; d.inode = inode;
+	for (auto &it : items) d.entries.push_back(std::move(found[file_name(it.path)]));
+
+	LOCK (mtx);
+	for (auto &k : known)
+		if (k.second.type == F_DIR && !found.count(k.first))
+			remove_tree (sub_path(path, k.first));
+	for (auto &e : d.entries)
+		if (e.type == F_DIR && (job.deep || !known.count(e.name)))
+			todo.push_back(Job{sub_path(path, e.name), true});
+	dirs[path] = std::move(d);
+	dirty = true;
+	UNLOCK (mtx);
+
+	// the tags cache remembers these for later
+	if (options::ReadTags) for (size_t i = 0; i < changed.size() && !stop; ++i)
+		tc->get_immediate(changed[i], mtimes[i]);
+}
+
+static void *library_thread (void *)
+{
+	LOCK (mtx);
+	while (!stop)
+	{
+		if (todo.empty())
+		{
+			if (!busy && !ready)
+			{
+				ready = true;
+				logit ("Library is complete (%d directories)", (int)dirs.size());
+			}
+			if (!busy && dirty && !saving && time(NULL) - last_save >= SAVE_INTERVAL)
+			{
+				save (); // unlocks mtx for a while
+				continue;
+			}
+			pthread_cond_wait (&cond, &mtx);
+			continue;
+		}
+
+		Job job = std::move(todo.front()); todo.pop_front();
+		++busy;
+		UNLOCK (mtx);
+		scan (job);
+		LOCK (mtx);
+		--busy;
+		if (!todo.empty() || !busy) pthread_cond_broadcast (&cond);
+	}
+	UNLOCK (mtx);
+	return NULL;
+}
+
+void library_init (tags_cache *cache)
+{
+	assert (cache && threads.empty());
+	if (!options::IndexMusicDir || options::MusicDir.empty()) return;
+	tc = cache;
+	stop = false;
+
+	load ();
+	ready = false; // not before everything was checked once
+	last_save = time(NULL);
+	todo.push_back(Job{options::MusicDir, true});
+
+	int n = std::min(16L, std::max(2L, sysconf(_SC_NPROCESSORS_ONLN)));
+	for (int i = 0; i < n; ++i)
+	{
+		pthread_t tid;
+		int rc = pthread_create (&tid, NULL, library_thread, NULL);
+		if (rc != 0) fatal ("Can't create library thread: %s", xstrerror (rc));
+		threads.push_back(tid);
+	}
+	logit ("Indexing %s with %d threads", options::MusicDir.c_str(), n);
+}
+
+void library_exit ()
+{
+	if (threads.empty()) return;
+
+	LOCK (mtx);
+	stop = true;
+	pthread_cond_broadcast (&cond);
+	UNLOCK (mtx);
+
+	for (pthread_t tid : threads)
+	{
+		int rc = pthread_join (tid, NULL);
+		if (rc != 0) fatal ("pthread_join() on library thread failed: %s", xstrerror (rc));
+	}
+	threads.clear();
+
+	// only save complete ones, or the next start would take it as done
+	LOCK (mtx);
+	if (dirty && ready) save ();
+	UNLOCK (mtx);
+	dirs.clear(); inodes.clear(); todo.clear();
+	tc = NULL;
+}
+
+void library_dir_changed (const str &dir)
+{
+	if (threads.empty()) return;
+	LockGuard g(mtx);
+	auto i = dirs.find(dir);
+	if (i == dirs.end()) return; // not ours or not read yet
+	if (!i->second.alias.empty())
+	{
+		i = dirs.find(i->second.alias);
+		if (i == dirs.end()) return;
+	}
+	i->second.mtime = -1; // file changes don't touch the directory's mtime
+	todo.push_back(Job{i->first, false});
+	pthread_cond_signal (&cond);
+}
+
+/* List the files below path, which is read as key (they differ below
+ * aliases). Directories are only listed once, like add_directory() does
+ * against symlink loops. */
+static void list (const str &path, str key, std::set<Inode> &done, std::vector<std::pair<str, time_t>> &files)
+{
+	auto i = dirs.find(key); if (i == dirs.end()) return;
+	if (!i->second.alias.empty())
+	{
+		key = i->second.alias;
+		i = dirs.find(key); if (i == dirs.end()) return;
+	}
+	if (!done.insert(i->second.inode).second) return;
+
+	for (auto &e : i->second.entries)
+		if (e.type == F_DIR) list (sub_path(path, e.name), sub_path(key, e.name), done, files);
+	for (auto &e : i->second.entries)
+		if (e.type == F_SOUND) files.emplace_back(sub_path(path, e.name), e.mtime);
+}
+
+bool library_list (const str &dir, std::vector<std::pair<str, time_t>> &files)
+{
+	if (threads.empty()) return false;
+	LockGuard g(mtx);
+	if (!ready || !dirs.count(dir)) return false;
+	std::set<Inode> done;
+	list (dir, dir, done, files);
+	return true;
+}
@@ -0,0 +1,31 @@
+#pragma once
+class tags_cache;
+
+/* The library: an index of all directories, sound files and playlists
+ * under MusicDir, kept in RunDir/library.
+ *
+ * It is built in the background by a few threads. After a restart only
+ * the directories whose mtime changed are read again (one stat per
+ * directory instead of one per file). Tags for new or changed files are
+ * read into the tags cache along the way. dir_watch tells it about
+ * changes with library_dir_changed().
+ *
+ * Adding a directory to a playlist can then be answered from memory with
+ * library_list() instead of walking the file system. That only starts
+ * once every directory was checked after the start, including the mtimes
+ * of the files in directories that did not change.
+ *
+ * Symlinked directories are followed. A directory that is reachable
+ * through more than one path is only read under one of them, the others
+ * are aliases for it.
+ */
+
+void library_init (tags_cache *tc);
+void library_exit ();
+
+/* Something in dir changed, read it again. */
+void library_dir_changed (const str &dir);
+
+/* All sound files below dir (in the order of plist::add_directory) with
+ * their mtimes. Returns false if dir is not indexed. */
+bool library_list (const str &dir, std::vector<std::pair<str, time_t>> &files);
@@ -18,8 +18,8 @@
 
 #include <math.h>
 #include <samplerate.h>
-#include <byteswap.h>
 #include "audio_conversion.h"
+#include "conv_kernels.h"
 
 static void float_to_u8 (const float *in, unsigned char *out,
 		const size_t samples)
@@ -81,26 +81,6 @@ static void float_to_u16 (const float *in, unsigned char *out,
 	}
 }
 
-static void float_to_s16 (const float *in, char *out, const size_t samples)
-{
-	size_t i;
-
-	assert (in != NULL);
-	assert (out != NULL);
-
-	for (i = 0; i < samples; i++) {
-		int16_t *out_val = (int16_t *)(out + i * sizeof (int16_t));
-		float f = in[i] * INT32_MAX;
-
-		if (f >= INT32_MAX)
-			*out_val = INT16_MAX;
-		else if (f <= INT32_MIN)
-			*out_val = INT16_MIN;
-		else
-			*out_val = lrintf(f) >> 16;
-	}
-}
-
 static void float_to_u32 (const float *in, unsigned char *out,
 		const size_t samples)
 {
@@ -187,18 +167,6 @@ static void u16_to_float (const unsigned char *in, float *out,
 		out[i] = ((int)*in_16++ + INT16_MIN) / (float)(INT16_MAX + 1);
 }
 
-static void s16_to_float (const char *in, float *out, const size_t samples)
-{
-	size_t i;
-	const int16_t *in_16 = (int16_t *)in;
-
-	assert (in != NULL);
-	assert (out != NULL);
-
-	for (i = 0; i < samples; i++)
-		out[i] = *in_16++ / (float)(INT16_MAX + 1);
-}
-
 static void u32_to_float (const unsigned char *in, float *out,
 		const size_t samples)
 {
@@ -224,12 +192,12 @@ static void s32_to_float (const char *in, float *out, const size_t samples)
 		out[i] = *in_32++ / ((float)INT32_MAX + 1.0);
 }
 
-/* Convert fixed point samples in format fmt (size in bytes) to float.
- * Size of converted sound is put in new_size. Returned memory is malloc()ed. */
-static float *fixed_to_float (const char *buf, const size_t size,
-		const long fmt, size_t *new_size)
+/* Convert fixed point samples in format fmt (size in bytes) to float and
+ * write them to out, which must have room for them. Size of converted sound
+ * is put in new_size. */
+static void fixed_to_float (const char *buf, const size_t size,
+		const long fmt, float *out, size_t *new_size)
 {
-	float *out = NULL;
 	char fmt_name[SFMT_STR_MAX];
 
 	assert ((fmt & SFMT_MASK_FORMAT) != SFMT_FLOAT);
@@ -237,32 +205,26 @@ static float *fixed_to_float (const char *buf, const size_t size,
 	switch (fmt & SFMT_MASK_FORMAT) {
 		case SFMT_U8:
 			*new_size = sizeof(float) * size;
-			out = (float *)xmalloc (*new_size);
 			u8_to_float ((unsigned char *)buf, out, size);
 			break;
 		case SFMT_S8:
 			*new_size = sizeof(float) * size;
-			out = (float *)xmalloc (*new_size);
 			s8_to_float (buf, out, size);
 			break;
 		case SFMT_U16:
 			*new_size = sizeof(float) * size / 2;
-			out = (float *)xmalloc (*new_size);
 			u16_to_float ((unsigned char *)buf, out, size / 2);
 			break;
 		case SFMT_S16:
 			*new_size = sizeof(float) * size / 2;
-			out = (float *)xmalloc (*new_size);
-			s16_to_float (buf, out, size / 2);
+			conv_kernels().s16_to_float ((const int16_t *)buf, out, size / 2);
 			break;
 		case SFMT_U32:
 			*new_size = sizeof(float) * size / 4;
-			out = (float *)xmalloc (*new_size);
 			u32_to_float ((unsigned char *)buf, out, size / 4);
 			break;
 		case SFMT_S32:
 			*new_size = sizeof(float) * size / 4;
-			out = (float *)xmalloc (*new_size);
 			s32_to_float (buf, out, size / 4);
 			break;
 		default:
@@ -270,82 +232,47 @@ static float *fixed_to_float (const char *buf, const size_t size,
 			       sfmt_str (fmt, fmt_name, sizeof (fmt_name)));
 			abort ();
 	}
-
-	return out;
 }
 
-/* Convert float samples to fixed point format fmt. Returned samples of size
- * new_size bytes is malloc()ed. */
-static char *float_to_fixed (const float *buf, const size_t samples,
-		const long fmt, size_t *new_size)
+/* Convert float samples to fixed point format fmt and write them to out.
+ * Size of the converted sound in bytes is put in new_size. */
+static void float_to_fixed (const float *buf, const size_t samples,
+		const long fmt, char *out, size_t *new_size)
 {
 	char fmt_name[SFMT_STR_MAX];
-	char *new_snd = NULL;
 
 	assert ((fmt & SFMT_MASK_FORMAT) != SFMT_FLOAT);
 
 	switch (fmt & SFMT_MASK_FORMAT) {
 		case SFMT_U8:
 			*new_size = samples;
-			new_snd = (char *)xmalloc (samples);
-			float_to_u8 (buf, (unsigned char *)new_snd, samples);
+			float_to_u8 (buf, (unsigned char *)out, samples);
 			break;
 		case SFMT_S8:
 			*new_size = samples;
-			new_snd = (char *)xmalloc (samples);
-			float_to_s8 (buf, new_snd, samples);
+			float_to_s8 (buf, out, samples);
 			break;
 		case SFMT_U16:
 			*new_size = samples * 2;
-			new_snd = (char *)xmalloc (*new_size);
-			float_to_u16 (buf, (unsigned char *)new_snd, samples);
+			float_to_u16 (buf, (unsigned char *)out, samples);
 			break;
 		case SFMT_S16:
 			*new_size = samples * 2;
-			new_snd = (char *)xmalloc (*new_size);
-			float_to_s16 (buf, new_snd, samples);
+			conv_kernels().float_to_s16 (buf, (int16_t *)out, samples);
 			break;
 		case SFMT_U32:
 			*new_size = samples * 4;
-			new_snd = (char *)xmalloc (*new_size);
-			float_to_u32 (buf, (unsigned char *)new_snd, samples);
+			float_to_u32 (buf, (unsigned char *)out, samples);
 			break;
 		case SFMT_S32:
 			*new_size = samples * 4;
-			new_snd = (char *)xmalloc (*new_size);
-			float_to_s32 (buf, new_snd, samples);
+			float_to_s32 (buf, out, samples);
 			break;
 		default:
 			error ("Can't convert from float to %s!",
 			       sfmt_str (fmt, fmt_name, sizeof (fmt_name)));
 			abort ();
 	}
-
-	return new_snd;
-}
-
-static void change_sign_8 (uint8_t *buf, const size_t samples)
-{
-	size_t i;
-
-	for (i = 0; i < samples; i++)
-		*buf++ ^= 1 << 7;
-}
-
-static void change_sign_16 (uint16_t *buf, const size_t samples)
-{
-	size_t i;
-
-	for (i = 0; i < samples; i++)
-		*buf++ ^= 1 << 15;
-}
-
-static void change_sign_32 (uint32_t *buf, const size_t samples)
-{
-	size_t i;
-
-	for (i = 0; i < samples; i++)
-		*buf++ ^= 1 << 31;
 }
 
 /* Change the signs of samples in format *fmt.  Also changes fmt to the new
@@ -357,7 +284,7 @@ static void change_sign (char *buf, const size_t size, long *fmt)
 	switch (*fmt & SFMT_MASK_FORMAT) {
 		case SFMT_S8:
 		case SFMT_U8:
-			change_sign_8 ((uint8_t *)buf, size);
+			conv_kernels().change_sign_8 ((uint8_t *)buf, size);
 			if (*fmt & SFMT_S8)
 				*fmt = sfmt_set_fmt (*fmt, SFMT_U8);
 			else
@@ -365,7 +292,7 @@ static void change_sign (char *buf, const size_t size, long *fmt)
 			break;
 		case SFMT_S16:
 		case SFMT_U16:
-			change_sign_16 ((uint16_t *)buf, size / 2);
+			conv_kernels().change_sign_16 ((uint16_t *)buf, size / 2);
 			if (*fmt & SFMT_S16)
 				*fmt = sfmt_set_fmt (*fmt, SFMT_U16);
 			else
@@ -373,7 +300,7 @@ static void change_sign (char *buf, const size_t size, long *fmt)
 			break;
 		case SFMT_S32:
 		case SFMT_U32:
-			change_sign_32 ((uint32_t *)buf, size/4);
+			conv_kernels().change_sign_32 ((uint32_t *)buf, size/4);
 			if (*fmt & SFMT_S32)
 				*fmt = sfmt_set_fmt (*fmt, SFMT_U32);
 			else
@@ -388,18 +315,12 @@ static void change_sign (char *buf, const size_t size, long *fmt)
 
 void audio_conv_bswap_16 (int16_t *buf, const size_t num)
 {
-	size_t i;
-
-	for (i = 0; i < num; i++)
-		buf[i] = bswap_16 (buf[i]);
+	conv_kernels().swap_16 (buf, num);
 }
 
 void audio_conv_bswap_32 (int32_t *buf, const size_t num)
 {
-	size_t i;
-
-	for (i = 0; i < num; i++)
-		buf[i] = bswap_32 (buf[i]);
+	conv_kernels().swap_32 (buf, num);
 }
 
 /* Swap endianness of fixed point samples. */
@@ -468,7 +389,8 @@ int audio_conv_new (struct audio_conversion *conv,
 				fatal ("Bad ResampleMethod option");
 				break;
 		}
-		conv->src_state = src_new (resample_type, to->channels, &err);
+		/* resampling is done before mono_to_stereo() */
+		conv->src_state = src_new (resample_type, from->channels, &err);
 		if (!conv->src_state) {
 			error ("Can't resample from %dHz to %dHz: %s",
 					from->rate, to->rate, src_strerror (err));
@@ -481,19 +403,49 @@ int audio_conv_new (struct audio_conversion *conv,
 	conv->from = *from;
 	conv->to = *to;
 
-	conv->resample_buf = NULL;
+	conv->resample_buf.clear ();
 	conv->resample_buf_nsamples = 0;
 
+	/* Size the scratch buffers for the largest intermediate result of
+	 * a typical chunk, so audio_conv() doesn't have to allocate. */
+	size_t samples = AUDIO_CONV_PREALLOC / sfmt_Bps (from->fmt);
+	size_t bytes = samples * std::max(sizeof(float), (size_t)sfmt_Bps (to->fmt));
+	if (from->rate != to->rate) {
+		bytes = bytes * (to->rate / (double)from->rate) + 1;
+		conv->resample_buf.reserve (2 * samples);
+	}
+	// samples counts all channels: only upmixing makes it bigger, the
+	// steps before a downmix still have all of the input channels
+	bytes = bytes * std::max(to->channels, from->channels) / from->channels;
+	for (auto &b : conv->scratch)
+		if (b.size () < bytes) b.resize (bytes);
+
 	return 1;
 }
 
-static float *resample_sound (struct audio_conversion *conv, const float *buf,
-		const size_t samples, const int nchannels, size_t *resampled_samples)
+/* Return scratch buffer i with room for at least size bytes. */
+static char *get_scratch (struct audio_conversion *conv, const int i,
+		const size_t size)
+{
+	std::vector<char> &b = conv->scratch[i];
+	if (b.size () < size) {
+		debug ("Growing conversion buffer to %zu bytes", size);
+		b.resize (size);
+	}
+	return b.data ();
+}
+
+/* Resample samples from buf into out (which is grown if needed) and put
+ * the number of produced samples into resampled_samples. Input that the
+ * resampler did not consume is kept in conv->resample_buf for the next
+ * call. */
+static bool resample_sound (struct audio_conversion *conv, const float *buf,
+		const size_t samples, const int nchannels, const int out_idx,
+		size_t *resampled_samples)
 {
 	SRC_DATA resample_data;
 	float *output;
-	float *new_input_start;
-	int output_samples = 0;
+	size_t output_samples = 0;
 
 	resample_data.end_of_input = 0;
 	resample_data.src_ratio = conv->to.rate / (double)conv->from.rate;
@@ -503,28 +455,17 @@ static float *resample_sound (struct audio_conversion *conv, const float *buf,
 	resample_data.output_frames = resample_data.input_frames
 		* resample_data.src_ratio;
 
-	if (conv->resample_buf) {
-		conv->resample_buf = (float *)xrealloc (conv->resample_buf,
-				sizeof(float) * resample_data.input_frames
-				* nchannels);
-		new_input_start = conv->resample_buf
-			+ conv->resample_buf_nsamples;
-	}
-	else {
-		conv->resample_buf = (float *)xmalloc (sizeof(float)
-				* resample_data.input_frames
-				* nchannels);
-		new_input_start = conv->resample_buf;
-	}
+	conv->resample_buf.resize (conv->resample_buf_nsamples + samples);
+	memcpy (conv->resample_buf.data () + conv->resample_buf_nsamples,
+			buf, samples * sizeof(float));
 
-	output = (float *)xmalloc (sizeof(float) * resample_data.output_frames
-				* nchannels);
+	output = (float *)get_scratch (conv, out_idx, sizeof(float)
+			* resample_data.output_frames * nchannels);
 
 	/*debug ("Resampling %lu bytes of data by ratio %f", (unsigned long)size,
 			resample_data.src_ratio);*/
 
-	memcpy (new_input_start, buf, samples * sizeof(float));
-	resample_data.data_in = conv->resample_buf;
+	resample_data.data_in = conv->resample_buf.data ();
 	resample_data.data_out = output;
 
 	do {
@@ -532,8 +473,7 @@ static float *resample_sound (struct audio_conversion *conv, const float *buf,
 
 		if ((err = src_process(conv->src_state, &resample_data))) {
 			error ("Can't resample: %s", src_strerror (err));
-			free (output);
-			return NULL;
+			return false;
 		}
 
 		resample_data.data_in += resample_data.input_frames_used
@@ -548,85 +488,32 @@ static float *resample_sound (struct audio_conversion *conv, const float *buf,
 
 	*resampled_samples = output_samples;
 
-	if (resample_data.input_frames) {
-		conv->resample_buf_nsamples = resample_data.input_frames
-			* nchannels;
-		if (conv->resample_buf != resample_data.data_in) {
-			float *new_buf;
-
-			new_buf = (float *)xmalloc (sizeof(float) *
-					conv->resample_buf_nsamples);
-			memcpy (new_buf, resample_data.data_in, sizeof(float) *
-					conv->resample_buf_nsamples);
-			free (conv->resample_buf);
-			conv->resample_buf = new_buf;
-		}
-	}
-	else {
-		free (conv->resample_buf);
-		conv->resample_buf = NULL;
-		conv->resample_buf_nsamples = 0;
-	}
-
-	return output;
-}
-
-/* Double the channels from */
-static char *mono_to_stereo (const char *mono, const size_t size,
-		const long format)
-{
-	int Bps = sfmt_Bps (format);
-	size_t i;
-	char *stereo;
-
-	stereo = (char *)xmalloc (size * 2);
-
-	for (i = 0; i < size; i += Bps) {
-		memcpy (stereo + (i * 2), mono + i, Bps);
-		memcpy (stereo + (i * 2 + Bps), mono + i, Bps);
-	}
-
-	return stereo;
-}
-
-static int16_t *s32_to_s16 (int32_t *in, const size_t samples)
-{
-	size_t i;
-	int16_t *buf;
+	/* keep the rest at the start of resample_buf */
+	conv->resample_buf_nsamples = resample_data.input_frames * nchannels;
+	memmove (conv->resample_buf.data (), resample_data.data_in,
+			sizeof(float) * conv->resample_buf_nsamples);
+	conv->resample_buf.resize (conv->resample_buf_nsamples);
 
-	buf = (int16_t *)xmalloc (samples * 2);
-
-	for (i = 0; i < samples; i++)
-		buf[i] = in[i] >> 16;
-
-	return buf;
-}
-
-static uint16_t *u32_to_u16 (uint32_t *in, const size_t samples)
-{
-	size_t i;
-	uint16_t *buf;
-
-	buf = (uint16_t *)xmalloc (samples * 2);
-
-	for (i = 0; i < samples; i++)
-		buf[i] = in[i] >> 16;
-
-	return buf;
+	return true;
 }
 
 /* Do the sound conversion.  buf of length size is the sample buffer to
  * convert and the size of the converted sound is put into *conv_len.
- * Return the converted sound in malloc()ed memory. */
-char *audio_conv (struct audio_conversion *conv, const char *buf,
+ * Returns the converted sound, which lives in conv's scratch buffers and
+ * stays valid until the next call, or NULL on error.
+ *
+ * The stages alternate between the two scratch buffers (or work in place)
+ * so nothing is allocated once those are big enough. */
+const char *audio_conv (struct audio_conversion *conv, const char *buf,
 		const size_t size, size_t *conv_len)
 {
-	char *curr_sound;
 	long curr_sfmt = conv->from.fmt;
+	int cur = 0; /* scratch buffer holding curr_sound */
+	char *curr_sound;
 
 	*conv_len = size;
 
-	curr_sound = (char *)xmalloc (size);
+	curr_sound = get_scratch (conv, cur, size);
 	memcpy (curr_sound, buf, size);
 
 	if (!(curr_sfmt & SFMT_NE)) {
@@ -639,22 +526,18 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
 	if ((curr_sfmt & (SFMT_S32 | SFMT_U32)) &&
 	    (conv->to.fmt & (SFMT_S16 | SFMT_U16)) &&
 	    conv->from.rate == conv->to.rate) {
-		char *new_sound;
 
 		if ((curr_sfmt & SFMT_MASK_FORMAT) == SFMT_S32) {
-			new_sound = (char *)s32_to_s16 ((int32_t *)curr_sound,
-					*conv_len / 4);
+			conv_kernels().s32_to_s16 ((int32_t *)curr_sound,
+					(int16_t *)curr_sound, *conv_len / 4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_S16);
 		}
 		else {
-			new_sound = (char *)u32_to_u16 ((uint32_t *)curr_sound,
-					*conv_len / 4);
+			conv_kernels().u32_to_u16 ((uint32_t *)curr_sound,
+					(uint16_t *)curr_sound, *conv_len / 4);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_U16);
 		}
 
-		if (curr_sound != buf)
-			free (curr_sound);
-		curr_sound = new_sound;
 		*conv_len /= 2;
 	}
 
@@ -663,45 +546,45 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
 				|| (conv->to.fmt & SFMT_MASK_FORMAT) == SFMT_FLOAT
 				|| !sfmt_same_bps(conv->to.fmt, curr_sfmt))
 			&& (curr_sfmt & SFMT_MASK_FORMAT) != SFMT_FLOAT) {
-		char *new_sound;
+		char *new_sound = get_scratch (conv, !cur, *conv_len
+				/ sfmt_Bps (curr_sfmt) * sizeof(float));
 
-		new_sound = (char *)fixed_to_float (curr_sound, *conv_len,
-				curr_sfmt, conv_len);
+		fixed_to_float (curr_sound, *conv_len, curr_sfmt,
+				(float *)new_sound, conv_len);
 		curr_sfmt = sfmt_set_fmt (curr_sfmt, SFMT_FLOAT);
 
-		if (curr_sound != buf)
-			free (curr_sound);
+		cur = !cur;
 		curr_sound = new_sound;
 	}
 
 	if (conv->from.rate != conv->to.rate) {
-		char *new_sound = (char *)resample_sound (conv,
-				(float *)curr_sound,
-				*conv_len / sizeof(float), conv->to.channels,
-				conv_len);
+		if (!resample_sound (conv, (float *)curr_sound,
+				*conv_len / sizeof(float), conv->from.channels,
+				!cur, conv_len))
+			return NULL;
 		*conv_len *= sizeof(float);
-		if (curr_sound != buf)
-			free (curr_sound);
-		curr_sound = new_sound;
+		cur = !cur;
+		curr_sound = conv->scratch[cur].data ();
 	}
 
 	if ((curr_sfmt & SFMT_MASK_FORMAT)
 			!= (conv->to.fmt & SFMT_MASK_FORMAT)) {
 
 		if (sfmt_same_bps(curr_sfmt, conv->to.fmt))
-			change_sign (curr_sound, size, &curr_sfmt);
+			change_sign (curr_sound, *conv_len, &curr_sfmt);
 		else {
 			char *new_sound;
 
 			assert (curr_sfmt & SFMT_FLOAT);
 
-			new_sound = float_to_fixed ((float *)curr_sound,
+			new_sound = get_scratch (conv, !cur, *conv_len
+					/ sizeof(float) * sfmt_Bps (conv->to.fmt));
+			float_to_fixed ((float *)curr_sound,
 					*conv_len / sizeof(float),
-					conv->to.fmt, conv_len);
+					conv->to.fmt, new_sound, conv_len);
 			curr_sfmt = sfmt_set_fmt (curr_sfmt, conv->to.fmt);
 
-			if (curr_sound != buf)
-				free (curr_sound);
+			cur = !cur;
 			curr_sound = new_sound;
 		}
 	}
@@ -714,13 +597,14 @@ char *audio_conv (struct audio_conversion *conv, const char *buf,
 	}
 
 	if (conv->from.channels == 1 && conv->to.channels == 2) {
-		char *new_sound;
+		char *new_sound = get_scratch (conv, !cur, *conv_len * 2);
 
-		new_sound = mono_to_stereo (curr_sound, *conv_len, curr_sfmt);
+		int Bps = sfmt_Bps (curr_sfmt);
+		conv_kernels().mono_to_stereo (curr_sound, new_sound,
+				*conv_len / Bps, Bps);
 		*conv_len *= 2;
 
-		if (curr_sound != buf)
-			free (curr_sound);
+		cur = !cur;
 		curr_sound = new_sound;
 	}
 
@@ -731,8 +615,9 @@ void audio_conv_destroy (struct audio_conversion *conv)
 {
 	assert (conv != NULL);
 
-	if (conv->resample_buf)
-		free (conv->resample_buf);
+	conv->resample_buf.clear ();
+	conv->resample_buf.shrink_to_fit ();
 	if (conv->src_state)
 		src_delete (conv->src_state);
+	conv->src_state = NULL;
 }
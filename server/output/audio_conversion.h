@@ -12,14 +12,21 @@ struct audio_conversion
 	struct sound_params to;
 
 	SRC_STATE *src_state;
-	float *resample_buf;
+	std::vector<float> resample_buf; /* input not yet consumed by the resampler */
 	size_t resample_buf_nsamples; /* in samples ( sizeof(float) ) */
+
+	/* Intermediate results, kept between calls so audio_conv() doesn't
+	 * allocate once they are big enough. */
+	std::vector<char> scratch[2];
 };
 
+/* Input size (in bytes) for which the buffers are allocated up front. */
+#define AUDIO_CONV_PREALLOC	(64 * 1024)
+
 int audio_conv_new (struct audio_conversion *conv,
 		const struct sound_params *from,
 		const struct sound_params *to);
-char *audio_conv (struct audio_conversion *conv,
+const char *audio_conv (struct audio_conversion *conv,
 		const char *buf, const size_t size, size_t *conv_len);
 void audio_conv_destroy (struct audio_conversion *conv);
 
@@ -0,0 +1,427 @@
+/*
+ * Sample conversion kernels, see conv_kernels.h
+ *
+ * The scalar versions are the reference: they are what audio_conversion.cc
+ * used to do inline. The vector versions process the bulk of a buffer and
+ * hand the remaining few samples to the scalar ones.
+ */
+
+#include <math.h>
+#include <byteswap.h>
+#include "conv_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+//-----------------------------------------------------------------------------
+// scalar
+//-----------------------------------------------------------------------------
+
+static void float_to_s16_c (const float *in, int16_t *out, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		float f = in[i] * INT32_MAX;
+
+		if (f >= INT32_MAX)
+			out[i] = INT16_MAX;
+		else if (f <= INT32_MIN)
+			out[i] = INT16_MIN;
+		else
+			out[i] = lrintf(f) >> 16;
+	}
+}
+
+static void s16_to_float_c (const int16_t *in, float *out, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		out[i] = in[i] / (float)(INT16_MAX + 1);
+}
+
+static void s32_to_s16_c (const int32_t *in, int16_t *out, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		out[i] = in[i] >> 16;
+}
+
+static void u32_to_u16_c (const uint32_t *in, uint16_t *out, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		out[i] = in[i] >> 16;
+}
+
+static void change_sign_8_c (uint8_t *buf, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		buf[i] ^= 1 << 7;
+}
+
+static void change_sign_16_c (uint16_t *buf, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		buf[i] ^= 1 << 15;
+}
+
+static void change_sign_32_c (uint32_t *buf, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		buf[i] ^= 1u << 31;
+}
+
+static void bswap_16_c (int16_t *buf, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		buf[i] = bswap_16 (buf[i]);
+}
+
+static void bswap_32_c (int32_t *buf, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		buf[i] = bswap_32 (buf[i]);
+}
+
+static void mono_to_stereo_c (const char *in, char *out, size_t frames, int Bps)
+{
+	for (size_t i = 0; i < frames; i++) {
+		memcpy (out + 2*i*Bps, in + i*Bps, Bps);
+		memcpy (out + (2*i+1)*Bps, in + i*Bps, Bps);
+	}
+}
+
+static const ConvKernels scalar_kernels = {
+	"scalar",
+	float_to_s16_c, s16_to_float_c, s32_to_s16_c, u32_to_u16_c,
+	change_sign_8_c, change_sign_16_c, change_sign_32_c,
+	bswap_16_c, bswap_32_c,
+	mono_to_stereo_c
+};
+
+#ifdef HAVE_X86_KERNELS
+
+//-----------------------------------------------------------------------------
+// SSE2
+//-----------------------------------------------------------------------------
+
+#define SSE2 __attribute__((target("sse2")))
+
+/* 4 floats to 4 int32 that are ready for >> 16: same as the tests and
+ * lrintf() in float_to_s16_c. Values below the range and NaN come out of
+ * cvtps as INT32_MIN anyway, NaN is zeroed first because lrintf(NaN) >> 16
+ * truncates to 0 there. */
+static inline SSE2 __m128i f2i_sse2 (__m128 x)
+{
+	const __m128 scale = _mm_set1_ps ((float)INT32_MAX);
+	x = _mm_and_ps (x, _mm_cmpord_ps (x, x));
+	x = _mm_mul_ps (x, scale);
+	__m128i over = _mm_castps_si128 (_mm_cmpge_ps (x, scale));
+	__m128i i = _mm_cvtps_epi32 (x);
+	return _mm_or_si128 (_mm_andnot_si128 (over, i),
+	                     _mm_and_si128 (over, _mm_set1_epi32 (INT32_MAX)));
+}
+
+static SSE2 void float_to_s16_sse2 (const float *in, int16_t *out, size_t n)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i a = _mm_srai_epi32 (f2i_sse2 (_mm_loadu_ps (in + i)), 16);
+		__m128i b = _mm_srai_epi32 (f2i_sse2 (_mm_loadu_ps (in + i + 4)), 16);
+		_mm_storeu_si128 ((__m128i *)(out + i), _mm_packs_epi32 (a, b));
+	}
+	float_to_s16_c (in + i, out + i, n - i);
+}
+
+static SSE2 void s16_to_float_sse2 (const int16_t *in, float *out, size_t n)
+{
+	const __m128 scale = _mm_set1_ps (1.0f / (INT16_MAX + 1));
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i x = _mm_loadu_si128 ((const __m128i *)(in + i));
+		__m128i lo = _mm_srai_epi32 (_mm_unpacklo_epi16 (x, x), 16);
+		__m128i hi = _mm_srai_epi32 (_mm_unpackhi_epi16 (x, x), 16);
+		_mm_storeu_ps (out + i,     _mm_mul_ps (_mm_cvtepi32_ps (lo), scale));
+		_mm_storeu_ps (out + i + 4, _mm_mul_ps (_mm_cvtepi32_ps (hi), scale));
+	}
+	s16_to_float_c (in + i, out + i, n - i);
+}
+
+static SSE2 void s32_to_s16_sse2 (const int32_t *in, int16_t *out, size_t n)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i a = _mm_srai_epi32 (_mm_loadu_si128 ((const __m128i *)(in + i)), 16);
+		__m128i b = _mm_srai_epi32 (_mm_loadu_si128 ((const __m128i *)(in + i + 4)), 16);
+		_mm_storeu_si128 ((__m128i *)(out + i), _mm_packs_epi32 (a, b));
+	}
+	s32_to_s16_c (in + i, out + i, n - i);
+}
+
+static SSE2 void u32_to_u16_sse2 (const uint32_t *in, uint16_t *out, size_t n)
+{
+	/* no unsigned pack in SSE2, but the arithmetic shift leaves the
+	 * high half sign-extended, which packs passes through bit for bit */
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i a = _mm_srai_epi32 (_mm_loadu_si128 ((const __m128i *)(in + i)), 16);
+		__m128i b = _mm_srai_epi32 (_mm_loadu_si128 ((const __m128i *)(in + i + 4)), 16);
+		_mm_storeu_si128 ((__m128i *)(out + i), _mm_packs_epi32 (a, b));
+	}
+	u32_to_u16_c (in + i, out + i, n - i);
+}
+
+template<typename T>
+static inline SSE2 void xor_sse2 (T *buf, size_t n, __m128i m)
+{
+	const size_t k = 16 / sizeof(T);
+	size_t i = 0;
+	for (; i + k <= n; i += k) {
+		__m128i *p = (__m128i *)(buf + i);
+		_mm_storeu_si128 (p, _mm_xor_si128 (_mm_loadu_si128 (p), m));
+	}
+	for (; i < n; i++) buf[i] ^= ((T)1 << (8*sizeof(T)-1));
+}
+
+static SSE2 void change_sign_8_sse2 (uint8_t *buf, size_t n)
+{
+	xor_sse2 (buf, n, _mm_set1_epi8 ((char)0x80));
+}
+
+static SSE2 void change_sign_16_sse2 (uint16_t *buf, size_t n)
+{
+	xor_sse2 (buf, n, _mm_set1_epi16 (INT16_MIN));
+}
+
+static SSE2 void change_sign_32_sse2 (uint32_t *buf, size_t n)
+{
+	xor_sse2 (buf, n, _mm_set1_epi32 (INT32_MIN));
+}
+
+static inline SSE2 __m128i bswap16_sse2 (__m128i x)
+{
+	return _mm_or_si128 (_mm_slli_epi16 (x, 8), _mm_srli_epi16 (x, 8));
+}
+
+static SSE2 void bswap_16_sse2 (int16_t *buf, size_t n)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i *p = (__m128i *)(buf + i);
+		_mm_storeu_si128 (p, bswap16_sse2 (_mm_loadu_si128 (p)));
+	}
+	bswap_16_c (buf + i, n - i);
+}
+
+static SSE2 void bswap_32_sse2 (int32_t *buf, size_t n)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i *p = (__m128i *)(buf + i);
+		__m128i x = _mm_loadu_si128 (p);
+		/* swap the 16-bit halves, then the bytes in each half */
+		x = _mm_shufflelo_epi16 (x, _MM_SHUFFLE (2, 3, 0, 1));
+		x = _mm_shufflehi_epi16 (x, _MM_SHUFFLE (2, 3, 0, 1));
+		_mm_storeu_si128 (p, bswap16_sse2 (x));
+	}
+	bswap_32_c (buf + i, n - i);
+}
+
+static SSE2 void mono_to_stereo_sse2 (const char *in, char *out, size_t frames, int Bps)
+{
+	const size_t N = frames * Bps; /* bytes in */
+	size_t i = 0;
+	for (; i + 16 <= N; i += 16) {
+		__m128i x = _mm_loadu_si128 ((const __m128i *)(in + i)), lo, hi;
+		switch (Bps) {
+			case 1:  lo = _mm_unpacklo_epi8  (x, x); hi = _mm_unpackhi_epi8  (x, x); break;
+			case 2:  lo = _mm_unpacklo_epi16 (x, x); hi = _mm_unpackhi_epi16 (x, x); break;
+			default: lo = _mm_unpacklo_epi32 (x, x); hi = _mm_unpackhi_epi32 (x, x); break;
+		}
+		_mm_storeu_si128 ((__m128i *)(out + 2*i), lo);
+		_mm_storeu_si128 ((__m128i *)(out + 2*i + 16), hi);
+	}
+	mono_to_stereo_c (in + i, out + 2*i, (N - i) / Bps, Bps);
+}
+
+static const ConvKernels sse2_kernels = {
+	"SSE2",
+	float_to_s16_sse2, s16_to_float_sse2, s32_to_s16_sse2, u32_to_u16_sse2,
+	change_sign_8_sse2, change_sign_16_sse2, change_sign_32_sse2,
+	bswap_16_sse2, bswap_32_sse2,
+	mono_to_stereo_sse2
+};
+
+//-----------------------------------------------------------------------------
+// AVX2
+//-----------------------------------------------------------------------------
+
+#define AVX2 __attribute__((target("avx2")))
+
+/* see f2i_sse2 */
+static inline AVX2 __m256i f2i_avx2 (__m256 x)
+{
+	const __m256 scale = _mm256_set1_ps ((float)INT32_MAX);
+	x = _mm256_and_ps (x, _mm256_cmp_ps (x, x, _CMP_ORD_Q));
+	x = _mm256_mul_ps (x, scale);
+	__m256 over = _mm256_cmp_ps (x, scale, _CMP_GE_OQ);
+	__m256i i = _mm256_cvtps_epi32 (x);
+	return _mm256_blendv_epi8 (i, _mm256_set1_epi32 (INT32_MAX),
+	                           _mm256_castps_si256 (over));
+}
+
+/* packs works per 128-bit lane, this puts the result back in order */
+static inline AVX2 __m256i packs_avx2 (__m256i a, __m256i b)
+{
+	return _mm256_permute4x64_epi64 (_mm256_packs_epi32 (a, b),
+	                                 _MM_SHUFFLE (3, 1, 2, 0));
+}
+
+static AVX2 void float_to_s16_avx2 (const float *in, int16_t *out, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256i a = _mm256_srai_epi32 (f2i_avx2 (_mm256_loadu_ps (in + i)), 16);
+		__m256i b = _mm256_srai_epi32 (f2i_avx2 (_mm256_loadu_ps (in + i + 8)), 16);
+		_mm256_storeu_si256 ((__m256i *)(out + i), packs_avx2 (a, b));
+	}
+	float_to_s16_sse2 (in + i, out + i, n - i);
+}
+
+static AVX2 void s16_to_float_avx2 (const int16_t *in, float *out, size_t n)
+{
+	const __m256 scale = _mm256_set1_ps (1.0f / (INT16_MAX + 1));
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i x = _mm256_cvtepi16_epi32 (_mm_loadu_si128 ((const __m128i *)(in + i)));
+		_mm256_storeu_ps (out + i, _mm256_mul_ps (_mm256_cvtepi32_ps (x), scale));
+	}
+	s16_to_float_c (in + i, out + i, n - i);
+}
+
+static AVX2 void s32_to_s16_avx2 (const int32_t *in, int16_t *out, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256i a = _mm256_srai_epi32 (_mm256_loadu_si256 ((const __m256i *)(in + i)), 16);
+		__m256i b = _mm256_srai_epi32 (_mm256_loadu_si256 ((const __m256i *)(in + i + 8)), 16);
+		_mm256_storeu_si256 ((__m256i *)(out + i), packs_avx2 (a, b));
+	}
+	s32_to_s16_sse2 (in + i, out + i, n - i);
+}
+
+static AVX2 void u32_to_u16_avx2 (const uint32_t *in, uint16_t *out, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256i a = _mm256_srli_epi32 (_mm256_loadu_si256 ((const __m256i *)(in + i)), 16);
+		__m256i b = _mm256_srli_epi32 (_mm256_loadu_si256 ((const __m256i *)(in + i + 8)), 16);
+		_mm256_storeu_si256 ((__m256i *)(out + i),
+			_mm256_permute4x64_epi64 (_mm256_packus_epi32 (a, b),
+			                          _MM_SHUFFLE (3, 1, 2, 0)));
+	}
+	u32_to_u16_sse2 (in + i, out + i, n - i);
+}
+
+template<typename T>
+static inline AVX2 void xor_avx2 (T *buf, size_t n, __m256i m)
+{
+	const size_t k = 32 / sizeof(T);
+	size_t i = 0;
+	for (; i + k <= n; i += k) {
+		__m256i *p = (__m256i *)(buf + i);
+		_mm256_storeu_si256 (p, _mm256_xor_si256 (_mm256_loadu_si256 (p), m));
+	}
+	for (; i < n; i++) buf[i] ^= ((T)1 << (8*sizeof(T)-1));
+}
+
+static AVX2 void change_sign_8_avx2 (uint8_t *buf, size_t n)
+{
+	xor_avx2 (buf, n, _mm256_set1_epi8 ((char)0x80));
+}
+
+static AVX2 void change_sign_16_avx2 (uint16_t *buf, size_t n)
+{
+	xor_avx2 (buf, n, _mm256_set1_epi16 (INT16_MIN));
+}
+
+static AVX2 void change_sign_32_avx2 (uint32_t *buf, size_t n)
+{
+	xor_avx2 (buf, n, _mm256_set1_epi32 (INT32_MIN));
+}
+
+static inline AVX2 void shuffle_avx2 (char *buf, size_t N, __m256i m)
+{
+	for (size_t i = 0; i + 32 <= N; i += 32) {
+		__m256i *p = (__m256i *)(buf + i);
+		_mm256_storeu_si256 (p, _mm256_shuffle_epi8 (_mm256_loadu_si256 (p), m));
+	}
+}
+
+static AVX2 void bswap_16_avx2 (int16_t *buf, size_t n)
+{
+	const __m256i m = _mm256_setr_epi8 (
+		1,0, 3,2, 5,4, 7,6, 9,8, 11,10, 13,12, 15,14,
+		1,0, 3,2, 5,4, 7,6, 9,8, 11,10, 13,12, 15,14);
+	const size_t k = n & ~(size_t)15;
+	shuffle_avx2 ((char *)buf, 2*k, m);
+	bswap_16_c (buf + k, n - k);
+}
+
+static AVX2 void bswap_32_avx2 (int32_t *buf, size_t n)
+{
+	const __m256i m = _mm256_setr_epi8 (
+		3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12,
+		3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+	const size_t k = n & ~(size_t)7;
+	shuffle_avx2 ((char *)buf, 4*k, m);
+	bswap_32_c (buf + k, n - k);
+}
+
+static AVX2 void mono_to_stereo_avx2 (const char *in, char *out, size_t frames, int Bps)
+{
+	/* widen each sample to twice its size, then copy it into the
+	 * upper half as well */
+	const size_t N = frames * Bps;
+	size_t i = 0;
+	for (; i + 16 <= N; i += 16) {
+		__m128i x = _mm_loadu_si128 ((const __m128i *)(in + i));
+		__m256i y;
+		switch (Bps) {
+			case 1:  y = _mm256_cvtepu8_epi16  (x); y = _mm256_or_si256 (y, _mm256_slli_epi16 (y, 8));  break;
+			case 2:  y = _mm256_cvtepu16_epi32 (x); y = _mm256_or_si256 (y, _mm256_slli_epi32 (y, 16)); break;
+			default: y = _mm256_cvtepu32_epi64 (x); y = _mm256_or_si256 (y, _mm256_slli_epi64 (y, 32)); break;
+		}
+		_mm256_storeu_si256 ((__m256i *)(out + 2*i), y);
+	}
+	mono_to_stereo_c (in + i, out + 2*i, (N - i) / Bps, Bps);
+}
+
+static const ConvKernels avx2_kernels = {
+	"AVX2",
+	float_to_s16_avx2, s16_to_float_avx2, s32_to_s16_avx2, u32_to_u16_avx2,
+	change_sign_8_avx2, change_sign_16_avx2, change_sign_32_avx2,
+	bswap_16_avx2, bswap_32_avx2,
+	mono_to_stereo_avx2
+};
+
+#endif // HAVE_X86_KERNELS
+
+//-----------------------------------------------------------------------------
+// selection
+//-----------------------------------------------------------------------------
+
+static const ConvKernels &select_kernels ()
+{
+	#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx2")) return avx2_kernels;
+	if (__builtin_cpu_supports ("sse2")) return sse2_kernels;
+	#endif
+
+	return scalar_kernels;
+}
+
+const ConvKernels &conv_kernels ()
+{
+	static const ConvKernels &k = select_kernels ();
+	return k;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Inner loops of the sample format conversion.
+ *
+ * There is a scalar version of each, plus SSE2 and AVX2 versions on x86
+ * which are picked at runtime depending on the CPU. All of them give
+ * exactly the same results, including saturation. A NEON set would go
+ * next to the x86 ones in conv_kernels.cc and be picked the same way.
+ *
+ * Sizes are in samples, except for mono_to_stereo which takes frames.
+ * The "in" and "out" buffers must not overlap, except for s32_to_s16
+ * and u32_to_u16 which can work in place.
+ */
+struct ConvKernels
+{
+	const char *name;
+
+	void (*float_to_s16)(const float *in, int16_t *out, size_t n);
+	void (*s16_to_float)(const int16_t *in, float *out, size_t n);
+	void (*s32_to_s16)(const int32_t *in, int16_t *out, size_t n);
+	void (*u32_to_u16)(const uint32_t *in, uint16_t *out, size_t n);
+
+	void (*change_sign_8) (uint8_t  *buf, size_t n);
+	void (*change_sign_16)(uint16_t *buf, size_t n);
+	void (*change_sign_32)(uint32_t *buf, size_t n);
+
+	void (*swap_16)(int16_t *buf, size_t n);
+	void (*swap_32)(int32_t *buf, size_t n);
+
+	/* Bps is 1, 2 or 4 */
+	void (*mono_to_stereo)(const char *in, char *out, size_t frames, int Bps);
+};
+
+/* The best kernels for this machine (selected on first call). */
+const ConvKernels &conv_kernels();
@@ -32,60 +32,97 @@
 #include "audio_conversion.h"
 #include "equalizer.h"
 
-struct Biquad
+typedef float v4f __attribute__((vector_size(16)));
+
+/* A cascade of peaking EQ filters for all channels.
+ *
+ * The filters run in transposed direct form II. Coefficients are stored per
+ * band and the state per band and group of four channels, so each band goes
+ * over the whole buffer once with all channels of a frame in one vector.
+ */
+struct Equalizer
 {
-	float a0, a1, a2, a3, a4;
-	mutable float x1, x2, y1, y2;
+	str   name;
+	float preamp;
+	std::vector<float> CF, BW, DG; // band parameters from the eqset file
 
-	/* biquad functions */
+	int channels = 0;
+	std::vector<float> b0, b1, b2, a1, a2; // per band
+	std::vector<v4f> z1, z2; // per band and channel group
 
-	/* Create a Peaking EQ Filter.
-	* See 'Audio EQ Cookbook' for more information
-	*/
-	Biquad(float dbgain, float cf, float srate, float bw)
+	int bands() const { return CF.size(); }
+	int groups() const { return (channels + 3) / 4; }
+
+	/* Compute the coefficients for the given sound parameters.
+	 * See 'Audio EQ Cookbook' for more information
+	 */
+	void setup(float srate, int nchannels)
 	{
-		float A = powf(10.0f, dbgain / 40.0f);
-		float omega = 2.0 * M_PI * cf / srate;
-		float sn = sin(omega);
-		float cs = cos(omega);
-		float alpha = sn * sinh(M_LN2 / 2.0f * bw * omega / sn);
-
-		float alpha_m_A = alpha * A;
-		float alpha_d_A = alpha / A;
-
-		float b0 =  1.0f + alpha_m_A;
-		float b1 = -2.0f * cs;
-		float b2 =  1.0f - alpha_m_A;
-		float a0 =  1.0f + alpha_d_A;
-		float a1 =  b1;
-		float a2 =  1.0f - alpha_d_A;
-
-		this->a0 = b0 / a0;
-		this->a1 = b1 / a0;
-		this->a2 = b2 / a0;
-		this->a3 = a1 / a0;
-		this->a4 = a2 / a0;
-
-		this->x1 = 0.0f;
-		this->x2 = 0.0f;
-		this->y1 = 0.0f;
-		this->y2 = 0.0f;
+		const int N = bands();
+		b0.resize(N); b1.resize(N); b2.resize(N); a1.resize(N); a2.resize(N);
+		for (int k = 0; k < N; ++k)
+		{
+			float A = powf(10.0f, DG[k] / 40.0f);
+			float omega = 2.0 * M_PI * CF[k] / srate;
+			float sn = sin(omega);
+			float cs = cos(omega);
+			float alpha = sn * sinh(M_LN2 / 2.0f * BW[k] * omega / sn);
+
+			float alpha_m_A = alpha * A;
+			float alpha_d_A = alpha / A;
+			float a0 = 1.0f + alpha_d_A;
+
+			b0[k] = (1.0f + alpha_m_A) / a0;
+			b1[k] = (-2.0f * cs) / a0;
+			b2[k] = (1.0f - alpha_m_A) / a0;
+			a1[k] = (-2.0f * cs) / a0;
+			a2[k] = (1.0f - alpha_d_A) / a0;
+		}
+		channels = nchannels;
+		reset();
 	}
 
-	void operator() (float &s, float &f) const
+	void reset()
 	{
-		f = s*a0 + a1*x1 + a2*x2 - a3*y1 - a4*y2;
-		x2 = x1; x1 = s;
-		y2 = y1; y1 = f;
-		s = f;
+		z1.assign(bands() * groups(), v4f{});
+		z2.assign(bands() * groups(), v4f{});
 	}
-};
 
-struct Equalizer
-{
-	str   name;
-	float preamp;
-	std::vector<Biquad> b;
+	/* Filter interleaved samples in place. */
+	void run(float *buf, size_t frames)
+	{
+		const int N = bands(), G = groups(), C = channels;
+		for (int k = 0; k < N; ++k)
+		{
+			const v4f B0 = v4f{} + b0[k], B1 = v4f{} + b1[k], B2 = v4f{} + b2[k];
+			const v4f A1 = v4f{} + a1[k], A2 = v4f{} + a2[k];
+
+			for (int g = 0; g < G; ++g)
+			{
+				v4f s1 = z1[k*G + g], s2 = z2[k*G + g];
+				const int nc = std::min(4, C - 4*g);
+				float *p = buf + 4*g;
+
+				for (size_t f = 0; f < frames; ++f, p += C)
+				{
+					v4f x = {};
+					memcpy(&x, p, nc * sizeof(float));
+					v4f y = B0*x + s1;
+					s1 = B1*x - A1*y + s2;
+					s2 = B2*x - A2*y;
+					memcpy(p, &y, nc * sizeof(float));
+				}
+
+				// don't let silence decay into denormals
+				for (int c = 0; c < 4; ++c)
+				{
+					if (fabsf(s1[c]) < 1e-20f) s1[c] = 0.0f;
+					if (fabsf(s2[c]) < 1e-20f) s2[c] = 0.0f;
+				}
+				z1[k*G + g] = s1; z2[k*G + g] = s2;
+			}
+		}
+	}
 };
 
 /* config processing */
@@ -95,11 +132,27 @@ static std::vector<std::unique_ptr<Equalizer>> equalizers;
 static int       eqi = -1;
 static Equalizer *eq = NULL;
 
+/* The preset the output thread used for the last buffer. When eq differs
+ * from it, we crossfade from it (or from the unfiltered sound if NULL)
+ * over FADE_MS instead of switching abruptly. */
+static Equalizer *playing = NULL;
+static Equalizer *fade_from = NULL;
+static bool   fading = false;
+static size_t fade_pos, fade_len; /* in frames */
+#define FADE_MS 50
+
 static int sample_rate, channels;
 static float mixin_rate;
 
+/* float copies of the buffer being processed, see equalizer_prepare() */
+static std::vector<float> tmp, tmp_fade;
+
 bool equalizer_is_active() { return options::EqualizerActive; }
-void equalizer_set_active(bool active) { options::EqualizerActive = active; }
+void equalizer_set_active(bool active)
+{
+	options::EqualizerActive = active;
+	if (!active) playing = NULL; // fade in when turned on again
+}
 str equalizer_current_eqname()
 {
 	return (options::EqualizerActive && eq) ? eq->name : str("off");
@@ -121,26 +174,6 @@ void equalizer_prev()
 	options::EqualizerPreset = eq->name;
 }
 
-/* Applies a set of biquadratic filters to a buffer of floating point samples.
- * It is safe to have the same input and output buffer.
- * length of src and dst is len
- */
-static inline void apply_biquads(float *src, float *dst, int len, const std::vector<Biquad> b)
-{
-	int blen = b.size() / channels;
-	while (len > 0)
-	{
-		for (int c = 0; c < channels; ++c)
-		{
-			auto *cb = b.data() + c*blen; // data for channel c
-			float s = *src++, f = s;
-			for (int i = 0; i < blen; ++i) (*cb++)(s, f);
-			*dst++ = f;
-			--len;
-		}
-	}
-}
-
 void equalizer_init()
 {
 	sample_rate = 44100;
@@ -162,6 +195,8 @@ void equalizer_refresh()
 
 	eqi = -1;
 	eq  = NULL;
+	playing = fade_from = NULL;
+	fading = false;
 
 	DIR *d = opendir(options::config_file_path("eqsets").c_str());
 	if(!d) return;
@@ -229,56 +264,116 @@ void equalizer_refresh()
 	if (!eq) equalizer_next();
 }
 
-template<typename T>
-static void process(T *buf, size_t samples)
+/* Run the current preset over the float samples in t, crossfading from the
+ * previous one if it was just switched. */
+static void filter(float *t, size_t samples)
 {
-	constexpr auto A = (float)std::numeric_limits<T>::min();
-	constexpr auto B = (float)std::numeric_limits<T>::max();
-	float *tmp = (float *)xmalloc (samples * sizeof (float));
-
-	for (size_t i = 0; i < samples; ++i)
-		tmp[i] = eq->preamp * (float)buf[i];
+	const size_t frames = samples / channels;
 
-	apply_biquads(tmp, tmp, samples, eq->b);
+	if (eq != playing)
+	{
+		fade_from = playing;
+		playing = eq;
+		eq->reset();
+		fading = true;
+		fade_pos = 0;
+		fade_len = std::max(1, sample_rate * FADE_MS / 1000);
+	}
 
-	for (size_t i = 0; i < samples; ++i)
+	float *f = NULL;
+	if (fading)
 	{
-		tmp[i] = (1.0f - mixin_rate) * tmp[i] + mixin_rate * (float)buf[i];
-		buf[i] = (T)CLAMP(A, tmp[i], B);
+		if (tmp_fade.size() < samples) tmp_fade.resize(samples);
+		f = tmp_fade.data();
+		memcpy(f, t, samples * sizeof(float));
+		if (fade_from)
+		{
+			for (size_t i = 0; i < samples; ++i) f[i] *= fade_from->preamp;
+			fade_from->run(f, frames);
+		}
 	}
 
-	free(tmp);
+	for (size_t i = 0; i < samples; ++i) t[i] *= eq->preamp;
+	eq->run(t, frames);
+
+	if (fading)
+	{
+		size_t fr = 0;
+		for (; fr < frames && fade_pos < fade_len; ++fr, ++fade_pos)
+		{
+			const float w = (float)fade_pos / fade_len;
+			for (int c = 0; c < channels; ++c)
+			{
+				const size_t i = fr * channels + c;
+				t[i] = w * t[i] + (1.0f - w) * f[i];
+			}
+		}
+		if (fade_pos >= fade_len)
+		{
+			fading = false;
+			fade_from = NULL;
+		}
+	}
 }
-static void process(float *buf, size_t samples)
+
+template<typename T>
+static void process(T *buf, size_t samples, float A, float B)
 {
-	float *tmp = (float *)xmalloc (samples * sizeof (float));
+	if (tmp.size() < samples) tmp.resize(samples);
+	float *t = tmp.data();
 
 	for (size_t i = 0; i < samples; ++i)
-		tmp[i] = eq->preamp * (float)buf[i];
+		t[i] = (float)buf[i];
 
-	apply_biquads(tmp, tmp, samples, eq->b);
+	filter(t, samples);
 
 	for (size_t i = 0; i < samples; ++i)
 	{
-		tmp[i] = (1.0f - mixin_rate) * tmp[i] + mixin_rate * buf[i];
-		buf[i] = CLAMP(-1.0f, tmp[i], 1.0f);
+		t[i] = (1.0f - mixin_rate) * t[i] + mixin_rate * (float)buf[i];
+		buf[i] = (T)CLAMP(A, t[i], B);
 	}
+}
+template<typename T>
+static void process(T *buf, size_t samples)
+{
+	process(buf, samples, (float)std::numeric_limits<T>::min(),
+	                      (float)std::numeric_limits<T>::max());
+}
+static void process(float *buf, size_t samples)
+{
+	process(buf, samples, -1.0f, 1.0f);
+}
 
-	free(tmp);
+static void set_sound_params(const sound_params &sp)
+{
+	logit ("Recreating filters due to sound parameter changes...");
+	sample_rate = sp.rate;
+	channels = sp.channels;
+	for (auto &e : equalizers) e->setup(sample_rate, channels);
+	fading = false;
+	fade_from = NULL;
+}
+
+/* Called when the device is opened: recompute the filters for the new sound
+ * parameters and allocate what's needed for buffers of up to max_size bytes,
+ * so none of this happens on the output thread. */
+void equalizer_prepare(const sound_params &sp, size_t max_size)
+{
+	size_t samples = max_size / sfmt_Bps(sp.fmt);
+	if (tmp.size() < samples) tmp.resize(samples);
+	if (tmp_fade.size() < samples) tmp_fade.resize(samples);
+
+	if (sp.rate != sample_rate || sp.channels != channels)
+		set_sound_params(sp);
 }
 
 /* sound processing code */
 void equalizer_process_buffer(char *buf, size_t size, const sound_params &sp)
 {
-	if(!options::EqualizerActive || !eq || eq->b.empty()) return;
+	if(!options::EqualizerActive || !eq || !eq->bands()) return;
 
 	if (sp.rate != sample_rate || sp.channels != channels)
-	{
-		logit ("Recreating filters due to sound parameter changes...");
-		sample_rate = sp.rate;
-		channels = sp.channels;
-		equalizer_refresh();
-	}
+		set_sound_params(sp);
 
 	bool do_endian = (sp.fmt & SFMT_MASK_ENDIANNESS != SFMT_NE);
 
@@ -417,12 +512,10 @@ static int read_setup(char *desc, Equalizer *&s)
 	if (!N) return -4;
 
 	s = new Equalizer;
-	s->b.reserve(channels * N);
-
-	for (int i = 0; i < N; ++i)
-		s->b.emplace_back(DG[i], CF[i], sample_rate, BW[i]);
-	for (int c = 1; c < channels; ++c)
-		s->b.insert(s->b.end(), s->b.begin(), s->b.begin() + N);
+	s->CF.swap(CF);
+	s->BW.swap(BW);
+	s->DG.swap(DG);
+	s->setup(sample_rate, channels);
 
 	/*
 	preamping
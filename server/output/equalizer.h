@@ -2,6 +2,7 @@
 
 void equalizer_init();
 void equalizer_shutdown();
+void equalizer_prepare(const sound_params &sp, size_t max_size);
 void equalizer_process_buffer(char *buf, size_t size, const sound_params &sp);
 void equalizer_refresh();
 bool equalizer_is_active();
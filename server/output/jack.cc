@@ -203,10 +203,15 @@ struct jack_driver : public AudioDriver
 
 	int get_buff_fill () const override
 	{
-		/* FIXME: should we also use jack_port_get_latency() here? */
+		/* what is in our ring buffers plus the playback latency of
+		 * the ports behind them (in frames) */
+		jack_latency_range_t range;
+		jack_port_get_latency_range (output_port[0], JackPlaybackLatency, &range);
+
 		return sizeof(float) * (jack_ringbuffer_read_space(ringbuffer[0])
 				+ jack_ringbuffer_read_space(ringbuffer[1]))
-			/ sizeof(jack_default_audio_sample_t);
+			/ sizeof(jack_default_audio_sample_t)
+			+ 2 * sizeof(float) * range.max;
 	}
 
 	bool reset () override
@@ -1,4 +1,5 @@
 #include <pthread.h>
+#include <atomic>
 #include "../audio.h"
 #include "../../fifo_buf.h"
 #include "out_buf.h"
@@ -9,13 +10,14 @@ public:
 	out_buf(size_t size);
 	~out_buf();
 
-	fifo_buf buf;
+	fifo_buf buf; /* Lock-free, mutex only guards the state below. */
 	pthread_mutex_t	mutex;
 	pthread_t tid;	/* Thread id of the reading thread. */
 
 	/* Signals. */
 	pthread_cond_t play_cond;	/* Something was written to the buffer. */
-	pthread_cond_t ready_cond;	/* There is some space in the buffer. */
+	pthread_cond_t ready_cond;	/* The read thread went through its loop. */
+	pthread_cond_t space_cond;	/* There is some space in the buffer. */
 
 	/* Optional callback called when there is some free space in
 	 * the buffer. */
@@ -24,28 +26,35 @@ public:
 	/* State flags of the buffer. */
 	int pause;
 	int exit;	/* Exit when the buffer is empty. */
-	int stop;	/* Don't play anything. */
+	std::atomic<int> stop;	/* Don't play anything. */
 
 	int reset_dev;	/* Request to the reading thread to reset the audio
 			   device. */
 
-	float time;	/* Time of played sound. */
-	int hardware_buf_fill;	/* How the sound card buffer is filled. */
+	frame_clock clock;	/* Position of the played sound. */
+	int hardware_delay;	/* Frames in the sound card buffer. */
 
-	int read_thread_waiting; /* Is the read thread waiting for data? */
+	/* Is the read thread waiting for data? Is out_buf_put() waiting
+	 * for space? Both are set under the mutex before checking the
+	 * buffer, so the other side only has to lock and signal when it
+	 * sees them set. */
+	std::atomic<int> read_thread_waiting;
+	std::atomic<int> write_waiting;
 };
 
 static void *read_thread (void *arg);
 
 out_buf::out_buf(size_t size)
 	: buf(size)
-	, exit(0), pause(0), stop(0), time(0.0)
-	, reset_dev(0), hardware_buf_fill(0), read_thread_waiting(0)
+	, exit(0), pause(0), stop(0)
+	, reset_dev(0), hardware_delay(0), read_thread_waiting(0)
+	, write_waiting(0)
 	, free_callback(NULL)
 {
 	pthread_mutex_init (&mutex, NULL);
 	pthread_cond_init (&play_cond, NULL);
 	pthread_cond_init (&ready_cond, NULL);
+	pthread_cond_init (&space_cond, NULL);
 
 	int rc = pthread_create (&tid, NULL, read_thread, this);
 	if (rc) fatal ("Can't create buffer thread: %s", xstrerror (rc));
@@ -65,6 +74,7 @@ out_buf::~out_buf()
 	LOCK (mutex);
 	buf.clear();
 	pthread_cond_broadcast (&ready_cond);
+	pthread_cond_broadcast (&space_cond);
 	UNLOCK (mutex);
 
 	int rc = pthread_mutex_destroy (&mutex);
@@ -73,6 +83,8 @@ out_buf::~out_buf()
 	if (rc) log_errno ("Destroying buffer play condition failed", rc);
 	rc = pthread_cond_destroy (&ready_cond);
 	if (rc) log_errno ("Destroying buffer ready condition failed", rc);
+	rc = pthread_cond_destroy (&space_cond);
+	if (rc) log_errno ("Destroying buffer space condition failed", rc);
 }
 
 /* Allocate and initialize the buf structure, size is the buffer size. */
@@ -93,7 +105,6 @@ void out_buf_free (struct out_buf *buf)
 /* Don't play more than this value (in seconds) in one audio_play().
  * This prevents locking. */
 #define AUDIO_MAX_PLAY		0.1
-#define AUDIO_MAX_PLAY_BYTES	32768
 
 static void set_realtime_prio ()
 {
@@ -124,8 +135,10 @@ static void *read_thread (void *arg)
 	while (1) {
 		int played = 0;
 		char play_buf[AUDIO_MAX_PLAY_BYTES];
-		int play_buf_fill;
-		int play_buf_pos = 0;
+		const char *play_data;
+		size_t play_buf_fill;
+		size_t play_buf_pos = 0;
+		bool in_place;
 
 		if (buf->reset_dev && !audio_dev_closed) {
 			audio_reset ();
@@ -144,7 +157,10 @@ static void *read_thread (void *arg)
 		}
 
 		pthread_cond_broadcast (&buf->ready_cond);
+		if (buf->write_waiting)
+			pthread_cond_signal (&buf->space_cond);
 
+		buf->read_thread_waiting = 1;
 		if ((buf->buf.get_fill() == 0 || buf->pause || buf->stop)
 				&& !buf->exit) {
 			if (buf->pause && !audio_dev_closed) {
@@ -153,7 +169,6 @@ static void *read_thread (void *arg)
 				audio_dev_closed = 1;
 			}
 
-			buf->read_thread_waiting = 1;
 			pthread_cond_wait (&buf->play_cond, &buf->mutex);
 		}
 
@@ -196,25 +211,45 @@ static void *read_thread (void *arg)
 			audio_bpf = audio_get_bpf();
 			play_buf_frames = MIN(audio_get_bps() * AUDIO_MAX_PLAY,
 			                      AUDIO_MAX_PLAY_BYTES) / audio_bpf;
-			play_buf_fill = buf->buf.get(play_buf, play_buf_frames * audio_bpf);
 			UNLOCK (buf->mutex);
 
+			/* Play straight from the ring buffer unless a frame
+			 * wraps around its end. */
+			play_data = buf->buf.read_span(play_buf_fill);
+			play_buf_fill = MIN(play_buf_fill, play_buf_frames * audio_bpf);
+			play_buf_fill -= play_buf_fill % audio_bpf;
+			in_place = (play_buf_fill > 0);
+			if (!in_place) {
+				play_buf_fill = buf->buf.get(play_buf, play_buf_frames * audio_bpf);
+				play_data = play_buf;
+			}
+
 			while (play_buf_pos < play_buf_fill) {
 				played = audio_send_pcm (
-						play_buf + play_buf_pos,
+						play_data + play_buf_pos,
 						play_buf_fill - play_buf_pos);
 
 				play_buf_pos += played;
 			}
 
+			if (in_place)
+				buf->buf.commit_read(play_buf_fill);
+
+			if (play_buf_fill && buf->write_waiting) {
+				LOCK (buf->mutex);
+				pthread_cond_signal (&buf->space_cond);
+				UNLOCK (buf->mutex);
+			}
+
 			/*logit ("done sending PCM");*/
 
 			LOCK (buf->mutex);
 
 			/* Update time */
-			if (play_buf_fill && audio_get_bps())
-				buf->time += play_buf_fill / (float)audio_get_bps();
-			buf->hardware_buf_fill = audio_get_buf_fill();
+			if (play_buf_fill)
+				buf->clock.add(play_buf_fill / audio_bpf,
+				               audio_get_bps() / audio_bpf);
+			buf->hardware_delay = audio_get_buf_fill() / audio_bpf;
 		}
 	}
 
@@ -225,7 +260,9 @@ static void *read_thread (void *arg)
 	return NULL;
 }
 
-/* Put data at the end of the buffer, return 0 if nothing was put. */
+/* Put data at the end of the buffer, return 0 if nothing was put.
+ * The mutex is only taken when the buffer is full or the read thread
+ * is waiting for data. */
 int out_buf_put (struct out_buf *buf, const char *data, int size)
 {
 	int pos = 0;
@@ -235,34 +272,73 @@ int out_buf_put (struct out_buf *buf, const char *data, int size)
 	while (size) {
 		int written;
 
-		LOCK (buf->mutex);
-
-		if (buf->buf.get_space() == 0 && !buf->stop) {
-			/*logit ("buffer full, waiting for the signal");*/
-			pthread_cond_wait (&buf->ready_cond, &buf->mutex);
-			/*logit ("buffer ready");*/
+		if (buf->buf.get_space() == 0) {
+			LOCK (buf->mutex);
+			buf->write_waiting = 1;
+			if (buf->buf.get_space() == 0 && !buf->stop) {
+				/*logit ("buffer full, waiting for the signal");*/
+				pthread_cond_wait (&buf->space_cond, &buf->mutex);
+				/*logit ("buffer ready");*/
+			}
+			buf->write_waiting = 0;
+			UNLOCK (buf->mutex);
 		}
 
 		if (buf->stop) {
 			logit ("the buffer is stopped, refusing to write to the buffer");
-			UNLOCK (buf->mutex);
 			return 0;
 		}
 
 		written = buf->buf.put(data + pos, size);
 
 		if (written) {
-			pthread_cond_signal (&buf->play_cond);
 			size -= written;
 			pos += written;
-		}
 
-		UNLOCK (buf->mutex);
+			if (buf->read_thread_waiting) {
+				LOCK (buf->mutex);
+				pthread_cond_signal (&buf->play_cond);
+				UNLOCK (buf->mutex);
+			}
+		}
 	}
 
 	return 1;
 }
 
+/* Zero-copy version of out_buf_put(): return a pointer to contiguous free
+ * space in the buffer and set size to its length (which can be less than
+ * the total free space). Never blocks. Returns NULL if there is no space
+ * or the buffer is stopped. */
+char *out_buf_reserve (struct out_buf *buf, size_t *size)
+{
+	assert (buf != NULL);
+
+	if (buf->stop) {
+		*size = 0;
+		return NULL;
+	}
+
+	char *p = buf->buf.write_span(*size);
+	return *size ? p : NULL;
+}
+
+/* Make size bytes written to the pointer returned by out_buf_reserve()
+ * available to the reading thread. */
+void out_buf_commit (struct out_buf *buf, size_t size)
+{
+	assert (buf != NULL);
+
+	if (!size) return;
+	buf->buf.commit_write(size);
+
+	if (buf->read_thread_waiting) {
+		LOCK (buf->mutex);
+		pthread_cond_signal (&buf->play_cond);
+		UNLOCK (buf->mutex);
+	}
+}
+
 void out_buf_pause (struct out_buf *buf)
 {
 	LOCK (buf->mutex);
@@ -307,32 +383,41 @@ void out_buf_reset (struct out_buf *buf)
 	buf->stop = 0;
 	buf->pause = 0;
 	buf->reset_dev = 0;
-	buf->hardware_buf_fill = 0;
+	buf->hardware_delay = 0;
 	UNLOCK (buf->mutex);
 }
 
-void out_buf_time_set (struct out_buf *buf, const float time)
+void out_buf_time_set (struct out_buf *buf, int64_t ns)
 {
 	LOCK (buf->mutex);
-	buf->time = time;
+	buf->clock.set_ns(ns);
 	UNLOCK (buf->mutex);
 }
 
-/* Return the time in the audio which the user is currently hearing.
+/* Return the time (in ns) in the audio which the user is currently hearing.
  * If unplayed samples still remain in the hardware buffer from the
  * previous audio then the value returned may be negative and it is
  * up to the caller to handle this appropriately in the context of
  * its own processing. */
-int out_buf_time_get (struct out_buf *buf)
+int64_t out_buf_time_ns (struct out_buf *buf)
 {
-	int time;
-	int bps = audio_get_bps ();
+	LockGuard g(buf->mutex);
+	return buf->clock.ns(buf->hardware_delay);
+}
 
-	LOCK (buf->mutex);
-	time = buf->time - (bps ? buf->hardware_buf_fill / (float)bps : 0);
-	UNLOCK (buf->mutex);
+/* Same in whole seconds. */
+int out_buf_time_get (struct out_buf *buf)
+{
+	return out_buf_time_ns (buf) / NS_PER_SEC;
+}
 
-	return time;
+/* Same in frames at the current device rate, which is put into *rate
+ * (0 if nothing was played yet). */
+int64_t out_buf_frames_get (struct out_buf *buf, int *rate)
+{
+	LockGuard g(buf->mutex);
+	*rate = buf->clock.rate;
+	return buf->clock.position(buf->hardware_delay);
 }
 
 void out_buf_set_free_callback (struct out_buf *buf,
@@ -347,28 +432,14 @@ void out_buf_set_free_callback (struct out_buf *buf,
 
 int out_buf_get_free (struct out_buf *buf)
 {
-	int space;
-
 	assert (buf != NULL);
-
-	LOCK (buf->mutex);
-	space = buf->buf.get_space();
-	UNLOCK (buf->mutex);
-
-	return space;
+	return buf->buf.get_space();
 }
 
 int out_buf_get_fill (struct out_buf *buf)
 {
-	int fill;
-
 	assert (buf != NULL);
-
-	LOCK (buf->mutex);
-	fill = buf->buf.get_fill();
-	UNLOCK (buf->mutex);
-
-	return fill;
+	return buf->buf.get_fill();
 }
 
 /* Wait until the read thread will stop and wait for data to come.
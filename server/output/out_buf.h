@@ -1,18 +1,62 @@
 #pragma once
+#include <stdint.h>
 
 typedef void out_buf_free_callback ();
 
+#define NS_PER_SEC	1000000000LL
+
+/* Playback position as a number of frames. Frames are counted exactly and
+ * only converted to time when asked, so nothing drifts. When the rate
+ * changes, what was counted so far is folded into base. */
+struct frame_clock
+{
+	int64_t base;	/* ns before the current rate started */
+	int64_t frames;	/* frames since then */
+	int rate;	/* 0 if not known yet */
+
+	frame_clock () : base(0), frames(0), rate(0) {}
+
+	void set_ns (int64_t ns) { base = ns; frames = 0; }
+	void add (int64_t n, int r)
+	{
+		if (r != rate) {
+			base = ns ();
+			frames = 0;
+			rate = r;
+		}
+		frames += n;
+	}
+	int64_t ns (int64_t delay_frames = 0) const
+	{
+		if (!rate) return base;
+		int64_t n = frames - delay_frames;
+		return base + n / rate * NS_PER_SEC + n % rate * NS_PER_SEC / rate;
+	}
+	int64_t position (int64_t delay_frames = 0) const /* in frames at rate */
+	{
+		return base / NS_PER_SEC * rate + base % NS_PER_SEC * rate / NS_PER_SEC
+			+ frames - delay_frames;
+	}
+};
+
+/* Don't play more than this many bytes in one audio_send_pcm(). */
+#define AUDIO_MAX_PLAY_BYTES	32768
+
 struct out_buf;
 
 struct out_buf *out_buf_new (int size);
 void out_buf_free (struct out_buf *buf);
 int out_buf_put (struct out_buf *buf, const char *data, int size);
+char *out_buf_reserve (struct out_buf *buf, size_t *size);
+void out_buf_commit (struct out_buf *buf, size_t size);
 void out_buf_pause (struct out_buf *buf);
 void out_buf_unpause (struct out_buf *buf);
 void out_buf_stop (struct out_buf *buf);
 void out_buf_reset (struct out_buf *buf);
-void out_buf_time_set (struct out_buf *buf, const float time);
+void out_buf_time_set (struct out_buf *buf, int64_t ns);
 int out_buf_time_get (struct out_buf *buf);
+int64_t out_buf_time_ns (struct out_buf *buf);
+int64_t out_buf_frames_get (struct out_buf *buf, int *rate);
 void out_buf_set_free_callback (struct out_buf *buf,
 		out_buf_free_callback callback);
 int out_buf_get_free (struct out_buf *buf);
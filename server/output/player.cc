@@ -10,6 +10,7 @@
  */
 
 #include <pthread.h>
+#include <atomic>
 #include <deque>
 
 #include "../input/decoder.h"
@@ -18,6 +19,7 @@
 #include "player.h"
 
 #define PCM_BUF_SIZE		(36 * 1024)
+#define DIRECT_MIN		(32 * 1024) /* see Codec::decode() */
 
 enum Request
 {
@@ -40,7 +42,7 @@ static volatile int req_seek = 0;
 
 struct BitrateList
 {
-	struct Entry { int time, bitrate; };
+	struct Entry { int64_t time; int bitrate; }; // time in ns
 	std::deque<Entry> entries;
 	pthread_mutex_t mtx;
 
@@ -57,7 +59,7 @@ struct BitrateList
 	}
 	void clear() { LockGuard G(mtx); entries.clear(); }
 
-	void add(int time, int bitrate)
+	void add(int64_t time, int bitrate)
 	{
 		LockGuard G(mtx);
 		assert(entries.empty() || time >= entries.back().time);
@@ -67,7 +69,7 @@ struct BitrateList
 			entries.push_back({time, bitrate});
 	}
 
-	int get (int t)
+	int get (int64_t t)
 	{
 		LockGuard G(mtx);
 		if (entries.empty() || entries.front().time > t) return -1;
@@ -84,8 +86,8 @@ static BitrateList bitrate_list;
 struct DecoderState
 {
 	DecoderState(const str &path)
-	: buf(PCM_BUF_SIZE), buf_fill(0), path(path), time(0.0)
-	, sp{ -1, -1, -1 }, sound_params_changed(false), tags_changed(false)
+	: buf(PCM_BUF_SIZE), buf_fill(0), path(path)
+	, sp{ -1, -1, -1 }, tags_changed(false)
 	, codec(NULL), done(true)
 	{
 		Decoder *f = get_decoder(path);
@@ -118,15 +120,47 @@ struct DecoderState
 		const size_t N = buf.size();
 		if (done || buf_fill >= N) return false;
 		
-		// decode next chunk
+		int n = decode(buf.data() + buf_fill, N - buf_fill);
+		mark(n);
+		buf_fill += n;
+		assert(buf_fill <= N);
+		return true;
+	}
+
+	// Decode straight into the output buffer. Returns false if that
+	// is not possible (then use decode() above).
+	bool decode_direct()
+	{
+		if (done || buf_fill) return false;
+
+		size_t N;
+		char *dst = audio_reserve_buf(sp, N);
+		if (!dst || N < DIRECT_MIN) return false;
+		N = std::min(N, buf.size());
+
 		sound_params sp0 = sp;
-		int n = codec->decode(buf.data() + buf_fill, N - buf_fill, sp);
-		buf_fill += n; assert(buf_fill <= N);
+		int n = decode(dst, N);
+		if (sp == sp0)
+			audio_commit_buf(n);
+		else
+		{
+			// can't play this yet, keep it for when the device was
+			// reopened with the new parameters
+			memcpy(buf.data(), dst, n);
+			mark(n);
+			buf_fill = n;
+		}
+		return true;
+	}
+	
+	// decode next chunk into dst and update bitrate and such
+	int decode(char *dst, size_t N)
+	{
+		sound_params sp0 = sp;
+		int n = codec->decode(dst, N, sp);
 		
-		// update bitrate and such
-		if (sp != sp0) sound_params_changed = true;
-		bitrate.add(time, codec->get_bitrate());
-		time += n / (double)(sfmt_Bps(sp.fmt) * sp.rate * sp.channels);
+		bitrate.add(clock.ns(), codec->get_bitrate());
+		if (n) clock.add(n / (sfmt_Bps(sp.fmt) * sp.channels), sp.rate);
 		
 		// if it fails without producing any sound, mark the file as broken
 		if (!n && sp0.channels == -1) audio_fail_file(path);
@@ -135,28 +169,60 @@ struct DecoderState
 		if (!n || codec->error.type == ERROR_FATAL) done = true;
 		//if (!done && codec->current_tags(tags)) if (sp0.channels != -1) tags_changed = true;
 
-		return true;
+		return n;
 	}
-	
+
+	// n bytes in the current format were added to the end of buf
+	void mark(size_t n)
+	{
+		if (!n) return;
+		if (segments.empty() || segments.back().sp != sp)
+			segments.push_back({sp, n});
+		else
+			segments.back().size += n;
+	}
+
+	// Size and format of what flush() would send next
+	size_t pending() const { return segments.empty() ? 0 : segments.front().size; }
+	const sound_params &pending_sp() const { assert(!segments.empty()); return segments.front().sp; }
+
+	// Send the first segment of buf, which must be in the format that the
+	// device is currently opened with.
 	void flush()
 	{
-		audio_send_buf(buf.data(), buf_fill);
+		if (segments.empty()) return;
+		const size_t n = segments.front().size;
+		segments.pop_front();
+		audio_send_buf(buf.data(), n);
+		buf_fill -= n;
+		if (buf_fill) memmove(buf.data(), buf.data() + n, buf_fill);
+		assert(buf_fill || segments.empty());
+	}
+
+	void clear()
+	{
 		buf_fill = 0;
+		segments.clear();
 	}
 
 
 	Codec *codec;
 	str path; // what is this decoding?
 
+	// Decoded sound that was not sent yet. It can have different formats
+	// if the sound parameters changed while decoding: the segments list
+	// says where each one starts, so the device can be reopened at exactly
+	// the right sample.
+	struct Segment { sound_params sp; size_t size; };
 	std::vector<char> buf;
 	size_t buf_fill;
+	std::deque<Segment> segments; // sizes add up to buf_fill
 	
-	double time; // at the end of buf (used to update bitrate)
+	frame_clock clock; // at the end of buf (used to update bitrate)
 	sound_params sp; // from last decode call
 	BitrateList bitrate;
 	file_tags tags;
 	bool tags_changed;
-	bool sound_params_changed;
 
 	bool done;
 };
@@ -164,30 +230,69 @@ struct DecoderState
 //-----------------------------------------------------------------------------
 // Precache
 //-----------------------------------------------------------------------------
+// Opens the next few files of the playlist and decodes the start of each,
+// while the current file is still playing. The player takes them from here
+// in order and throws away what it skipped.
+//-----------------------------------------------------------------------------
+
+#define PRECACHE_MAX 8 /* upper limit for options::PrecacheFiles */
 
 static void *precache_thread (void *data); // below
 
 struct Precache
 {
-	Precache() : decoder(NULL), running(false), tid(0) {}
-	~Precache() { assert(!running); delete decoder; }
+	Precache() : running(false), cancel(false), stop_after(PRECACHE_MAX), tid(0) {}
+	~Precache() { assert(!running); drop(); }
+
+	struct Entry
+	{
+		str path;
+		DecoderState *decoder; // NULL until precached (or if that failed)
+		bool tried; // precache thread was here
+	};
+	std::vector<Entry> entries; // next files, in playing order
 
-	DecoderState *decoder;
 	bool running; /* if the precache thread is running */
+	std::atomic<bool> cancel;
+	std::atomic<int>  stop_after; // entry after which the thread stops
 	pthread_t tid; /* tid of the precache thread */
-	str path;
 
-	bool start(const str &p)
+	// Precache paths (the files that will be played after the current
+	// one, in that order). Keeps what was already done for them.
+	void start(const std::vector<str> &paths)
 	{
-		if (running) finish();
-		path = p;
-		logit ("Precaching %s", path.c_str());
+		finish();
+
+		std::vector<Entry> E;
+		for (auto &p : paths)
+		{
+			if (E.size() >= PRECACHE_MAX) break;
+			auto it = std::find_if(entries.begin(), entries.end(),
+				[&p](const Entry &e){ return e.path == p && e.tried; });
+			if (it != entries.end())
+			{
+				E.push_back(*it);
+				it->decoder = NULL;
+				it->tried = false;
+			}
+			else
+				E.push_back({p, NULL, false});
+		}
+		for (auto &e : entries) delete e.decoder;
+		entries.swap(E);
+
+		bool todo = false;
+		for (auto &e : entries) if (!e.tried) todo = true;
+		if (!todo) return;
+
+		logit ("Precaching %d files", (int)entries.size());
+		cancel = false;
+		stop_after = PRECACHE_MAX;
 		int rc = pthread_create (&tid, NULL, precache_thread, NULL);
 		if (rc != 0)
 			log_errno ("Could not run precache thread", rc);
 		else
 			running = true;
-		return running;
 	}
 	void finish()
 	{
@@ -200,53 +305,71 @@ struct Precache
 	}
 	void drop()
 	{
+		cancel = true;
+		finish();
+		for (auto &e : entries) delete e.decoder;
+		entries.clear();
+	}
+
+	// Is path the next entry and does it start in sp? Waits for it to be
+	// precached, but not for the ones after it.
+	bool continues(const str &path, const sound_params &sp)
+	{
+		if (entries.empty() || entries[0].path != path) return false;
+		stop_after = 0;
+		finish();
+		DecoderState *d = entries[0].decoder;
+		return d && d->pending() && d->pending_sp() == sp;
+	}
+
+	// Returns the decoder for path if it was precached (NULL otherwise)
+	// and forgets all the entries up to it.
+	DecoderState *take(const str &path)
+	{
+		// entries and their paths don't change while the thread runs
+		size_t i = 0, n = entries.size();
+		while (i < n && entries[i].path != path) ++i;
+		if (i == n)
+		{
+			if (n) logit ("The precached files are not the file we want.");
+			drop();
+			return NULL;
+		}
+
+		// wait for this one, but not for the ones after it
+		stop_after = (int)i;
 		finish();
-		delete decoder;
-		decoder = NULL;
+
+		DecoderState *d = entries[i].decoder;
+		for (size_t j = 0; j < i; ++j) delete entries[j].decoder;
+		entries.erase(entries.begin(), entries.begin() + i + 1);
+		return d;
 	}
 };
 static Precache precache;
 
 static void *precache_thread (void *)
 {
-	delete precache.decoder;
-	precache.decoder = new DecoderState(precache.path);
-	if (precache.decoder->done)
+	for (int i = 0; i < (int)precache.entries.size() && i <= precache.stop_after; ++i)
 	{
-		delete precache.decoder;
-		precache.decoder = NULL;
-		return NULL;
-	}
-	auto &decoder = *precache.decoder;
-	assert(decoder.sp.channels == -1);
+		auto &e = precache.entries[i];
+		if (precache.cancel) break;
+		if (e.tried) continue;
+		e.tried = true;
+		if (plist_item::ftype(e.path) != F_SOUND) continue;
 
-	while (!decoder.done)
-	{
-		bool first = (decoder.sp.channels == -1);
-		bool ok = decoder.decode();
-		if (!ok) break;
+		DecoderState *d = new DecoderState(e.path);
+		while (!precache.cancel && d->decode()) {}
 
-		// if sound_params change, we have no place to put that
-		// information, so cancel (this thing can't be precached)
-		if (decoder.sound_params_changed || decoder.tags_changed)
+		if (!d->buf_fill)
 		{
-			if (first)
-			{
-				decoder.sound_params_changed = false;
-				decoder.tags_changed = false;
-			}
-			else
-			{
-				logit("Cannot precache");
-				// we can pre-open the thing again though...
-				delete precache.decoder;
-				precache.decoder = new DecoderState(precache.path);
-				break;
-			}
+			delete d;
+			continue;
 		}
+		logit ("Precached %d bytes (%d formats) from %s", (int)d->buf_fill,
+			(int)d->segments.size(), e.path.c_str());
+		e.decoder = d;
 	}
-
-	logit ("Precached %d bytes from %s", decoder.buf_fill, precache.path.c_str());
 	return NULL;
 }
 
@@ -256,6 +379,7 @@ static void *precache_thread (void *)
 
 static DecoderState *decoder = NULL;
 static pthread_mutex_t decoder_stream_mtx = PTHREAD_MUTEX_INITIALIZER;
+static sound_params dev_sp{ -1, -1, -1 }; // kept for a gapless player() call
 
 void player_init ()
 {
@@ -269,58 +393,52 @@ static void buf_free_cb ()
 	UNLOCK (request_cond_mtx);
 
 	static int last_time = 0;
-	int ctime = audio_get_time ();
-	if (ctime >= 0 && ctime != last_time) {
+	int64_t t = audio_get_time_ns ();
+	int ctime = t / NS_PER_SEC;
+	if (t >= 0 && ctime != last_time) {
 		last_time = ctime;
 		ctime_change ();
-		set_info_bitrate(decoder ? decoder->bitrate.get(ctime) : -1);
+		set_info_bitrate(decoder ? decoder->bitrate.get(t) : -1);
 	}
 }
 
-/* Open a file, decode it and put output into the buffer. At the end, start
- * precaching next_file. */
-void player (const char *file, const char *next_file, struct out_buf *out_buf)
+/* Open a file, decode it and put output into the buffer. When the buffer is
+ * full, start precaching next_files.
+ *
+ * If all of the file is in the buffer and next_files[0] was precached in
+ * the same format, return true without waiting for the buffer to play:
+ * the caller should then call this for that file with gapless set, and
+ * it goes on filling the buffer after the end of this one. The time is
+ * set so that it gets to 0 when the new file can be heard. Between files
+ * with different formats the buffer is played out and the device
+ * reopened, like before. */
+bool player (const char *file, const std::vector<str> &next_files, struct out_buf *out_buf, bool gapless)
 {
-	out_buf_reset (out_buf);
+	if (!gapless) out_buf_reset (out_buf);
 
-	DecoderState *d = NULL;
-	precache.finish();
-	if (precache.decoder)
+	DecoderState *d = precache.take(file);
+	if (d)
 	{
-		if (precache.decoder->path == file)
-		{
-			logit ("Using precached file");
-			d = precache.decoder;
-			precache.decoder = NULL;
-
-			auto &sp = d->sp;
-			set_info_channels (sp.channels);
-			set_info_rate (sp.rate / 1000);
-			if (!audio_open(&sp))
-			{
-				delete d;
-				return;
-			}
-
-			d->flush();
-			set_info_avg_bitrate (d->codec ? d->codec->get_avg_bitrate() : -1);
-		}
-		else
-		{
-			logit ("The precached file is not the file we want.");
-			precache.drop();
-		}
+		logit ("Using precached file");
+		set_info_avg_bitrate (d->codec ? d->codec->get_avg_bitrate() : -1);
+	}
+	else
+		d = new DecoderState(file);
+	if (d->done && !d->buf_fill)
+	{
+		delete d;
+		if (gapless) out_buf_wait (out_buf); // the end of the last file
+		return false;
 	}
-	
-	if (!d) d = new DecoderState(file);
-	if (d->done && !d->buf_fill) return;
 
 	delete decoder; decoder = d;
 	
 	audio_state_started_playing ();
-	assert(decoder); if (!decoder) return;
 
-	bool stopped = false;
+	bool stopped = false, precaching = next_files.empty();
+	bool tried_handover = false, handover = false;
+	sound_params out_sp{ -1, -1, -1 }; // what the device was opened with
+	if (gapless) out_sp = dev_sp;
 
 	out_buf_set_free_callback (out_buf, buf_free_cb);
 
@@ -328,20 +446,45 @@ void player (const char *file, const char *next_file, struct out_buf *out_buf)
 	{
 		if (!decoder->done)
 		{
-			decoder->decode();
+			if (!decoder->decode_direct()) decoder->decode();
 
 			decoder_error &err = decoder->codec->error;
 			if (err) error ("%s", err.desc.c_str());
 		}
 
-		/* Wait, if there is no space in the buffer to put the decoded
-		 * data or EOF occurred and there is something in the buffer. */
-		if (decoder->buf_fill > out_buf_get_free(out_buf)
-		|| (decoder->done && out_buf_get_fill(out_buf)))
+		/* All of it is in the buffer, see if the next file can follow
+		 * it right away. */
+		if (!tried_handover && decoder->done && !decoder->pending()
+		    && !next_files.empty() && out_sp.channels != -1)
+		{
+			tried_handover = true;
+			if (!precaching)
+			{
+				precaching = true;
+				precache.start(next_files);
+			}
+			if (precache.continues(next_files[0], out_sp))
+			{
+				logit ("Going on with the next file without a gap");
+				handover = true;
+				break;
+			}
+		}
+
+		/* Wait, if the next part of the decoded data can not be sent
+		 * (no space in the buffer or the device has to be reopened
+		 * first and is still playing) or EOF occurred and there is
+		 * something in the buffer. */
+		const size_t n = decoder->pending();
+		if (n ? (decoder->pending_sp() == out_sp ? n > (size_t)out_buf_get_free(out_buf)
+		                                         : out_buf_get_fill(out_buf) > 0)
+		      : decoder->done && out_buf_get_fill(out_buf))
 		{
-			if (next_file && !precache.running && !precache.decoder && 
-			plist_item::ftype(next_file) == F_SOUND)
-				precache.start(next_file);
+			if (!precaching)
+			{
+				precaching = true;
+				precache.start(next_files);
+			}
 			
 			LOCK (request_cond_mtx);
 			pthread_cond_wait (&request_cond, &request_cond_mtx);
@@ -384,10 +527,10 @@ void player (const char *file, const char *next_file, struct out_buf *out_buf)
 					if (pos != -1) {
 						out_buf_stop (out_buf);
 						out_buf_reset (out_buf);
-						out_buf_time_set (out_buf, pos);
+						out_buf_time_set (out_buf, pos * NS_PER_SEC);
 						decoder->bitrate.clear();
-						decoder->time = pos;
-						decoder->buf_fill = 0;
+						decoder->clock.set_ns(pos * NS_PER_SEC);
+						decoder->clear();
 					}
 					break;
 				}
@@ -397,23 +540,25 @@ void player (const char *file, const char *next_file, struct out_buf *out_buf)
 		}
 		if (stopped) break;
 
-		if (decoder->buf_fill <= out_buf_get_free(out_buf) && !decoder->sound_params_changed)
-		{
-			decoder->flush();
-		}
-		
-		if (decoder->sound_params_changed && out_buf_get_fill(out_buf) == 0)
+		if (decoder->pending())
 		{
-			decoder->sound_params_changed = false;
-			auto &sp = decoder->sp;
-			logit ("Sound parameters have changed.");
-			set_info_channels (sp.channels);
-			set_info_rate (sp.rate / 1000);
-			out_buf_wait (out_buf);
-			if (!audio_open(&sp)) break;
+			sound_params sp = decoder->pending_sp();
+			if (sp != out_sp && out_buf_get_fill(out_buf) == 0)
+			{
+				if (out_sp.channels != -1) logit ("Sound parameters have changed.");
+				set_info_channels (sp.channels);
+				set_info_rate (sp.rate / 1000);
+				out_buf_wait (out_buf);
+				out_sp = sp;
+				if (!audio_open(&sp)) break;
+			}
+			if (sp == out_sp && decoder->pending() <= (size_t)out_buf_get_free(out_buf))
+			{
+				decoder->flush();
+			}
 		}
 		
-		if (decoder->done && out_buf_get_fill(out_buf) == 0)
+		if (decoder->done && !decoder->pending() && out_buf_get_fill(out_buf) == 0)
 		{
 			logit ("played everything");
 			break;
@@ -424,9 +569,17 @@ void player (const char *file, const char *next_file, struct out_buf *out_buf)
 	delete decoder; decoder = NULL;
 	UNLOCK (decoder_stream_mtx);
 
-	out_buf_wait (out_buf);
+	if (handover)
+	{
+		dev_sp = out_sp;
+		int bps = audio_get_bps();
+		if (bps > 0) out_buf_time_set (out_buf, -(int64_t)out_buf_get_fill(out_buf) * NS_PER_SEC / bps);
+	}
+	else
+		out_buf_wait (out_buf);
 
 	logit ("exiting");
+	return handover;
 }
 
 void player_cleanup ()
@@ -460,12 +613,12 @@ void player_stop ()
 
 void player_seek (const int sec)
 {
-	int time = audio_get_time ();
-	if (time < 0) return;
+	int64_t t = audio_get_time_ns ();
+	if (t < 0) return;
 	
 	LockGuard g(request_cond_mtx);
 	request = REQ_SEEK;
-	req_seek = sec + time;
+	req_seek = sec + (int)((t + NS_PER_SEC/2) / NS_PER_SEC);
 	pthread_cond_signal (&request_cond);
 }
 
@@ -4,7 +4,7 @@
 #include "../input/io.h"
 
 void player_cleanup ();
-void player (const char *file, const char *next_file, struct out_buf *out_buf);
+bool player (const char *file, const std::vector<str> &next_files, struct out_buf *out_buf, bool gapless);
 void player_stop ();
 void player_seek (const int n);
 void player_jump_to (const int n);
@@ -1,6 +1,8 @@
 #pragma once
 
-/* Definition of events sent by server to the client. */
+/* Definition of events sent by server to the client. All but EV_PONG,
+ * EV_BUSY, EV_EXIT and EV_DATA are followed by the length of what follows
+ * them (uint32_t), see Socket. */
 enum ServerEvents : int
 {
 	EV_PONG = 101,		/* response for CMD_PING */
@@ -13,6 +15,9 @@ enum ServerEvents : int
 	EV_DATA = 301,		/* data in response to a request follows */
 	EV_FILE_TAGS,		/* tags in a response for tags request */
 	EV_FILE_RATING,		/* ratings changed for a file */
+	EV_FILE_TAGS_BATCH,	/* (path, tags) pairs for a batch request, followed by "" */
+	EV_DIR_CHANGED,		/* files in the client's directory changed: the directory,
+				   then the changed paths and "" */
 	
 	EV_PLIST_NEW = 401,	/* replaced the playlist (no data. use CMD_PLIST_GET) */
 	EV_PLIST_ADD,		/* items were added, followed by the file names and "" */
@@ -21,14 +26,16 @@ enum ServerEvents : int
 	EV_PLIST_RM,		/* items were removed. followed by set of indices */
 	EV_PLIST_MOD,		/* paths changed, followed by (old_path,new_path) pairs */
 
-	EV_STATE = 501, 	/* server has changed the play/pause/stopped state */
+	EV_STATE = 501, 	/* server has changed the play/pause/stopped state,
+				   followed by state, time, song index and path */
 	EV_CTIME,		/* current time of the song has changed */
 	EV_BITRATE,		/* the bitrate has changed */
 	EV_RATE,		/* the rate has changed */
 	EV_CHANNELS,		/* the number of channels has changed */
 	EV_OPTIONS,		/* the options (repeat, shuffle) have changed */
 	EV_AVG_BITRATE,		/* average bitrate has changed */
-	EV_MIXER_CHANGE		/* the mixer channel was changed */
+	EV_MIXER_CHANGE,	/* the mixer channel was changed */
+	EV_MIXER_VALUE		/* the volume has changed, followed by the new one */
 };
 
 /* Definition of server commands. */
@@ -38,7 +45,10 @@ enum ServerCommands : int
 	CMD_QUIT,		/* shutdown the server */
 	CMD_DISCONNECT,		/* disconnect from the server */
 
-	CMD_PLAY = 2001,	/* play i'th item on the (optionally following) playlist, or if -1, play the following path */
+	CMD_PLAY = 2001,	/* play i'th item, followed by i and a path. If i is -1, play the path.
+				   If the path is "", play the i'th item of the current playlist.
+				   Otherwise the path is that of the i'th item of the following
+				   playlist, which replaces the current one */
 	CMD_STOP,		/* stop playing */
 	CMD_PAUSE,		/* pause */
 	CMD_UNPAUSE,		/* unpause */
@@ -47,7 +57,9 @@ enum ServerCommands : int
 	CMD_SEEK,		/* seek in the current stream */
 	CMD_JUMP_TO,		/* jumps to a some position in the current stream */
 
-	CMD_PLIST_GET = 3001,	/* send the entire playlist to client */
+	CMD_PLIST_GET = 3001,	/* send the playlist to the client, followed by the version the
+				   client has (0 for none). The answer is the new version, how
+				   many items at the front and back stay and the items between */
 	CMD_PLIST_ADD,		/* add following items to the playlist */
 	CMD_PLIST_DEL,		/* delete an item from the server's playlist */
 	CMD_PLIST_MOVE,		/* move an item */
@@ -57,6 +69,11 @@ enum ServerCommands : int
 	CMD_FILES_RM,		/* delete files/directories */
 	CMD_FILES_MV,		/* move files into new directory */
 	CMD_FILES_RENAME,	/* move+rename single file */
+	CMD_GET_FILE_TAGS_BATCH,/* get tags for the following (path, mtime) pairs (ended by "").
+				   mtime is what the client saw or -1 if unknown */
+	CMD_WATCH_DIR,		/* the client shows this directory now (for EV_DIR_CHANGED) */
+	CMD_LIBRARY_LIST,	/* get all sound files below a directory from the library:
+				   EV_DATA, found flag, then (path, mtime) pairs and "" */
 
 	CMD_GET_CURRENT = 4001,	/* get the current song index and path */
 	CMD_GET_CTIME,		/* get the current song time */
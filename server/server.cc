@@ -11,12 +11,14 @@
 
 #include <sys/wait.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/resource.h>
 #include <sys/un.h>
 #include <time.h>
 #include <signal.h>
 #include <pthread.h>
+#include <atomic>
 
 #include "protocol.h"
 #include "../Socket.h"
@@ -27,18 +29,39 @@
 #include "output/softmixer.h"
 #include "output/equalizer.h"
 #include "ratings.h"
+#include "dir_watch.h"
+#include "library.h"
+#include "status_shm.h"
 
 #define SERVER_LOG	"amoc_server_log"
 #define PID_FILE	"pid"
 #define PLAYLIST_FILE	"playlist.m3u"
 
+/* Most tags in one EV_FILE_TAGS_BATCH */
+#define TAGS_BATCH_CHUNK	128
+
+/* How often the mixer is checked for changes from outside (in ms), while
+ * clients are connected */
+#define MIXER_CHECK_INTERVAL	500
+
 struct client
 {
 	Socket *socket; 	/* NULL if inactive */
 	pthread_mutex_t events_mtx;
+
+	/* answers to CMD_GET_FILE_TAGS_BATCH that were not sent yet
+	 * (guarded by events_mtx) */
+	std::vector<std::pair<str, file_tags>> tags_batch;
+
+	/* directory the client shows (from CMD_WATCH_DIR, guarded by events_mtx) */
+	str dir;
 };
 static client clients[CLIENTS_MAX];
 
+static std::atomic<bool> state_changed(false); /* EV_STATE needs to be sent */
+static int last_mixer = -1; /* the value the clients know about */
+static double next_mixer_check = 0.0;
+
 // RAII lock for the client's event mutex
 struct Lock
 {
@@ -51,8 +74,14 @@ struct Lock
 /* Thread ID of the server thread. */
 static pthread_t server_tid;
 
-/* Pipe used to wake up the server from select() from another thread. */
-static int wake_up_pipe[2];
+/* Used to wake up the server from epoll_wait() from another thread. */
+static int wake_up_fd = -1;
+
+/* The server loop's epoll instance. Clients are registered with their
+ * index as data (edge-triggered), the other two with these: */
+static int epoll_fd = -1;
+#define EP_LISTEN	CLIENTS_MAX
+#define EP_WAKE_UP	(CLIENTS_MAX + 1)
 
 /* Socket used to accept incoming client connections. */
 static int server_sock = -1;
@@ -151,6 +180,15 @@ static bool add_client (int sock)
 	for (int i = 0; i < CLIENTS_MAX; i++)
 	{
 		if (clients[i].socket) continue;
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.u32 = i;
+		if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+			log_errno ("Can't add client to epoll", errno);
+			return false;
+		}
+
 		clients[i].socket = new Socket(sock);
 		tc->clear_queue(i);
 
@@ -172,10 +210,15 @@ static void del_client(int i)
 {
 	client &cli = clients[i];
 	LOCK (cli.events_mtx);
+	epoll_ctl (epoll_fd, EPOLL_CTL_DEL, cli.socket->fd(), NULL);
 	close (cli.socket->fd());
 	delete cli.socket; cli.socket = NULL;
 	tc->clear_queue(i);
+	cli.tags_batch.clear();
+	str dir; dir.swap(cli.dir);
 	UNLOCK (cli.events_mtx);
+
+	if (!dir.empty()) dir_watch_hide (dir);
 }
 
 /* Check if the process with given PID exists. Return != 0 if so. */
@@ -186,12 +229,10 @@ static bool valid_pid (const pid_t pid)
 
 static void wake_up_server ()
 {
-	int w = 1;
-
 	SOCKET_DEBUG("Waking up the server");
 
-	if (write(wake_up_pipe[1], &w, sizeof(w)) < 0)
-		log_errno ("Can't wake up the server: (write() failed)", errno);
+	if (eventfd_write (wake_up_fd, 1) < 0)
+		log_errno ("Can't wake up the server: (eventfd_write() failed)", errno);
 }
 
 static void redirect_output (FILE *stream)
@@ -259,8 +300,9 @@ void server_init (int debugging, int foreground)
 		log_init_stream (logfp, SERVER_LOG);
 	}
 
-	if (pipe(wake_up_pipe) < 0)
-		fatal ("pipe() failed: %s", xstrerror (errno));
+	wake_up_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_up_fd == -1)
+		fatal ("eventfd() failed: %s", xstrerror (errno));
 
 	unlink (options::SocketPath.c_str());
 
@@ -277,16 +319,32 @@ void server_init (int debugging, int foreground)
 	if (bind(server_sock, (struct sockaddr *)&sock_name, SUN_LEN(&sock_name)) == -1)
 		fatal ("Can't bind() to the socket: %s", xstrerror (errno));
 
-	if (listen(server_sock, 1) == -1)
+	if (listen(server_sock, CLIENTS_MAX) == -1)
 		fatal ("listen() failed: %s", xstrerror (errno));
 
+	epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+	if (epoll_fd == -1)
+		fatal ("epoll_create1() failed: %s", xstrerror (errno));
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u32 = EP_LISTEN;
+	if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, server_sock, &ev) == -1)
+		fatal ("Can't add the socket to epoll: %s", xstrerror (errno));
+	ev.data.u32 = EP_WAKE_UP;
+	if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, wake_up_fd, &ev) == -1)
+		fatal ("Can't add the wake up fd to epoll: %s", xstrerror (errno));
+
 	/* Log stack sizes so stack overflows can be debugged. */
 	log_process_stack_size ();
 	log_pthread_stack_size ();
 
+	status_init ();
 	clients_init ();
 	audio_initialize ();
 	tc = new tags_cache();
+	dir_watch_init (tc);
+	library_init (tc);
 
 	/* Load the playlist from .moc directory. */
 	str plist_file = options::run_file_path(PLAYLIST_FILE);
@@ -396,30 +454,24 @@ void add_event_all(int type)
 	if (added) wake_up_server ();
 }
 
-/* Send events to clients whose sockets are ready to write. */
-static void send_events (fd_set *fds)
+/* Send queued events to client i until it would block. Client sockets are
+ * edge-triggered, so if it does block we get EPOLLOUT when there is space
+ * again. */
+static void send_events (int i)
 {
-	for (int i = 0; i < CLIENTS_MAX; i++)
+	client &cli = clients[i];
+	if (!cli.socket) return;
+	Socket &sock = *cli.socket;
+	if (!sock.pending()) return;
+
+	SOCKET_DEBUG("Flushing events for client %d", i);
+	try {
+		Lock lock(cli);
+		sock.send_pending_noblock();
+	}
+	catch (...)
 	{
-		client &cli = clients[i];
-		if (!cli.socket) continue;
-		Socket &sock = *cli.socket;
-		if (!sock.pending()) continue;
-		SOCKET_DEBUG("Sending events for client %d", i);
-		if (!FD_ISSET(sock.fd(), fds)) continue;
-
-		SOCKET_DEBUG("Flushing events for client %d", i);
-		try {
-			Lock lock(cli);
-			while (sock.pending())
-			{
-				if (sock.send_next_packet_noblock() != 1) break;
-			}
-		}
-		catch (...)
-		{
-			del_client(i);
-		}
+		del_client(i);
 	}
 }
 
@@ -433,11 +485,14 @@ static void server_shutdown ()
 	if (playlist.size()) playlist.save(plist_file); else unlink (plist_file.c_str());
 
 	audio_exit ();
+	status_exit ();
+	dir_watch_exit ();
+	library_exit ();
 	delete tc; tc = NULL;
 	unlink (options::SocketPath.c_str());
 	unlink (options::run_file_path(PID_FILE).c_str());
-	close (wake_up_pipe[0]);
-	close (wake_up_pipe[1]);
+	close (wake_up_fd);
+	close (epoll_fd);
 	logit ("Server exited");
 	log_close ();
 }
@@ -512,11 +567,61 @@ static void send_ev_mixer(int where = -1)
 	int v = audio_get_mixer();
 
 	if (where == -1)
+	{
+		last_mixer = v;
 		add_event_all(EV_MIXER_CHANGE, name, v);
+	}
 	else
 		add_event(clients[where], EV_MIXER_CHANGE, name, v);
 }
 
+/* Send EV_MIXER_VALUE if the volume changed, which includes changes from
+ * other programs. Only checks every MIXER_CHECK_INTERVAL unless forced. */
+static void check_mixer (bool force = false)
+{
+	double t = now();
+	if (!force && t < next_mixer_check) return;
+	next_mixer_check = t + MIXER_CHECK_INTERVAL / 1000.0;
+
+	int v = audio_get_mixer();
+	if (v == last_mixer) return;
+	last_mixer = v;
+	add_event_all(EV_MIXER_VALUE, v);
+}
+
+/* Send EV_STATE with everything that goes with it. This runs in the server
+ * thread because state_change() gets called with the playlist locked. */
+static void send_state ()
+{
+	if (!state_changed.exchange(false)) return;
+
+	str path; int idx; audio_get_current(path, idx);
+	int st = audio_get_state();
+	int t = MAX(0, audio_get_time());
+	status_set_state (st, t, idx, path);
+
+	for (int i = 0; i < CLIENTS_MAX; i++)
+	{
+		client &cli = clients[i];
+		if (!cli.socket) continue;
+		Lock lock(cli);
+		auto &sock = *cli.socket;
+		sock.packet(EV_STATE);
+		sock.send(st);
+		sock.send(t);
+		sock.send(idx);
+		sock.send(path);
+		sock.finish();
+	}
+}
+
+static bool have_clients ()
+{
+	for (int i = 0; i < CLIENTS_MAX; i++)
+		if (clients[i].socket) return true;
+	return false;
+}
+
 /* Receive a command from the client and execute it. */
 static void handle_command (const int client_id)
 {
@@ -535,7 +640,7 @@ static void handle_command (const int client_id)
 				del_client (client_id);
 				server_quit = 1;
 				break;
-			case CMD_PING: cli.socket->send(EV_PONG); break;
+			case CMD_PING: { Lock lock(cli); cli.socket->send(EV_PONG); } break;
 
 			case CMD_PLAY:
 			{
@@ -552,9 +657,8 @@ static void handle_command (const int client_id)
 				}
 				else
 				{
-					plist pl, tmp; pl += std::move(file);
-					cli.socket->get(tmp); pl += std::move(tmp);
-					if (idx >= pl.size())
+					plist pl; cli.socket->get(pl);
+					if (idx >= pl.size() || pl[idx].path != file)
 					{
 						logit("Invalid play index %d for given playlist of size %d", idx, (int)pl.size());
 						break;
@@ -593,9 +697,10 @@ static void handle_command (const int client_id)
 			}
 			case CMD_PLIST_GET:
 			{
+				uint32_t version; cli.socket->get(version);
 				Lock lock(cli);
 				cli.socket->send(EV_DATA); 
-				audio_send_plist(*cli.socket);
+				audio_send_plist(*cli.socket, version);
 				break;
 			}
 			case CMD_PLIST_MOVE:
@@ -660,7 +765,10 @@ static void handle_command (const int client_id)
 			case CMD_SET_OPTION_SHUFFLE: options::Shuffle  = cli.socket->get_bool(); send_ev_options(); break;
 			case CMD_SET_OPTION_REPEAT:  options::Repeat   = (RepeatType)cli.socket->get_int(); send_ev_options(); break;
 			case CMD_GET_MIXER: send_data_int(&cli, audio_get_mixer()); break;
-			case CMD_SET_MIXER: audio_set_mixer(cli.socket->get_int()); break;
+			case CMD_SET_MIXER:
+				audio_set_mixer(cli.socket->get_int());
+				check_mixer(true);
+				break;
 			case CMD_TOGGLE_MIXER_CHANNEL:
 				audio_toggle_mixer_channel ();
 				send_ev_mixer();
@@ -678,6 +786,58 @@ static void handle_command (const int client_id)
 				tc->add_request(file.c_str(), client_id);
 				break;
 			}
+			case CMD_GET_FILE_TAGS_BATCH:
+			{
+				strings files; std::vector<time_t> mtimes;
+				while (true)
+				{
+					str f = cli.socket->get_str(); if (f.empty()) break;
+					int64_t mtime; cli.socket->get(mtime);
+					files.push_back(std::move(f));
+					mtimes.push_back((time_t)mtime);
+				}
+				debug ("Request for tags of %d files", (int)files.size());
+				tc->add_batch_request(files, mtimes, client_id);
+				break;
+			}
+			case CMD_LIBRARY_LIST:
+			{
+				str dir = cli.socket->get_str();
+				std::vector<std::pair<str, time_t>> files;
+				bool found = library_list(dir, files);
+				debug ("Library has %d files in %s", (int)files.size(), dir.c_str());
+
+				Lock lock(cli);
+				auto &sock = *cli.socket;
+				sock.buffer();
+				sock.send(EV_DATA);
+				sock.send(found);
+				// Without a watch on the directory, a file could have been
+				// changed in place since the library saw it. Then the tags
+				// cache has to stat() it.
+				str last_dir; bool verified = false;
+				for (auto &f : files)
+				{
+					str d = containing_directory(f.first);
+					if (d != last_dir) { verified = dir_watch_verified(f.first); last_dir.swap(d); }
+					sock.send(f.first);
+					sock.send((int64_t)(verified ? f.second : (time_t)-1));
+				}
+				sock.send("");
+				sock.flush();
+				break;
+			}
+			case CMD_WATCH_DIR:
+			{
+				str dir = cli.socket->get_str();
+				LOCK (cli.events_mtx);
+				dir.swap(cli.dir);
+				UNLOCK (cli.events_mtx);
+				if (dir == cli.dir) break;
+				if (!dir.empty()) dir_watch_hide (dir);
+				if (!cli.dir.empty()) dir_watch_show (cli.dir);
+				break;
+			}
 
 			case CMD_SET_FILE_TAGS:
 			{
@@ -725,37 +885,22 @@ static void handle_command (const int client_id)
 	}
 }
 
-/* Add clients file descriptors to fds. */
-static void add_clients_fds (fd_set *read, fd_set *write)
+/* Is there anything to read on fd (or an EOF or error that reading would
+ * run into)? */
+static bool readable (int fd)
 {
-	for (int i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket) {
-			FD_SET (clients[i].socket->fd(), read);
-			LOCK (clients[i].events_mtx);
-			if (clients[i].socket->pending())
-				FD_SET (clients[i].socket->fd(), write);
-			UNLOCK (clients[i].events_mtx);
-		}
+	char c;
+	ssize_t res = recv (fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return !(res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
 }
 
-/* Return the maximum fd from clients and the argument. */
-static int max_fd (int max)
+/* Handle all commands that client i sent. Its socket is edge-triggered, so
+ * we have to read until there is nothing left (in the socket and in what
+ * Socket already received). */
+static void handle_client (int i)
 {
-	if (wake_up_pipe[0] > max)
-		max = wake_up_pipe[0];
-
-	for (int i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket && clients[i].socket->fd() > max)
-			max = clients[i].socket->fd();
-	return max;
-}
-
-/* Handle clients whose fds are ready to read. */
-static void handle_clients (fd_set *fds)
-{
-	for (int i = 0; i < CLIENTS_MAX; i++)
-		if (clients[i].socket && FD_ISSET(clients[i].socket->fd(), fds))
-			handle_command (i);
+	while (clients[i].socket && (clients[i].socket->buffered() || readable(clients[i].socket->fd())))
+		handle_command (i);
 }
 
 /* Close all client connections sending EV_EXIT. */
@@ -766,6 +911,7 @@ static void close_clients ()
 	for (i = 0; i < CLIENTS_MAX; i++)
 		if (clients[i].socket) {
 			try {
+				Lock lock(clients[i]);
 				clients[i].socket->send(EV_EXIT);
 			} catch (...) {}
 			del_client (i);
@@ -782,24 +928,23 @@ void server_loop ()
 
 	assert (server_sock != -1);
 
+	struct epoll_event events[CLIENTS_MAX + 2];
+
 	while (true)
 	{
-		fd_set fds_write, fds_read;
-		FD_ZERO (&fds_read);
-		FD_ZERO (&fds_write);
-		FD_SET (server_sock, &fds_read);
-		FD_SET (wake_up_pipe[0], &fds_read);
-		add_clients_fds (&fds_read, &fds_write);
-
-		int res = select (max_fd(server_sock)+1, &fds_read, &fds_write, NULL, NULL);
+		int n = epoll_wait (epoll_fd, events, CLIENTS_MAX + 2,
+				have_clients() ? MIXER_CHECK_INTERVAL : -1);
 
 		if (server_quit) break;
 
-		if (res == -1 && errno != EINTR)
-			fatal ("pselect() failed: %s", xstrerror (errno));
+		if (n == -1 && errno != EINTR)
+			fatal ("epoll_wait() failed: %s", xstrerror (errno));
+
+		for (int k = 0; k < n; ++k)
+		{
+			const uint32_t id = events[k].data.u32;
 
-		if (res >= 0) {
-			if (FD_ISSET(server_sock, &fds_read)) {
+			if (id == EP_LISTEN) {
 				int client_sock;
 
 				debug ("accept()ing connection...");
@@ -818,20 +963,28 @@ void server_loop ()
 					close (client_sock);
 				}
 			}
-
-			if (FD_ISSET(wake_up_pipe[0], &fds_read)) {
+			else if (id == EP_WAKE_UP) {
 				SOCKET_DEBUG("Got 'wake up'");
 
-				int w;
-				if (read(wake_up_pipe[0], &w, sizeof(w)) < 0)
+				eventfd_t w;
+				if (eventfd_read (wake_up_fd, &w) < 0 && errno != EAGAIN)
 					fatal ("Can't read wake up signal: %s", xstrerror (errno));
-			}
 
-			send_events (&fds_write);
-			handle_clients (&fds_read);
+				send_state ();
+				for (int i = 0; i < CLIENTS_MAX; i++)
+					send_events (i);
+			}
+			else {
+				assert (id < CLIENTS_MAX);
+				if (events[k].events & EPOLLOUT)
+					send_events (id);
+				if (events[k].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+					handle_client (id);
+			}
 		}
 
 		if (server_quit) break;
+		if (have_clients()) check_mixer ();
 	}
 
 	logit ("Exiting...");
@@ -846,6 +999,7 @@ void set_info_bitrate (const int bitrate)
 {
 	if (sound_info.bitrate == bitrate) return;
 	sound_info.bitrate = bitrate;
+	status_set_info (sound_info.bitrate, sound_info.avg_bitrate, sound_info.rate, sound_info.channels);
 	add_event_all (EV_BITRATE, sound_info.bitrate);
 }
 
@@ -853,6 +1007,7 @@ void set_info_channels (const int channels)
 {
 	if (sound_info.channels == channels) return;
 	sound_info.channels = channels;
+	status_set_info (sound_info.bitrate, sound_info.avg_bitrate, sound_info.rate, sound_info.channels);
 	add_event_all (EV_CHANNELS, sound_info.channels);
 }
 
@@ -860,6 +1015,7 @@ void set_info_rate (const int rate)
 {
 	if (sound_info.rate == rate) return;
 	sound_info.rate = rate;
+	status_set_info (sound_info.bitrate, sound_info.avg_bitrate, sound_info.rate, sound_info.channels);
 	add_event_all (EV_RATE, sound_info.rate);
 }
 
@@ -867,18 +1023,22 @@ void set_info_avg_bitrate (const int avg_bitrate)
 {
 	if (sound_info.avg_bitrate == avg_bitrate) return;
 	sound_info.avg_bitrate = avg_bitrate;
+	status_set_info (sound_info.bitrate, sound_info.avg_bitrate, sound_info.rate, sound_info.channels);
 	add_event_all (EV_AVG_BITRATE, sound_info.avg_bitrate);
 }
 
 /* Notify the client about change of the player state. */
 void state_change ()
 {
-	add_event_all (EV_STATE);
+	state_changed = true;
+	wake_up_server ();
 }
 
 void ctime_change ()
 {
-	add_event_all (EV_CTIME, (int)MAX(0, audio_get_time()));
+	int t = MAX(0, audio_get_time());
+	status_set_time (t);
+	add_event_all (EV_CTIME, t);
 }
 
 void status_msg (const str &msg)
@@ -898,3 +1058,77 @@ void tags_response (const int client_id, const str &file, const file_tags *tags)
 		wake_up_server ();
 	}
 }
+
+/* Send what was collected by tags_batch_response(). Must hold events_mtx. */
+static void send_tags_batch (client &cli)
+{
+	if (cli.tags_batch.empty()) return;
+
+	auto &sock = *cli.socket;
+	sock.packet(EV_FILE_TAGS_BATCH);
+	for (auto &t : cli.tags_batch)
+	{
+		sock.send(t.first);
+		sock.send(&t.second);
+	}
+	sock.send("");
+	sock.finish();
+	cli.tags_batch.clear();
+}
+
+/* Like tags_response(), but for a batch request: the tags are sent in
+ * chunks of TAGS_BATCH_CHUNK, the rest when tags_batch_done() is called. */
+void tags_batch_response (const int client_id, const str &file, const file_tags *tags)
+{
+	assert (tags != NULL);
+	assert (LIMIT(client_id, CLIENTS_MAX));
+
+	client &cli = clients[client_id];
+	if (!cli.socket) return;
+
+	LOCK (cli.events_mtx);
+	if (cli.socket) cli.tags_batch.emplace_back(file, *tags);
+	bool full = (cli.tags_batch.size() >= TAGS_BATCH_CHUNK);
+	if (full) send_tags_batch (cli);
+	UNLOCK (cli.events_mtx);
+
+	if (full) wake_up_server ();
+}
+
+void tags_batch_done (const int client_id)
+{
+	assert (LIMIT(client_id, CLIENTS_MAX));
+
+	client &cli = clients[client_id];
+	if (!cli.socket) return;
+
+	LOCK (cli.events_mtx);
+	bool any = cli.socket && !cli.tags_batch.empty();
+	if (any) send_tags_batch (cli);
+	UNLOCK (cli.events_mtx);
+
+	if (any) wake_up_server ();
+}
+
+/* Called by the dir watch thread. */
+void dir_changed (const str &dir, const strings &files)
+{
+	bool added = false;
+
+	for (auto &cli : clients)
+	{
+		LOCK (cli.events_mtx);
+		if (cli.socket && cli.dir == dir)
+		{
+			auto &sock = *cli.socket;
+			sock.packet(EV_DIR_CHANGED);
+			sock.send(dir);
+			sock.send(files);
+			sock.finish();
+			added = true;
+		}
+		UNLOCK (cli.events_mtx);
+	}
+
+	if (added) wake_up_server ();
+}
@@ -3,7 +3,7 @@
 
 #include "../playlist.h"
 
-#define CLIENTS_MAX 3
+#define CLIENTS_MAX 32
 
 enum PlayState : int
 {
@@ -24,5 +24,8 @@ void tags_change ();
 void ctime_change ();
 void status_msg (const str &msg);
 void tags_response (const int client_id, const str &file, const file_tags *tags);
+void tags_batch_response (const int client_id, const str &file, const file_tags *tags);
+void tags_batch_done (const int client_id);
+void dir_changed (const str &dir, const strings &files);
 
 #endif
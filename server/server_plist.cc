@@ -5,7 +5,7 @@
 #define IT       S(dir, i)
 
 ServerPlaylist::ServerPlaylist()
-: i0(-1), i1(-1), dir(false), nv{0,0}
+: i0(-1), i1(-1), id1(0), dir(false), nv{0,0}
 {}
 
 void ServerPlaylist::play(plist &&p, int i)
@@ -33,6 +33,8 @@ void ServerPlaylist::play(song s, bool restarting)
 {
 	dir = s.first;
 	i1 = s.second;
+	auto &p = dir ? dir_plist : playlist;
+	id1 = (i1 >= 0 && i1 < (int)p.size()) ? p.items[i1]->id : 0;
 	logit("Playlist: playing song (%s,%d)%s", dir ? "dir" : "lst", i1, restarting ? " with restart" : "");
 	if (restarting)
 	{
@@ -45,7 +47,7 @@ void ServerPlaylist::invalidate(const str &path)
 	auto &p = dir ? dir_plist : playlist;
 	auto &n = nv[dir];
 	// check current song first
-	if (i1 >= 0 || i1 < p.size())
+	if (i1 >= 0 && i1 < p.size())
 	{
 		auto &it = *p.items[i1];
 		if (it.path == path && valid_type(it.type))
@@ -182,6 +184,28 @@ ServerPlaylist::song ServerPlaylist::next(bool force) const
 	assert(false); nv[dir] = 0; return NIL;
 }
 
+void ServerPlaylist::upcoming(int n, std::vector<str> &paths) const
+{
+	paths.clear();
+	if (n <= 0) return;
+	song s = next();
+	if (s.second == -1) return;
+	str p0 = path(s);
+	if (!p0.empty()) paths.push_back(p0);
+	if (options::Repeat == REPEAT_ONE) return;
+
+	// look further ahead, but don't wrap around (that would reshuffle)
+	auto &p = dir ? dir_plist : playlist;
+	const int N = p.size();
+	if (options::Shuffle && (int)order.size() != N) return;
+	int k = options::Shuffle ? order_inv[s.second] : s.second;
+	while ((int)paths.size() < n && ++k < N)
+	{
+		int i = options::Shuffle ? order[k] : k;
+		if (VALID(i)) paths.push_back(p.items[i]->path);
+	}
+}
+
 ServerPlaylist::song ServerPlaylist::prev() const
 {
 	if (!nv[dir]) return NIL;
@@ -208,7 +232,7 @@ ServerPlaylist::song ServerPlaylist::prev() const
 void ServerPlaylist::clear()
 {
 	playlist.clear();
-	if (!dir) i1 = -1;
+	if (!dir) { i1 = -1; id1 = 0; order.clear(); order_inv.clear(); }
 	nv[0] = 0;
 }
 void ServerPlaylist::add(const str &path)
@@ -219,35 +243,77 @@ void ServerPlaylist::add(const str &path)
 }
 void ServerPlaylist::add(const plist &pl, int idx)
 {
+	auto ids = shuffled();
 	if (idx < 0)
 		playlist += pl;
 	else
-	{
 		playlist.insert(pl, idx);
-		if (i1 >= idx) i1 += pl.size();
-	}
 
-	for (auto &it : pl.items) if (valid_type(it->type)) ++nv[0];
+	edited(ids, i1 >= idx && idx >= 0 ? i1 + (int)pl.size() : i1);
 }
 void ServerPlaylist::remove(int i, int n)
 {
+	auto ids = shuffled();
 	playlist.remove(i, n);
-	if (!dir)
-	{
-		if (i1 >= i) i1 -= std::min(n, i1-i);
-	}
-	// TODO: shuffle and make sure i1 != i
+	edited(ids, i1 >= i ? i1 - std::min(n, i1-i) : i1);
 }
 void ServerPlaylist::move(int i, int j)
 {
-	playlist.move(i, j); if (!dir && i == i1 && i != -1) i1 = j; 
-	// TODO: shuffle...
+	auto ids = shuffled();
+	playlist.move(i, j);
+	edited(ids, i1);
 }
 
 void ServerPlaylist::remove(const std::set<str> &files)
 {
-	playlist.remove(files);
-	// TODO: shuffle, current song, dir_plist...
+	auto ids = shuffled();
+	int k = playlist.remove(files, dir ? -1 : i1);
+	edited(ids, k);
+}
+
+std::vector<uint64_t> ServerPlaylist::shuffled() const
+{
+	std::vector<uint64_t> ids;
+	if (dir || order.size() != playlist.size()) return ids;
+	ids.reserve(order.size());
+	for (int i : order) ids.push_back(playlist.items[i]->id);
+	return ids;
+}
+
+/* Items are found again by their ids, because their indices changed and
+ * the same file can be on the playlist more than once. fallback is where
+ * the current song would be by index, in case it was removed. */
+void ServerPlaylist::edited(const std::vector<uint64_t> &ids, int fallback)
+{
+	nv[0] = 0; for (auto &it : playlist.items) if (valid_type(it->type)) ++nv[0];
+	if (dir) return; // order and i1 are for dir_plist
+
+	const int n = (int)playlist.size();
+	int k = id1 ? playlist.find_id(id1) : -1;
+	i1 = (k >= 0 ? k : fallback);
+
+	order.clear(); order_inv.clear();
+	if (ids.empty()) return; // reshuffled when needed
+
+	// keep the order of what was played, new items go somewhere after
+	// the current song
+	std::vector<bool> seen(n, false);
+	int c = 0;
+	for (uint64_t id : ids)
+	{
+		int j = playlist.find_id(id);
+		if (j < 0) continue;
+		seen[j] = true;
+		order.push_back(j);
+		if (j == k) c = (int)order.size();
+	}
+	bool added = false;
+	for (int j = 0; j < n; ++j)
+		if (!seen[j]) { order.push_back(j); added = true; }
+	if (added) for (int i = (int)order.size() - 1; i > c; --i)
+		std::swap(order[i], order[c + random_int(i - c)]);
+	order_inv.resize(n);
+	for (int j = 0; j < n; ++j) order_inv[order[j]] = j;
 }
 
 void ServerPlaylist::rename(const str &file, const str &dst)
@@ -258,6 +324,7 @@ void ServerPlaylist::rename(const str &file, const str &dst)
 		if (file != playlist[i].path) continue;
 		playlist[i].path = dst;
 	}
+	playlist.changed();
 }
 
 void ServerPlaylist::move(const std::set<str> &files, const str &dst)
@@ -269,4 +336,5 @@ void ServerPlaylist::move(const std::set<str> &files, const str &dst)
 		str p = add_path(dst, file_name(playlist[i].path));
 		playlist[i].path = p;
 	}
+	playlist.changed();
 }
@@ -30,6 +30,7 @@ public:
 	bool stopped() const { return i1 == -1; }
 
 	song next(bool force = false) const; // force ignores Repeat and AutoNext
+	void upcoming(int n, std::vector<str> &paths) const; // up to n files after current, for precaching
 	song prev() const;
 	song current() const { return S(dir, i1); }
 
@@ -56,10 +57,13 @@ private:
 	song first() const;
 	song last() const;
 	void reshuffle(int first_item) const;
+	std::vector<uint64_t> shuffled() const; // order as item ids, before editing playlist
+	void edited(const std::vector<uint64_t> &shuffled, int fallback); // after editing it
 
 	plist playlist, dir_plist; // items with type F_OTHER are considered invalid and never returned!
 	mutable int  i0; // current song, before shuffling
 	int  i1;  // current song, after shuffling
+	uint64_t id1; // id of the current song, to find it again after edits
 	bool dir; // currently in dir_plist? current() returns (dir,i1)
 	str  cwd; // source of dir_plist
 	mutable int nv[2]; // number of valid items in the lists
@@ -0,0 +1,130 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+
+#include "status_shm.h"
+#include "server.h"
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "Shared seqlock needs lock free atomics.");
+
+static status_shm *shm = NULL;
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER; // one writer at a time
+
+/* Change shm->info with f under the seqlock. */
+template<typename F> static void update (F f)
+{
+	if (!shm) return;
+	LockGuard g(mtx);
+	uint32_t s = shm->seq.load(std::memory_order_relaxed);
+	shm->seq.store(s + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	f(shm->info);
+	shm->seq.store(s + 2, std::memory_order_release);
+}
+
+static void set_path (status_info &info, const str &path)
+{
+	size_t n = std::min(path.length(), sizeof(info.path) - 1);
+	memcpy(info.path, path.data(), n);
+	info.path[n] = 0;
+}
+
+void status_init ()
+{
+	assert (!shm);
+	str path = options::run_file_path(STATUS_FILE), tmp = path + ".tmp";
+
+	// a new file, so readers of an old one don't see it change size
+	int fd = open (tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) { log_errno ("Can't create the status file", errno); return; }
+	void *p = MAP_FAILED;
+	if (ftruncate (fd, sizeof(status_shm)) == 0)
+		p = mmap (NULL, sizeof(status_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+	{
+		log_errno ("Can't map the status file", errno);
+		close (fd);
+		unlink (tmp.c_str());
+		return;
+	}
+	close (fd);
+
+	auto *s = (status_shm *)p; // all zero
+	s->size = sizeof(status_shm);
+	s->info.pid = getpid();
+	s->info.state = STATE_STOP;
+	s->info.bitrate = s->info.avg_bitrate = s->info.rate = s->info.channels = -1;
+	s->info.idx = -1;
+	s->magic.store(STATUS_MAGIC, std::memory_order_release);
+
+	if (rename (tmp.c_str(), path.c_str()) != 0)
+	{
+		log_errno ("Can't create the status file", errno);
+		munmap (p, sizeof(status_shm));
+		unlink (tmp.c_str());
+		return;
+	}
+	shm = s;
+}
+
+void status_exit ()
+{
+	if (!shm) return;
+	update([](status_info &i){ i.pid = 0; i.state = STATE_STOP; });
+	unlink (options::run_file_path(STATUS_FILE).c_str());
+	munmap (shm, sizeof(status_shm));
+	shm = NULL;
+}
+
+void status_set_time (int sec)
+{
+	update([=](status_info &i){ i.time = sec; });
+}
+
+void status_set_state (int state, int sec, int idx, const str &path)
+{
+	update([&](status_info &i){ i.state = state; i.time = sec; i.idx = idx; set_path(i, path); });
+}
+
+void status_set_info (int bitrate, int avg_bitrate, int rate, int channels)
+{
+	update([=](status_info &i)
+	{
+		i.bitrate = bitrate; i.avg_bitrate = avg_bitrate;
+		i.rate = rate; i.channels = channels;
+	});
+}
+
+bool status_read (status_info &info)
+{
+	int fd = open (options::run_file_path(STATUS_FILE).c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return false;
+	struct stat st;
+	void *p = MAP_FAILED;
+	if (fstat (fd, &st) == 0 && st.st_size == sizeof(status_shm))
+		p = mmap (NULL, sizeof(status_shm), PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (p == MAP_FAILED) return false;
+
+	const auto *s = (const status_shm *)p;
+	bool ok = false;
+	if (s->magic.load(std::memory_order_acquire) == STATUS_MAGIC && s->size == sizeof(status_shm))
+	{
+		for (int tries = 0; tries < 1000; ++tries)
+		{
+			uint32_t s0 = s->seq.load(std::memory_order_acquire);
+			if (s0 & 1) { sched_yield(); continue; }
+			memcpy (&info, &s->info, sizeof(info));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (s->seq.load(std::memory_order_relaxed) != s0) continue;
+			ok = true;
+			break;
+		}
+	}
+	munmap (p, sizeof(status_shm));
+
+	info.path[sizeof(info.path) - 1] = 0;
+	return ok && info.pid > 0 && (kill (info.pid, 0) == 0 || errno == EPERM);
+}
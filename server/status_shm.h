@@ -0,0 +1,52 @@
+#pragma once
+#include <atomic>
+
+/* The status file: the server keeps what CMD_GET_STATE, CMD_GET_CTIME,
+ * CMD_GET_BITRATE etc. would answer in RunDir/status, which it has mapped
+ * into memory. Status bars and scripts can map it read-only and look at
+ * it as often as they like, without connecting to the server (which
+ * takes up one of its CLIENTS_MAX slots) and without any syscalls.
+ *
+ * It is written under a seqlock: seq is odd while the server changes
+ * info. Readers copy info and check that seq was even before and is the
+ * same after, else they try again. See status_read().
+ *
+ * A new server replaces the file, and an exiting one sets info.pid to 0.
+ * Readers that keep the mapping should map it again when that happens
+ * (or when the process info.pid is gone because the server crashed).
+ */
+
+#define STATUS_FILE	"status"
+#define STATUS_MAGIC	0x54534d41 /* "AMST" */
+
+struct status_info
+{
+	int32_t pid;      // of the server, 0 after it exited
+	int32_t state;    // PlayState
+	int32_t time;     // into the current song, in seconds
+	int32_t bitrate;  // the ones below are -1 if unknown
+	int32_t avg_bitrate;
+	int32_t rate;
+	int32_t channels;
+	int32_t idx;      // of the current song in the playlist, -1 if none
+	char    path[4096]; // of the current song, "" if none
+};
+
+struct status_shm
+{
+	std::atomic<uint32_t> magic; // STATUS_MAGIC once the rest is set up
+	uint32_t size;               // sizeof(status_shm)
+	std::atomic<uint32_t> seq;
+	status_info info;
+};
+
+/* Server side, the setters can be called from any thread. */
+void status_init ();
+void status_exit ();
+void status_set_time (int sec);
+void status_set_state (int state, int sec, int idx, const str &path);
+void status_set_info (int bitrate, int avg_bitrate, int rate, int channels);
+
+/* Read the status of a running server. Returns false if there is none
+ * (or it has no status file). */
+bool status_read (status_info &info);
@@ -4,13 +4,15 @@
 #include "audio.h"
 #include "input/decoder.h"
 #include "ratings.h"
+#include "dir_watch.h"
 #include <pthread.h>
 #include <sys/stat.h>
 
 /* Read the selected tags for this file and add it to the cache.
- * If client_id != -1, the server is notified using tags_response().
+ * If client_id != -1, the server is notified using tags_response()
+ * (or tags_batch_response() for batch requests).
  * If client_id == -1, copy of file_tags is returned. */
-file_tags tags_cache::read_add (const str &file, int client_id)
+file_tags tags_cache::read_add (const str &file, int client_id, bool batch, time_t current_mtime)
 {
 	debug ("Getting tags for %s", file);
 
@@ -20,25 +22,37 @@ file_tags tags_cache::read_add (const str &file, int client_id)
 	/* If this entry is already present in the cache, we have 3 options:
 	 * we must read different tags (TAGS_*) or the tags are outdated
 	 * or this is an immediate tags read (client_id == -1) */
-	time_t current_mtime = get_mtime (file);
+	bool stated = (current_mtime == (time_t)-1);
+	if (stated) current_mtime = get_mtime (file);
 	if (rec)
 	{
 		if (rec.mod_time == current_mtime)
 		{
 			debug ("Cache hit.");
+			if (client_id != -1)
+			{
+				if (batch) tags_batch_response (client_id, file, &rec.tags);
+				else       tags_response (client_id, file, &rec.tags);
+			}
 			return std::move(rec.tags);
 		}
 		debug ("Tags in the cache are outdated");
 	}
 
+	// what is on disk, not what the caller thought it was (and before
+	// reading, so a change while we read is noticed next time)
+	rec.mod_time = stated ? current_mtime : get_mtime (file);
 	auto *df = get_decoder (file);
 	if (df) df->read_tags(file, rec.tags);
 	rec.tags.rating = ratings_read(file);
-	rec.mod_time = current_mtime;
 
 	db->add(file, rec);
 
-	if (client_id != -1) tags_response (client_id, file, &rec.tags);
+	if (client_id != -1)
+	{
+		if (batch) tags_batch_response (client_id, file, &rec.tags);
+		else       tags_response (client_id, file, &rec.tags);
+	}
 
 	return std::move(rec.tags);
 }
@@ -105,6 +119,47 @@ void tags_cache::ratings_changed(const str &file, int rating)
 	db->add(file, rec);
 }
 
+void tags_cache::invalidate (const str &file)
+{
+	auto lock = db->lock(file);
+	db->remove(file);
+}
+
+void tags_cache::validate (const str &file, time_t mtime)
+{
+	auto lock = db->lock(file);
+	auto rec = db->get(file);
+	if (rec && rec.mod_time != mtime)
+	{
+		debug ("Dropping outdated tags for %s", file.c_str());
+		db->remove(file);
+	}
+}
+
+/* Take the next request, mutex must be locked. Requests for single files
+ * (what the client needs right now) go before batch requests and clients
+ * take turns within each kind. */
+bool tags_cache::next_request (int &client, Request &rq)
+{
+	for (request_queue *Q : {queues, batch_queues})
+	{
+		for (int k = 0; k < CLIENTS_MAX; ++k)
+		{
+			int i = (next_client + k) % CLIENTS_MAX;
+			auto &q = Q[i];
+			if (q.empty()) continue;
+
+			client = i;
+			rq = std::move(q.front());
+			q.pop();
+			if (rq.batch) ++batch_active[i];
+			next_client = (i + 1) % CLIENTS_MAX;
+			return true;
+		}
+	}
+	return false;
+}
+
 void *tags_cache::reader_thread(void *cache_ptr)
 {
 	logit ("Tags reader thread started");
@@ -112,30 +167,30 @@ void *tags_cache::reader_thread(void *cache_ptr)
 	tags_cache *c = (tags_cache *)cache_ptr;
 	LOCK (c->mutex);
 
-	for (int client = 0, last_client = 0; !c->stop_reader_thread; )
+	while (!c->stop_reader_thread)
 	{
-		++client; client %= CLIENTS_MAX;
-		auto &q = c->queues[client];
-		if (!q.empty())
-		{
-			last_client = client;
-			auto &rq = q.front();
-			str file = rq.path;
-			tag_changes *tags = rq.tags.release();
-			q.pop();
-			UNLOCK (c->mutex);
-			if (!tags)
-				c->read_add (file, client);
-			else
-				c->write_add(file, tags, client);
-			LOCK (c->mutex);
-		}
-		else if (client == last_client)
+		int client; Request rq;
+		if (!c->next_request(client, rq))
 		{
 			debug ("All queues empty, waiting");
 			pthread_cond_wait (&c->request_cond, &c->mutex);
 			continue;
 		}
+
+		UNLOCK (c->mutex);
+		if (!rq.tags)
+			c->read_add (rq.path, client, rq.batch, rq.mtime);
+		else
+			c->write_add(rq.path, rq.tags.release(), client);
+		LOCK (c->mutex);
+
+		// send the collected batch when nothing more is coming for it
+		if (rq.batch && !--c->batch_active[client] && c->batch_queues[client].empty())
+		{
+			UNLOCK (c->mutex);
+			tags_batch_done (client);
+			LOCK (c->mutex);
+		}
 	}
 
 	UNLOCK (c->mutex);
@@ -145,18 +200,17 @@ void *tags_cache::reader_thread(void *cache_ptr)
 }
 
 tags_cache::tags_cache()
-: stop_reader_thread(false)
+: stop_reader_thread(false), next_client(0)
 , db(NULL)
 {
+	for (int &n : batch_active) n = 0;
 	pthread_mutex_init (&mutex, NULL);
 	int rc = pthread_cond_init (&request_cond, NULL);
 	if (rc != 0) fatal ("Can't create request_cond: %s", xstrerror (rc));
-	rc = pthread_create (&reader_thread_id, NULL, reader_thread, this);
-	if (rc != 0) fatal ("Can't create tags cache thread: %s", xstrerror (rc));
 
 	try
 	{
-		db = new tags_db;
+		db = tags_db::open();
 	}
 	catch(std::exception &e)
 	{
@@ -165,21 +219,36 @@ tags_cache::tags_cache()
 		db = NULL;
 		fatal("Can't create tags_db: %s", e.what());
 	}
+
+	int n = options::TagReaderThreads;
+	if (n <= 0) n = std::max(2L, sysconf(_SC_NPROCESSORS_ONLN));
+	n = std::min(n, 64);
+	for (int i = 0; i < n; ++i)
+	{
+		pthread_t tid;
+		rc = pthread_create (&tid, NULL, reader_thread, this);
+		if (rc != 0) fatal ("Can't create tags cache thread: %s", xstrerror (rc));
+		reader_threads.push_back(tid);
+	}
+	logit ("Started %d tag reader threads", n);
 }
 
 tags_cache::~tags_cache()
 {
 	LOCK (mutex);
 	stop_reader_thread = true;
-	pthread_cond_signal (&request_cond);
+	pthread_cond_broadcast (&request_cond);
 	UNLOCK (mutex);
 
-	delete db;
+	for (pthread_t tid : reader_threads)
+	{
+		int rc = pthread_join (tid, NULL);
+		if (rc != 0) fatal ("pthread_join() on cache reader thread failed: %s", xstrerror (rc));
+	}
 
-	int rc = pthread_join (reader_thread_id, NULL);
-	if (rc != 0) fatal ("pthread_join() on cache reader thread failed: %s", xstrerror (rc));
+	delete db;
 
-	rc = pthread_mutex_destroy (&mutex);
+	int rc = pthread_mutex_destroy (&mutex);
 	if (rc != 0) log_errno ("Can't destroy mutex", rc);
 	rc = pthread_cond_destroy (&request_cond);
 	if (rc != 0) log_errno ("Can't destroy request_cond", rc);
@@ -189,13 +258,15 @@ void tags_cache::add_request (const str &file, int client_id, tag_changes *tags)
 {
 	assert (LIMIT(client_id, CLIENTS_MAX));
 
+	time_t mtime = (time_t)-1;
 	if (!tags)
 	{
 		debug ("Request for tags for '%s' from client %d", file.c_str(), client_id);
 
 		auto rec = db->get(file);
 		if (rec) {
-			if (rec.mod_time == get_mtime(file)) {
+			mtime = dir_watch_verified(file) ? rec.mod_time : get_mtime(file);
+			if (rec.mod_time == mtime) {
 				tags_response (client_id, file, &rec.tags);
 				debug ("Tags are present in the cache");
 				return;
@@ -205,25 +276,72 @@ void tags_cache::add_request (const str &file, int client_id, tag_changes *tags)
 	}
 
 	LOCK (mutex);
-	queues[client_id].emplace(file, tags);
+	if (tags)
+		queues[client_id].emplace(file, tags);
+	else
+		queues[client_id].emplace(file, false, mtime);
 	pthread_cond_signal (&request_cond);
 	UNLOCK (mutex);
 }
 
+/* Answer what is in the cache right away (in chunks), queue the rest.
+ * mtimes are what the client got when it listed the files. They are only
+ * used for files in watched directories (where a change would have been
+ * noticed), so those cost no stat() here. The rest is stat'ed together,
+ * one directory at a time. */
+void tags_cache::add_batch_request (const strings &files, const std::vector<time_t> &mtimes, int client_id)
+{
+	assert (LIMIT(client_id, CLIENTS_MAX));
+	assert (files.size() == mtimes.size());
+
+	strings unknown;
+	std::vector<bool> watched(files.size(), false);
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		if (dir_watch_verified(files[i])) watched[i] = true;
+		else unknown.push_back(files[i]);
+	}
+	std::vector<time_t> found;
+	if (!unknown.empty()) get_mtimes(unknown, found);
+
+	std::vector<std::pair<const str*, time_t>> todo;
+	for (size_t i = 0, j = 0; i < files.size(); ++i)
+	{
+		auto &file = files[i];
+		auto rec = db->get(file);
+		time_t mtime = !watched[i] ? found[j++] :
+		               mtimes[i] != (time_t)-1 ? mtimes[i] :
+		               rec ? rec.mod_time : (time_t)-1;
+		if (rec && rec.mod_time == mtime)
+			tags_batch_response (client_id, file, &rec.tags);
+		else
+			todo.emplace_back(&file, mtime);
+	}
+	tags_batch_done (client_id);
+	debug ("%d of %d tags are present in the cache", (int)(files.size() - todo.size()), (int)files.size());
+
+	if (todo.empty()) return;
+	LOCK (mutex);
+	for (auto &f : todo) batch_queues[client_id].emplace(*f.first, true, f.second);
+	pthread_cond_broadcast (&request_cond);
+	UNLOCK (mutex);
+}
+
 void tags_cache::clear_queue (int client_id)
 {
 	assert (LIMIT(client_id, CLIENTS_MAX));
 	LOCK (mutex);
 	request_queue().swap(queues[client_id]);
+	request_queue().swap(batch_queues[client_id]);
 	debug ("Cleared requests queue for client %d", client_id);
 	UNLOCK (mutex);
 }
 
 /* Immediately read tags for a file bypassing the request queue. */
-file_tags tags_cache::get_immediate (const str &file)
+file_tags tags_cache::get_immediate (const str &file, time_t mtime)
 {
 	debug ("Immediate tags read for %s", file.c_str());
-	return read_add(file, -1);
+	return read_add(file, -1, false, mtime);
 }
 
 void tags_cache::files_rm(std::set<str> &src)
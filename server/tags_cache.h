@@ -9,9 +9,12 @@ public:
 	~tags_cache();
 
 	void add_request (const str &file, int client_id, tag_changes *tags=NULL);
-	file_tags get_immediate (const str &file);
+	void add_batch_request (const strings &files, const std::vector<time_t> &mtimes, int client_id);
+	file_tags get_immediate (const str &file, time_t mtime = (time_t)-1);
 	void ratings_changed(const str &file, int rating);
 	void clear_queue (int client_id);
+	void invalidate (const str &file); // file was changed
+	void validate (const str &file, time_t mtime); // drop the entry if it's older
 
 	void files_rm(std::set<str> &src); // unlinks all files in src, removing those that fail
 	void files_mv(std::set<str> &src, const str &dst); // move file to new directory
@@ -20,19 +23,7 @@ public:
 private:
 	tags_db *db;
 
-	struct Lock
-	{
-		Lock(tags_db &db, DBT &key);
-		Lock(const Lock &) = delete;
-		~Lock();
-		DB_LOCK lock;
-		DB_ENV *db_env;
-	};
-	friend struct Lock;
-
-	void remove_rec(const str &fname);
-	void add(DBT &key, const cache_record &rec);
-	file_tags read_add(const str &file, int client_id);
+	file_tags read_add(const str &file, int client_id, bool batch = false, time_t mtime = (time_t)-1);
 	void write_add(const str &file, tag_changes *tags, int client_id);
 	static void *reader_thread (void *cache_ptr);
 
@@ -40,13 +31,20 @@ private:
 	{
 		str path;
 		std::unique_ptr<tag_changes> tags;
-		Request(const str &p) : path(p) {}
-		Request(const str &p, tag_changes *t) : path(p), tags(t) {}
+		bool batch; // part of a CMD_GET_FILE_TAGS_BATCH
+		time_t mtime; // if we know it already, else -1
+		Request() : batch(false), mtime((time_t)-1) {}
+		Request(const str &p, bool b, time_t t) : path(p), batch(b), mtime(t) {}
+		Request(const str &p, tag_changes *t) : path(p), tags(t), batch(false), mtime((time_t)-1) {}
 	};
+	bool next_request (int &client, Request &rq);
 	typedef std::queue<Request> request_queue;
 	request_queue queues[CLIENTS_MAX]; /* requests queues for each client */
+	request_queue batch_queues[CLIENTS_MAX]; /* same for batch requests, which come after those */
+	int batch_active[CLIENTS_MAX]; /* batch requests being read right now */
+	int next_client; /* where the readers continue round-robin */
 	bool stop_reader_thread; /* request for stopping read thread (if non-zero) */
 	pthread_cond_t request_cond; /* condition for signalizing new requests */
 	pthread_mutex_t mutex; /* mutex for all above data (except db because it's thread-safe) */
-	pthread_t reader_thread_id; /* tid of the reading thread */
+	std::vector<pthread_t> reader_threads; /* tids of the reading threads */
 };
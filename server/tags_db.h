@@ -1,6 +1,5 @@
 #pragma once
 #include "../file_tags.h"
-#include <db.h>
 
 struct cache_record
 {
@@ -10,32 +9,49 @@ struct cache_record
 	file_tags tags;
 };
 
+//---------------------------------------------------------------
+// Persistent cache of file tags, keyed by path. There are two
+// backends (options::TagsCacheBackend):
+// - "snapshot": sorted, mmap'ed file plus a log of the changes
+//   since it was written (tags_snapshot.cc)
+// - "bdb": a BerkeleyDB btree (tags_bdb.cc)
+// All functions can be called from any thread.
+//---------------------------------------------------------------
+
 class tags_db
 {
 public:
-	tags_db();
-	~tags_db();
+	static tags_db *open(); // throws on errors
+	virtual ~tags_db();
 
-	void add(const str &key, const cache_record &rec);
-	cache_record get(const str &key); // mod_time -1 if not found
-	void remove(const str &key);
-	void sync();
+	virtual void add(const str &key, const cache_record &rec) = 0;
+	virtual cache_record get(const str &key) = 0; // mod_time -1 if not found
+	virtual void remove(const str &key) = 0;
+	virtual void sync() {}
 
+	// Exclusive use of one key (other keys are not affected), to keep
+	// two threads from reading the same file's tags at the same time.
 	struct Lock
 	{
-		Lock(Lock &&) = default;
+		Lock(Lock &&l) : db(l.db), key(std::move(l.key)) { l.db = NULL; }
 		Lock(const Lock &) = delete;
 		Lock(tags_db &db, const str &k);
 		~Lock();
-		DB_LOCK lock;
-		DB_ENV *db_env;
+		tags_db *db;
+		str key;
 	};
 	friend struct Lock;
 
-	Lock lock(const str &key);
+	Lock lock(const str &key) { return Lock(*this, key); }
+
+protected:
+	tags_db();
 
 private:
-	DB_ENV *db_env;
-	DB     *db;
-	u_int32_t locker;
+	pthread_mutex_t lock_mtx;
+	pthread_cond_t  lock_cond;
+	std::set<str>   locked; // keys with a Lock on them
 };
+
+tags_db *bdb_tags_db_open();
+tags_db *snapshot_tags_db_open();
@@ -0,0 +1,645 @@
+#include "tags_db.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+
+//---------------------------------------------------------------
+// The snapshot backend of the tags cache.
+//
+// tags.snap is a read-only snapshot of all records, sorted by
+// path and mmap'ed. Paths are prefix-compressed against the one
+// before, with a full path every RESTART_INTERVAL records so we
+// can binary search. Title, artist and album are stored once in
+// a string pool and referenced by offset.
+//
+// Changes go to an in-memory delta and are appended to tags.log.
+// When the delta gets big, a background thread merges it into a
+// new snapshot and drops what was merged from the delta and the
+// log. On startup, the snapshot is mapped and the log replayed.
+// There is nothing to recover, a damaged file is just dropped
+// (it's only a cache).
+//---------------------------------------------------------------
+
+#define SNAP_FILE	"tags.snap"
+#define LOG_FILE	"tags.log"
+
+/* If you change any of the formats below, change the last digit. */
+#define SNAP_MAGIC	"amocTS\0\1"
+
+#define RESTART_INTERVAL 16
+#define COMPACT_AT	4096 /* delta size that triggers a compaction */
+
+struct snap_header
+{
+	char     magic[8];
+	uint32_t count;		/* number of records */
+	uint32_t nrestarts;
+	uint64_t pool_off, pool_size;
+	uint64_t records_off, records_size;
+	uint64_t restarts_off;	/* nrestarts uint64_t offsets into records */
+};
+
+/* Fixed part of a record, follows the path. Strings are offsets into the
+ * pool. */
+struct snap_fields
+{
+	int64_t  mod_time;
+	uint32_t title, artist, album;
+	int32_t  track, time, rating;
+};
+
+static void put_varint (std::vector<char> &out, uint64_t v)
+{
+	while (v >= 0x80) { out.push_back((char)(v | 0x80)); v >>= 7; }
+	out.push_back((char)v);
+}
+static const char *get_varint (const char *p, const char *end, uint64_t &v)
+{
+	v = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7)
+	{
+		uint8_t b = *p++;
+		v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) return p;
+	}
+	return NULL;
+}
+
+//---------------------------------------------------------------
+// Snapshot: one mapped tags.snap
+//---------------------------------------------------------------
+
+struct Snapshot
+{
+	Snapshot() : map(NULL), size(0), h(NULL) {}
+	~Snapshot() { if (map) munmap(map, size); }
+	bool load(const str &path);
+
+	bool find(const str &key, cache_record &rec) const;
+	template<typename F> void for_each(F f) const; // f(str &&path, cache_record &&rec)
+
+	void  *map;
+	size_t size;
+	const snap_header *h;
+	const char *pool, *records, *records_end;
+	const uint64_t *restarts;
+
+private:
+	const char *decode(const char *p, str &key, snap_fields &f) const;
+	std::string_view restart_key(uint32_t i) const;
+	void fill(const snap_fields &f, cache_record &rec) const;
+	const char *string(uint32_t off) const { return off < h->pool_size ? pool + off : ""; }
+};
+
+bool Snapshot::load(const str &path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(snap_header))
+	{
+		close(fd);
+		return false;
+	}
+	size = st.st_size;
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) { map = NULL; return false; }
+	madvise(map, size, MADV_RANDOM);
+
+	h = (const snap_header*)map;
+	if (memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) != 0
+	 || h->pool_off > size || h->pool_size > size - h->pool_off
+	 || h->records_off > size || h->records_size > size - h->records_off
+	 || h->restarts_off > size || h->nrestarts > (size - h->restarts_off) / sizeof(uint64_t)
+	 || (h->pool_size && ((const char*)map)[h->pool_off + h->pool_size - 1] != 0))
+	{
+		logit ("Ignoring broken or outdated tags snapshot");
+		return false;
+	}
+
+	pool = (const char*)map + h->pool_off;
+	records = (const char*)map + h->records_off;
+	records_end = records + h->records_size;
+	restarts = (const uint64_t*)((const char*)map + h->restarts_off);
+	for (uint32_t i = 0; i < h->nrestarts; ++i)
+		if (restarts[i] >= h->records_size) return false;
+	return true;
+}
+
+/* Decode the record at p, whose path shares a prefix with key (which is
+ * the previous path). Returns the next record or NULL on errors. */
+const char *Snapshot::decode(const char *p, str &key, snap_fields &f) const
+{
+	uint64_t shared, unshared;
+	if (!(p = get_varint(p, records_end, shared))) return NULL;
+	if (!(p = get_varint(p, records_end, unshared))) return NULL;
+	if (shared > key.length() || unshared > (uint64_t)(records_end - p)) return NULL;
+	key.resize(shared);
+	key.append(p, unshared); p += unshared;
+	if ((size_t)(records_end - p) < sizeof(f)) return NULL;
+	memcpy(&f, p, sizeof(f));
+	return p + sizeof(f);
+}
+
+std::string_view Snapshot::restart_key(uint32_t i) const
+{
+	const char *p = records + restarts[i];
+	uint64_t shared, unshared;
+	if (!(p = get_varint(p, records_end, shared))) return {};
+	if (!(p = get_varint(p, records_end, unshared))) return {};
+	if (shared || unshared > (uint64_t)(records_end - p)) return {};
+	return std::string_view(p, unshared);
+}
+
+void Snapshot::fill(const snap_fields &f, cache_record &rec) const
+{
+	rec.mod_time = f.mod_time;
+	rec.tags.title  = string(f.title);
+	rec.tags.artist = string(f.artist);
+	rec.tags.album  = string(f.album);
+	rec.tags.track  = f.track;
+	rec.tags.time   = f.time;
+	rec.tags.rating = f.rating;
+}
+
+bool Snapshot::find(const str &key, cache_record &rec) const
+{
+	// last restart point <= key
+	uint32_t lo = 0, hi = h->nrestarts;
+	const std::string_view k(key);
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (restart_key(mid) <= k) lo = mid + 1; else hi = mid;
+	}
+	if (lo == 0) return false;
+
+	const char *p = records + restarts[lo-1];
+	str path; snap_fields f;
+	for (int i = 0; i < RESTART_INTERVAL && p && p < records_end; ++i)
+	{
+		p = decode(p, path, f);
+		if (!p) break;
+		int c = path.compare(key);
+		if (c > 0) break;
+		if (c == 0) { fill(f, rec); return true; }
+	}
+	return false;
+}
+
+template<typename F> void Snapshot::for_each(F fn) const
+{
+	const char *p = records;
+	str path; snap_fields f;
+	for (uint32_t i = 0; i < h->count && p < records_end; ++i)
+	{
+		p = decode(p, path, f);
+		if (!p) { logit ("Tags snapshot is damaged after %u records", i); return; }
+		cache_record rec;
+		fill(f, rec);
+		fn(str(path), std::move(rec));
+	}
+}
+
+/* Write the records (sorted by path) into a new snapshot file. */
+static bool write_snapshot (const str &path, const std::vector<std::pair<str, cache_record>> &recs)
+{
+	std::vector<char> pool, records;
+	std::vector<uint64_t> restarts;
+	std::unordered_map<str, uint32_t> interned;
+
+	auto intern = [&](const str &s) -> uint32_t
+	{
+		auto it = interned.find(s);
+		if (it != interned.end()) return it->second;
+		uint32_t off = pool.size();
+		pool.insert(pool.end(), s.c_str(), s.c_str() + s.length() + 1);
+		interned.emplace(s, off);
+		return off;
+	};
+	intern(""); // offset 0
+
+	const str *prev = NULL;
+	for (size_t i = 0; i < recs.size(); ++i)
+	{
+		const str &key = recs[i].first;
+		const cache_record &rec = recs[i].second;
+
+		size_t shared = 0;
+		if (i % RESTART_INTERVAL == 0)
+			restarts.push_back(records.size());
+		else
+			while (shared < key.length() && shared < prev->length() && key[shared] == (*prev)[shared]) ++shared;
+
+		put_varint(records, shared);
+		put_varint(records, key.length() - shared);
+		records.insert(records.end(), key.begin() + shared, key.end());
+
+		snap_fields f;
+		memset(&f, 0, sizeof(f));
+		f.mod_time = rec.mod_time;
+		f.title    = intern(rec.tags.title);
+		f.artist   = intern(rec.tags.artist);
+		f.album    = intern(rec.tags.album);
+		f.track    = rec.tags.track;
+		f.time     = rec.tags.time;
+		f.rating   = rec.tags.rating;
+		records.insert(records.end(), (const char*)&f, (const char*)&f + sizeof(f));
+		prev = &key;
+	}
+
+	snap_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SNAP_MAGIC, sizeof(h.magic));
+	h.count = recs.size();
+	h.nrestarts = restarts.size();
+	h.pool_off = sizeof(h);
+	h.pool_size = pool.size();
+	h.records_off = h.pool_off + h.pool_size;
+	h.records_size = records.size();
+	h.restarts_off = (h.records_off + h.records_size + 7) & ~(uint64_t)7;
+	const size_t pad = h.restarts_off - h.records_off - h.records_size;
+
+	str tmp = path + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (!f) { log_errno ("Can't write tags snapshot", errno); return false; }
+	static const char zeros[8] = {0};
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1
+		&& fwrite(pool.data(), 1, pool.size(), f) == pool.size()
+		&& fwrite(records.data(), 1, records.size(), f) == records.size()
+		&& fwrite(zeros, 1, pad, f) == pad
+		&& fwrite(restarts.data(), sizeof(uint64_t), restarts.size(), f) == restarts.size()
+		&& fflush(f) == 0 && fdatasync(fileno(f)) == 0;
+	if (fclose(f) != 0) ok = false;
+	if (ok && rename(tmp.c_str(), path.c_str()) != 0) ok = false;
+	if (!ok)
+	{
+		log_errno ("Writing tags snapshot failed", errno);
+		unlink(tmp.c_str());
+	}
+	return ok;
+}
+
+//---------------------------------------------------------------
+// Delta log records: u32 size, u8 op, then the fields
+//---------------------------------------------------------------
+
+enum { LOG_ADD = 1, LOG_REMOVE = 2 };
+
+static void log_put_str (std::vector<char> &out, const str &s)
+{
+	uint32_t n = s.length();
+	out.insert(out.end(), (const char*)&n, (const char*)&n + sizeof(n));
+	out.insert(out.end(), s.begin(), s.end());
+}
+template<typename T> static void log_put (std::vector<char> &out, T x)
+{
+	out.insert(out.end(), (const char*)&x, (const char*)&x + sizeof(x));
+}
+
+static void log_encode (std::vector<char> &out, const str &key, const cache_record &rec)
+{
+	size_t start = out.size();
+	log_put<uint32_t>(out, 0); // size, set below
+	log_put<uint8_t>(out, rec ? LOG_ADD : LOG_REMOVE);
+	log_put_str(out, key);
+	if (rec)
+	{
+		log_put<int64_t>(out, rec.mod_time);
+		log_put_str(out, rec.tags.title);
+		log_put_str(out, rec.tags.artist);
+		log_put_str(out, rec.tags.album);
+		log_put<int32_t>(out, rec.tags.track);
+		log_put<int32_t>(out, rec.tags.time);
+		log_put<int32_t>(out, rec.tags.rating);
+	}
+	uint32_t n = out.size() - start - sizeof(uint32_t);
+	memcpy(&out[start], &n, sizeof(n));
+}
+
+/* Decode one record of size n at p. False if it's broken. */
+static bool log_decode (const char *p, size_t n, str &key, cache_record &rec)
+{
+	const char *end = p + n;
+	auto get_str = [&](str &s) -> bool
+	{
+		uint32_t len;
+		if ((size_t)(end - p) < sizeof(len)) return false;
+		memcpy(&len, p, sizeof(len)); p += sizeof(len);
+		if ((size_t)(end - p) < len) return false;
+		s.assign(p, len); p += len;
+		return true;
+	};
+	auto get_num = [&](auto &x) -> bool
+	{
+		if ((size_t)(end - p) < sizeof(x)) return false;
+		memcpy(&x, p, sizeof(x)); p += sizeof(x);
+		return true;
+	};
+
+	uint8_t op;
+	if (!get_num(op) || !get_str(key)) return false;
+	if (op == LOG_REMOVE) { rec.mod_time = -1; return p == end; }
+	if (op != LOG_ADD) return false;
+
+	int64_t mt; int32_t track, time, rating;
+	if (!get_num(mt) || !get_str(rec.tags.title) || !get_str(rec.tags.artist)
+	 || !get_str(rec.tags.album) || !get_num(track) || !get_num(time)
+	 || !get_num(rating)) return false;
+	rec.mod_time = mt;
+	rec.tags.track = track;
+	rec.tags.time = time;
+	rec.tags.rating = rating;
+	return p == end;
+}
+
+//---------------------------------------------------------------
+// snapshot_tags_db
+//---------------------------------------------------------------
+
+class snapshot_tags_db : public tags_db
+{
+public:
+	snapshot_tags_db();
+	~snapshot_tags_db();
+
+	void add(const str &key, const cache_record &rec) override;
+	cache_record get(const str &key) override;
+	void remove(const str &key) override;
+
+private:
+	void change(const str &key, const cache_record &rec);
+	void replay_log();
+	void compact();
+	static void *compact_thread(void *db_ptr);
+
+	str snap_path, log_path;
+
+	// Readers load this with std::atomic_load, compact() replaces it.
+	std::shared_ptr<const Snapshot> snap;
+
+	struct Delta { cache_record rec; uint64_t seq; }; // rec.mod_time -1: removed
+	std::unordered_map<str, Delta> delta;
+	uint64_t seq; // of the last change
+	int log_fd;
+	pthread_rwlock_t delta_lock; // for delta, seq and log_fd
+
+	pthread_t tid;
+	pthread_mutex_t compact_mtx;
+	pthread_cond_t compact_cond;
+	bool compact_requested, stop;
+};
+
+tags_db *snapshot_tags_db_open()
+{
+	return new snapshot_tags_db;
+}
+
+snapshot_tags_db::snapshot_tags_db()
+: snap_path(options::run_file_path(SNAP_FILE))
+, log_path(options::run_file_path(LOG_FILE))
+, seq(0), log_fd(-1)
+, compact_requested(false), stop(false)
+{
+	pthread_rwlock_init (&delta_lock, NULL);
+	pthread_mutex_init (&compact_mtx, NULL);
+	pthread_cond_init (&compact_cond, NULL);
+
+	auto s = std::make_shared<Snapshot>();
+	if (s->load(snap_path))
+	{
+		logit ("Tags snapshot with %u records", s->h->count);
+		snap = s;
+	}
+
+	replay_log();
+
+	log_fd = ::open(log_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (log_fd < 0)
+	{
+		log_errno ("Can't open tags log", errno);
+		throw std::runtime_error("Can't open tags log");
+	}
+
+	int rc = pthread_create (&tid, NULL, compact_thread, this);
+	if (rc != 0) fatal ("Can't create tags compaction thread: %s", xstrerror (rc));
+
+	if (delta.size() >= COMPACT_AT)
+	{
+		LockGuard g(compact_mtx);
+		compact_requested = true;
+		pthread_cond_signal (&compact_cond);
+	}
+}
+
+snapshot_tags_db::~snapshot_tags_db()
+{
+	LOCK (compact_mtx);
+	stop = true;
+	pthread_cond_signal (&compact_cond);
+	UNLOCK (compact_mtx);
+
+	int rc = pthread_join (tid, NULL);
+	if (rc != 0) log_errno ("pthread_join() on tags compaction thread failed", rc);
+
+	// leave a clean snapshot for the next start
+	if (!delta.empty()) compact();
+
+	if (log_fd >= 0) close (log_fd);
+	pthread_rwlock_destroy (&delta_lock);
+	pthread_mutex_destroy (&compact_mtx);
+	pthread_cond_destroy (&compact_cond);
+}
+
+void snapshot_tags_db::replay_log()
+{
+	int fd = ::open(log_path.c_str(), O_RDWR | O_CLOEXEC);
+	if (fd < 0) return;
+
+	std::vector<char> buf;
+	struct stat st;
+	bool whole = false; // read all of it
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+	{
+		buf.resize(st.st_size);
+		size_t got = 0;
+		while (got < buf.size())
+		{
+			ssize_t n = read(fd, &buf[got], buf.size() - got);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) break;
+			got += n;
+		}
+		whole = (got == buf.size());
+		buf.resize(got);
+	}
+
+	size_t pos = 0, count = 0;
+	while (buf.size() - pos >= sizeof(uint32_t))
+	{
+		uint32_t n; memcpy(&n, &buf[pos], sizeof(n));
+		if (buf.size() - pos - sizeof(n) < n) break; // torn write at the end
+		str key; cache_record rec;
+		if (!log_decode(&buf[pos + sizeof(n)], n, key, rec)) break;
+		delta[key] = Delta{std::move(rec), ++seq};
+		pos += sizeof(n) + n;
+		++count;
+	}
+	if (pos != buf.size())
+	{
+		logit ("Ignoring the damaged end of the tags log");
+		// else new records would be appended after it and lost on the next replay
+		if (whole && ftruncate(fd, pos) != 0)
+			log_errno ("Can't truncate the tags log", errno);
+	}
+	close (fd);
+	if (count) logit ("Replayed %zu changes from the tags log", count);
+}
+
+cache_record snapshot_tags_db::get(const str &key)
+{
+	debug ("Getting tags for %s", key.c_str());
+	cache_record rec;
+
+	pthread_rwlock_rdlock (&delta_lock);
+	auto it = delta.find(key);
+	if (it != delta.end())
+	{
+		rec = it->second.rec;
+		pthread_rwlock_unlock (&delta_lock);
+		return rec; // mod_time -1 if it was removed
+	}
+	pthread_rwlock_unlock (&delta_lock);
+
+	// Anything that is not in the delta (anymore) is in this one.
+	auto s = std::atomic_load(&snap);
+	if (!s || !s->find(key, rec)) rec.mod_time = -1;
+	return rec;
+}
+
+void snapshot_tags_db::change(const str &key, const cache_record &rec)
+{
+	std::vector<char> buf;
+	log_encode(buf, key, rec);
+
+	pthread_rwlock_wrlock (&delta_lock);
+	delta[key] = Delta{rec, ++seq};
+	if (write(log_fd, buf.data(), buf.size()) != (ssize_t)buf.size())
+		log_errno ("Writing tags log failed", errno);
+	bool big = (delta.size() >= COMPACT_AT);
+	pthread_rwlock_unlock (&delta_lock);
+
+	if (big)
+	{
+		LockGuard g(compact_mtx);
+		compact_requested = true;
+		pthread_cond_signal (&compact_cond);
+	}
+}
+
+void snapshot_tags_db::add(const str &key, const cache_record &rec)
+{
+	debug ("Adding/updating cache object");
+	assert (rec);
+	change(key, rec);
+}
+
+void snapshot_tags_db::remove(const str &key)
+{
+	debug ("Removing %s from the cache...", key.c_str());
+	cache_record rec; rec.mod_time = -1;
+	change(key, rec);
+}
+
+/* Merge the delta into a new snapshot. Lookups keep working meanwhile and
+ * only wait for the short swap at the end. */
+void snapshot_tags_db::compact()
+{
+	std::vector<std::pair<str, Delta>> d;
+	uint64_t upto;
+	pthread_rwlock_rdlock (&delta_lock);
+	d.assign(delta.begin(), delta.end());
+	upto = seq;
+	pthread_rwlock_unlock (&delta_lock);
+	if (d.empty()) return;
+
+	std::sort(d.begin(), d.end(), [](auto &a, auto &b){ return a.first < b.first; });
+
+	std::vector<std::pair<str, cache_record>> recs;
+	auto old = std::atomic_load(&snap);
+	size_t j = 0;
+	auto emit_delta_upto = [&](const str *key) // delta entries < key (all if NULL)
+	{
+		for (; j < d.size() && (!key || d[j].first < *key); ++j)
+			if (d[j].second.rec) recs.emplace_back(d[j].first, d[j].second.rec);
+	};
+	if (old) old->for_each([&](str &&key, cache_record &&rec)
+	{
+		emit_delta_upto(&key);
+		if (j < d.size() && d[j].first == key) return; // replaced by the delta
+		recs.emplace_back(std::move(key), std::move(rec));
+	});
+	emit_delta_upto(NULL);
+
+	auto s = std::make_shared<Snapshot>();
+	if (!write_snapshot(snap_path, recs) || !s->load(snap_path))
+	{
+		logit ("Tags compaction failed");
+		return;
+	}
+
+	// swap it in and drop what was merged (unless it changed since)
+	pthread_rwlock_wrlock (&delta_lock);
+	std::atomic_store(&snap, std::shared_ptr<const Snapshot>(s));
+	for (auto it = delta.begin(); it != delta.end(); )
+		if (it->second.seq <= upto) it = delta.erase(it); else ++it;
+
+	std::vector<char> buf;
+	for (auto &e : delta) log_encode(buf, e.first, e.second.rec);
+	str tmp = log_path + ".tmp";
+	int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd >= 0 && write(fd, buf.data(), buf.size()) == (ssize_t)buf.size()
+	 && rename(tmp.c_str(), log_path.c_str()) == 0)
+	{
+		close (fd);
+		fd = ::open(log_path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+		if (fd >= 0) { close (log_fd); log_fd = fd; }
+	}
+	else
+	{
+		// the old log still has everything, which is fine
+		log_errno ("Can't rewrite tags log", errno);
+		if (fd >= 0) close (fd);
+		unlink (tmp.c_str());
+	}
+	size_t left = delta.size();
+	pthread_rwlock_unlock (&delta_lock);
+
+	logit ("Compacted tags cache: %zu records, %zu changes left", recs.size(), left);
+}
+
+void *snapshot_tags_db::compact_thread(void *db_ptr)
+{
+	snapshot_tags_db *db = (snapshot_tags_db*)db_ptr;
+
+	LOCK (db->compact_mtx);
+	while (!db->stop)
+	{
+		if (!db->compact_requested)
+		{
+			pthread_cond_wait (&db->compact_cond, &db->compact_mtx);
+			continue;
+		}
+		db->compact_requested = false;
+		UNLOCK (db->compact_mtx);
+		db->compact();
+		LOCK (db->compact_mtx);
+	}
+	UNLOCK (db->compact_mtx);
+	return NULL;
+}